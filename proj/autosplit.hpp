@@ -0,0 +1,191 @@
+/*
+ * Split of the workers of mainffa2a picked while running (-A 1).
+ *
+ * How many of the l+w workers should be L-Workers depends on the workload:
+ * splitting a mapped file is almost free, hashing its blocks (-H 1), mapping
+ * them one by one or reading them with io_uring (-M, -U) is not, and
+ * decompressing is much cheaper than compressing for the R-Workers. Instead
+ * of guessing -l and -w:
+ *
+ *  -   the threads of up to AUTO_MAX_L_SHARE of the workers as L-Workers and of
+ *      all but one of them as R-Workers are started, only activeL L-Workers
+ *      and activeR R-Workers (-l and -w at the start) work, the others are
+ *      parked: a parked L-Worker waits on a condition variable before taking
+ *      the next file, a parked R-Worker gets no blocks (the L-Workers send
+ *      each block to the least loaded active one) and sleeps on its queue;
+ *  -   every worker counts the time it spends working, not the time waiting
+ *      for files, credits or a full queue (WorkerClock);
+ *  -   AUTO_WINDOW_MS after the start the l+w workers are split between the
+ *      two sets in proportion to the time each set has been busy, the
+ *      surplus threads are parked and the choice is printed at the end.
+ *
+ * If the workers have been mostly idle in the window (the disk or the walker
+ * is the bottleneck) or the files are over before it, the split is kept.
+ */
+
+#if !defined _AUTOSPLIT_HPP
+#define _AUTOSPLIT_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+static const long   AUTO_WINDOW_MS   = 300;   // measured before picking the split
+static const double AUTO_MAX_L_SHARE = 0.5;   // L-Worker threads started, share of the workers
+static const double AUTO_MIN_BUSY    = 0.05;  // below this utilisation the split is kept
+
+static inline uint64_t autoNow() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// the time a worker has been working. Run covers a unit of work, Pause the
+// waits inside it; the tuner also reads the time of the unit in progress.
+struct WorkerClock {
+    std::atomic<uint64_t> busy{0};
+    std::atomic<uint64_t> since{0};   // 0 while not working
+
+    uint64_t read() const {
+        const uint64_t s = since.load(std::memory_order_relaxed);
+        return busy.load(std::memory_order_relaxed) + (s ? autoNow() - s : 0);
+    }
+    void start() { since.store(autoNow(), std::memory_order_relaxed); }
+    bool stop() {
+        const uint64_t s = since.exchange(0, std::memory_order_relaxed);
+        if (s) busy.fetch_add(autoNow() - s, std::memory_order_relaxed);
+        return s != 0;
+    }
+
+    // both do nothing without a clock (-A 0)
+    class Run {
+    public:
+        explicit Run(WorkerClock *c) : c(c) { if (c) c->start(); }
+        ~Run() { if (c) c->stop(); }
+    private:
+        WorkerClock *c;
+    };
+    class Pause {
+    public:
+        explicit Pause(WorkerClock *c) : c(c && c->stop() ? c : nullptr) {}
+        ~Pause() { if (c) c->start(); }
+    private:
+        WorkerClock *c;
+    };
+};
+
+class SplitTuner {
+public:
+    // l and r workers at the start
+    SplitTuner(size_t l, size_t r) : total(l + r), initL(l), initR(r) {
+        maxL = std::max(l, (size_t)(total * AUTO_MAX_L_SHARE));
+        maxR = total - 1;
+        lClocks = std::make_unique<WorkerClock[]>(maxL);
+        rClocks = std::make_unique<WorkerClock[]>(maxR);
+        queued  = std::make_unique<std::atomic<long>[]>(maxR);
+        for (size_t i = 0; i < maxR; ++i) queued[i] = 0;
+        activeL = l;
+        activeR = r;
+    }
+    ~SplitTuner() { stop(); }
+
+    size_t threadsL() const { return maxL; }
+    size_t threadsR() const { return maxR; }
+    WorkerClock *clockL(size_t i) { return &lClocks[i]; }
+    WorkerClock *clockR(size_t i) { return &rClocks[i]; }
+
+    void start() {
+        begin = autoNow();
+        tuner = std::thread([this] { tune(); });
+    }
+    // the files are over or an L-Worker has left: the parked ones leave too
+    void filesDone() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            over = true;
+        }
+        cv.notify_all();
+    }
+    void stop() {
+        filesDone();
+        if (tuner.joinable()) tuner.join();
+    }
+
+    // L-Worker id, before taking a file: false if it has to leave
+    bool waitActive(size_t id) {
+        if (id < activeL.load(std::memory_order_relaxed)) return true;
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [&] { return over || id < activeL.load(std::memory_order_relaxed); });
+        return id < activeL.load(std::memory_order_relaxed);
+    }
+    // the R-Worker for the next block: the active one with the fewest blocks queued
+    size_t pickR() {
+        const size_t n = activeR.load(std::memory_order_relaxed);
+        size_t best = 0;
+        for (size_t i = 1; i < n; ++i)
+            if (queued[i].load(std::memory_order_relaxed) < queued[best].load(std::memory_order_relaxed)) best = i;
+        queued[best].fetch_add(1, std::memory_order_relaxed);
+        return best;
+    }
+    // R-Worker i got a block
+    void taken(size_t i) { queued[i].fetch_sub(1, std::memory_order_relaxed); }
+
+    void print() const {
+        if (!decided) {
+            std::printf("Auto split: kept %zu L-Workers and %zu R-Workers (%s)\n", initL, initR, reason);
+            return;
+        }
+        std::printf("Auto split: %zu L-Workers, %zu R-Workers -> %zu L-Workers, %zu R-Workers (busy in the first %ld ms: L %.0f%%, R %.0f%%)\n",
+                    initL, initR, (size_t)activeL.load(), (size_t)activeR.load(), AUTO_WINDOW_MS, 100.0 * busyL, 100.0 * busyR);
+    }
+
+private:
+    void tune() {
+        std::unique_lock<std::mutex> lock(mtx);
+        if (cv.wait_for(lock, std::chrono::milliseconds(AUTO_WINDOW_MS), [&] { return over; })) {
+            reason = "the files had all been split before the end of the measure";
+            return;
+        }
+        const double window = autoNow() - begin;
+        double bl = 0, br = 0;
+        for (size_t i = 0; i < maxL; ++i) bl += lClocks[i].read();
+        for (size_t i = 0; i < maxR; ++i) br += rClocks[i].read();
+        busyL = bl / (std::max<size_t>(initL, 1) * window);
+        busyR = br / (std::max<size_t>(initR, 1) * window);
+        if (bl + br < AUTO_MIN_BUSY * total * window) {
+            reason = "the workers were mostly idle, the input is the bottleneck";
+            return;
+        }
+        // the workers go where the time has gone
+        size_t l = std::clamp<size_t>(std::lround(total * bl / (bl + br)), 1, maxL);
+        if (total - l > maxR) l = total - maxR;
+        activeL = l;
+        activeR = total - l;
+        decided = true;
+        lock.unlock();
+        cv.notify_all();
+    }
+
+    const size_t total, initL, initR;
+    size_t maxL, maxR;
+    std::unique_ptr<WorkerClock[]>       lClocks, rClocks;
+    std::unique_ptr<std::atomic<long>[]> queued;   // blocks sent to each R-Worker and not taken yet
+    std::atomic<size_t> activeL{0}, activeR{0};
+    std::mutex              mtx;
+    std::condition_variable cv;
+    bool        over = false;
+    uint64_t    begin = 0;
+    std::thread tuner;
+    // what has been decided, printed at the end
+    bool        decided = false;
+    double      busyL = 0, busyR = 0;
+    const char *reason = "";
+};
+
+#endif // _AUTOSPLIT_HPP
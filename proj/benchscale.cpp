@@ -0,0 +1,561 @@
+//
+// End-to-end scaling benchmark: generates a reproducible dataset, runs the
+// sequential, FastFlow and MPI versions over a sweep of workers/ranks and
+// prints time, MB/s, compression ratio, speedup and efficiency of each run.
+//
+// The dataset is made of a seeded stream: the same -s/-f/-e/-S give the same
+// files, byte by byte, on any machine. The file sizes follow one of
+//   tiny    many files between 512 bytes and 64 KB (log-uniform)
+//   huge    a few files (at most 4) sharing the whole size
+//   pareto  Pareto distributed sizes (alpha 1.1, from 8 KB): many small, some big
+// and the content is one of
+//   text    words of a seeded dictionary, Zipf-like frequencies (ratio ~2-3)
+//   random  incompressible bytes
+//   zero    zero-filled
+//   mixed   each 256 KB chunk is text (60%), random (25%) or zeros (15%)
+// It is generated once in <dir>/data (<dir>/data_<p> in weak mode), and
+// reused as long as <dir>/data.manifest matches the parameters.
+//
+// Each run compresses the dataset (-C 0) and then decompresses it (-D 0): the
+// decompressed files overwrite the originals and are checked against their
+// xxHash64, the archives are removed. The time is the one printed by the
+// program (so mpirun's start-up is not counted), the best of -r repetitions.
+// The speedup is relative to mainseq if it is in the list, otherwise to the
+// smallest p of the same program (taken as p times mainseq). With -x (weak
+// scaling) the dataset grows with p: the speedup is the scaled speedup and the
+// efficiency is T(1)/T(p).
+//
+// The table goes to stdout, -o file also writes it as CSV.
+//
+// Usage: ./benchscale [options]
+//   -d dir    work directory (default benchds)
+//   -s n      dataset size in Mbyte, per unit of p with -x (default 64)
+//   -f dist   file sizes: tiny, huge or pareto (default pareto)
+//   -e kind   content: text, random, zero or mixed (default mixed)
+//   -S seed   seed of the dataset (default 42)
+//   -b list   programs to run: seq,ff,mpi,mpirr,hybrid (default seq,ff,mpi)
+//   -w list   R-Workers of mainffa2a (default 1,2,4)
+//   -l n      L-Workers of mainffa2a and mainhybrid (default 2)
+//   -n list   ranks of the MPI versions (default 2,4)
+//   -W n      R-Workers of each mainhybrid process (default 2)
+//   -x        weak scaling
+//   -r n      repetitions, the best is taken (default 3)
+//   -B dir    directory of the binaries (default .)
+//   -m cmd    launcher of the MPI versions, -n p is appended (default "mpirun --oversubscribe")
+//   -a opts   extra options passed to every program (e.g. "-t 4 -L 1")
+//   -g        only generates the dataset
+//   -o file   also writes the table as CSV
+//
+// e.g. ./benchscale -s 256 -f pareto -e mixed -w 1,2,4,8 -n 2,4 -o strong.csv
+//      ./benchscale -x -s 32 -b seq,ff -w 1,2,4,8,16 -o weak.csv
+//
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <dedup.hpp>
+
+namespace fs = std::filesystem;
+
+static const size_t MB = 1024 * 1024;
+
+struct DatasetParams {
+    uint64_t    bytes;
+    std::string dist, kind;
+    uint64_t    seed;
+    std::string str() const {
+        return std::to_string(bytes) + " " + dist + " " + kind + " " + std::to_string(seed);
+    }
+};
+
+// -------------------------------------------------------------------------
+// dataset generation. Only the raw output of mt19937_64 is used (the
+// distributions of <random> differ among the standard libraries).
+class Generator {
+public:
+    explicit Generator(uint64_t seed) : gen(seed) {
+        words.resize(4096);
+        for (auto &w : words) {
+            w.resize(2 + gen() % 9);
+            for (auto &c : w) c = 'a' + gen() % 26;
+        }
+    }
+    double uniform() { return (gen() >> 11) * 0x1.0p-53; }   // [0, 1)
+
+    // the sizes of the files, bytes in total
+    std::vector<uint64_t> sizes(uint64_t bytes, const std::string &dist) {
+        std::vector<uint64_t> s;
+        uint64_t left = bytes;
+        if (dist == "huge") {
+            const uint64_t n = std::clamp<uint64_t>(bytes / (16 * MB), 1, 4);
+            for (uint64_t i = 0; i + 1 < n; ++i) {
+                const uint64_t share = (uint64_t)(bytes / n * (0.8 + 0.4 * uniform()));
+                s.push_back(share);
+                left -= share;
+            }
+        } else {
+            while (left) {
+                double x;
+                if (dist == "tiny") x = 512.0 * std::pow(2.0, 7.0 * uniform());
+                else                x = 8192.0 / std::pow(1.0 - uniform(), 1.0 / 1.1);
+                const uint64_t size = std::min<uint64_t>({(uint64_t)x, std::max<uint64_t>(bytes / 2, 1), left});
+                s.push_back(size);
+                left -= size;
+            }
+            return s;
+        }
+        s.push_back(left);
+        return s;
+    }
+
+    // len bytes of content of the given kind
+    void fill(unsigned char *p, size_t len, const std::string &kind) {
+        const size_t CHUNK = 256 * 1024;
+        for (size_t off = 0; off < len; off += CHUNK) {
+            const size_t n = std::min(CHUNK, len - off);
+            std::string k = kind;
+            if (kind == "mixed") {
+                const double u = uniform();
+                k = (u < 0.60) ? "text" : (u < 0.85) ? "random" : "zero";
+            }
+            if      (k == "zero")   std::memset(p + off, 0, n);
+            else if (k == "random") fillRandom(p + off, n);
+            else                    fillText(p + off, n);
+        }
+    }
+
+private:
+    void fillRandom(unsigned char *p, size_t n) {
+        for (size_t i = 0; i < n; i += 8) {
+            const uint64_t v = gen();
+            std::memcpy(p + i, &v, std::min<size_t>(8, n - i));
+        }
+    }
+    void fillText(unsigned char *p, size_t n) {
+        size_t i = 0, line = 0;
+        while (i < n) {
+            // the first words of the dictionary are the most frequent ones
+            const double u = uniform();
+            const std::string &w = words[(size_t)(u * u * u * words.size())];
+            for (size_t j = 0; j < w.size() && i < n; ++j) p[i++] = w[j];
+            line += w.size() + 1;
+            if (i < n) p[i++] = (line > 72) ? '\n' : ' ';
+            if (line > 72) line = 0;
+        }
+    }
+
+    std::mt19937_64 gen;
+    std::vector<std::string> words;
+};
+
+static bool readManifest(const std::string &path, std::string &line) {
+    FILE *f = std::fopen(path.c_str(), "r");
+    if (!f) return false;
+    char buf[256] = {};
+    const bool ok = std::fgets(buf, sizeof(buf), f) != nullptr;
+    std::fclose(f);
+    line = buf;
+    if (!line.empty() && line.back() == '\n') line.pop_back();
+    return ok;
+}
+
+// dir holds the dataset of p, regenerated only if the parameters changed
+static bool makeDataset(const std::string &dir, const DatasetParams &dp) {
+    const std::string manifest = dir + ".manifest";
+    std::string have;
+    if (readManifest(manifest, have) && have == dp.str() && fs::is_directory(dir)) return true;
+
+    std::error_code ec;
+    fs::remove_all(dir, ec);
+    fs::remove(manifest, ec);
+    Generator g(dp.seed);
+    const std::vector<uint64_t> sizes = g.sizes(dp.bytes, dp.dist);
+    std::fprintf(stderr, "generating %s: %zu files, %.1f MB (%s, %s, seed %lu)\n", dir.c_str(), sizes.size(),
+                 dp.bytes / (double)MB, dp.dist.c_str(), dp.kind.c_str(), (unsigned long)dp.seed);
+    std::vector<unsigned char> buf(4 * MB);
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        // at most 256 files per directory
+        char sub[32], name[32];
+        std::snprintf(sub, sizeof(sub), "d%04zu", i / 256);
+        std::snprintf(name, sizeof(name), "f%06zu.dat", i);
+        const std::string d = dir + "/" + sub;
+        fs::create_directories(d, ec);
+        if (ec) {
+            std::fprintf(stderr, "Failed to create directory %s: %s\n", d.c_str(), ec.message().c_str());
+            return false;
+        }
+        const std::string fname = d + "/" + name;
+        FILE *f = std::fopen(fname.c_str(), "wb");
+        if (!f) {
+            perror("fopen");
+            std::fprintf(stderr, "Failed to create file %s\n", fname.c_str());
+            return false;
+        }
+        for (uint64_t left = sizes[i]; left; ) {
+            const size_t n = std::min<uint64_t>(left, buf.size());
+            g.fill(buf.data(), n, dp.kind);
+            if (std::fwrite(buf.data(), 1, n, f) != n) {
+                perror("fwrite");
+                std::fclose(f);
+                return false;
+            }
+            left -= n;
+        }
+        if (std::fclose(f) != 0) {
+            perror("fclose");
+            return false;
+        }
+    }
+    FILE *m = std::fopen(manifest.c_str(), "w");
+    if (!m) {
+        perror("fopen");
+        return false;
+    }
+    std::fprintf(m, "%s\n", dp.str().c_str());
+    std::fclose(m);
+    return true;
+}
+
+// -------------------------------------------------------------------------
+// the files of a dataset, with their hash to check the decompressed ones
+
+static bool hashFile(const std::string &fname, uint64_t &h) {
+    int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return false;
+    }
+    h = xxh64(nullptr, 0);
+    if (st.st_size > 0) {
+        void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        h = xxh64((const unsigned char *)p, st.st_size);
+        munmap(p, st.st_size);
+    }
+    close(fd);
+    return true;
+}
+
+// the hash of every file of dir (not the archives), false if one cannot be read
+static bool hashDataset(const std::string &dir, std::map<std::string, uint64_t> &hashes) {
+    hashes.clear();
+    for (const auto &e : fs::recursive_directory_iterator(dir)) {
+        if (!e.is_regular_file() || e.path().extension() == ".zip") continue;
+        uint64_t h;
+        if (!hashFile(e.path().string(), h)) return false;
+        hashes[e.path().string()] = h;
+    }
+    return true;
+}
+
+// removes the archives of dir, returns their total size
+static uint64_t removeArchives(const std::string &dir) {
+    uint64_t bytes = 0;
+    std::vector<fs::path> zips;
+    for (const auto &e : fs::recursive_directory_iterator(dir))
+        if (e.is_regular_file() && e.path().extension() == ".zip") {
+            bytes += e.file_size();
+            zips.push_back(e.path());
+        }
+    for (const auto &z : zips) fs::remove(z);
+    return bytes;
+}
+
+// -------------------------------------------------------------------------
+// running the programs
+
+static std::string quote(const std::string &s) {
+    std::string q = "'";
+    for (char c : s) q += (c == '\'') ? std::string("'\\''") : std::string(1, c);
+    return q + "'";
+}
+
+// runs cmd, ms is the time it prints ("Time: x (ms)" or "Elapsed time: x milliseconds."),
+// the wall-clock time if it prints none
+static bool runCommand(const std::string &cmd, double &ms) {
+    const auto t0 = std::chrono::steady_clock::now();
+    FILE *p = popen((cmd + " 2>&1").c_str(), "r");
+    if (!p) {
+        perror("popen");
+        return false;
+    }
+    std::string out;
+    char buf[4096];
+    size_t n;
+    while ((n = std::fread(buf, 1, sizeof(buf), p)) > 0) out.append(buf, n);
+    const int status = pclose(p);
+    ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    if (status != 0) {
+        std::fprintf(stderr, "command failed (status %d): %s\n%s", status, cmd.c_str(), out.c_str());
+        return false;
+    }
+    size_t at;
+    if ((at = out.find("Elapsed time: ")) != std::string::npos) ms = std::atof(out.c_str() + at + 14);
+    else if ((at = out.find("Time: ")) != std::string::npos) ms = std::atof(out.c_str() + at + 6);
+    return true;
+}
+
+struct Program {
+    std::string name;   // as in -b
+    std::string binary;
+    bool        mpi;
+};
+static const Program PROGRAMS[] = {
+    {"seq",    "mainseq",    false},
+    {"ff",     "mainffa2a",  false},
+    {"mpi",    "mainmpi",    true},
+    {"mpirr",  "mainmpirr",  true},
+    {"hybrid", "mainhybrid", true},
+};
+
+struct Options {
+    std::string dir = "benchds", bindir = ".", launcher = "mpirun --oversubscribe", extra, csv;
+    DatasetParams data{64 * MB, "pareto", "mixed", 42};
+    std::vector<std::string> programs{"seq", "ff", "mpi"};
+    std::vector<long> workers{1, 2, 4}, ranks{2, 4};
+    long lworkers = 2, hybridWorkers = 2;
+    int  reps = 3;
+    bool weak = false, genOnly = false;
+};
+
+static std::string command(const Options &o, const Program &prog, long p, const std::string &op, const std::string &dir) {
+    std::string cmd = o.bindir + "/" + prog.binary;
+    if (prog.mpi) cmd = o.launcher + " -n " + std::to_string(p) + " " + cmd;
+    if (prog.name == "ff") cmd += " -l " + std::to_string(o.lworkers) + " -w " + std::to_string(p);
+    if (prog.name == "hybrid") cmd += " -l " + std::to_string(o.lworkers) + " -w " + std::to_string(o.hybridWorkers);
+    return cmd + " -r 1 -q 1 " + op + " " + o.extra + " " + quote(dir);
+}
+
+struct Row {
+    std::string program, op;
+    long        p;
+    size_t      files;
+    uint64_t    bytes;
+    double      ms, ratio, speedup=0, efficiency=0;
+    bool        ok;
+};
+
+// -------------------------------------------------------------------------
+
+static std::vector<long> parseList(const char *s) {
+    std::vector<long> v;
+    for (const char *p = s; *p; ) {
+        char *end;
+        const long n = std::strtol(p, &end, 10);
+        if (end == p || n <= 0) return {};
+        v.push_back(n);
+        p = (*end == ',') ? end + 1 : end;
+        if (*end && *end != ',') return {};
+    }
+    return v;
+}
+
+static void usage(const char *argv0) {
+    std::printf("Usage: %s [options]\n", argv0);
+    std::printf(" -d dir    work directory (default benchds)\n");
+    std::printf(" -s n      dataset size in Mbyte, per unit of p with -x (default 64)\n");
+    std::printf(" -f dist   file sizes: tiny, huge or pareto (default pareto)\n");
+    std::printf(" -e kind   content: text, random, zero or mixed (default mixed)\n");
+    std::printf(" -S seed   seed of the dataset (default 42)\n");
+    std::printf(" -b list   programs: seq,ff,mpi,mpirr,hybrid (default seq,ff,mpi)\n");
+    std::printf(" -w list   R-Workers of mainffa2a (default 1,2,4)\n");
+    std::printf(" -l n      L-Workers of mainffa2a and mainhybrid (default 2)\n");
+    std::printf(" -n list   ranks of the MPI versions (default 2,4)\n");
+    std::printf(" -W n      R-Workers of each mainhybrid process (default 2)\n");
+    std::printf(" -x        weak scaling, the dataset grows with p\n");
+    std::printf(" -r n      repetitions, the best is taken (default 3)\n");
+    std::printf(" -B dir    directory of the binaries (default .)\n");
+    std::printf(" -m cmd    MPI launcher, -n p is appended (default \"mpirun --oversubscribe\")\n");
+    std::printf(" -a opts   extra options for every program\n");
+    std::printf(" -g        only generates the dataset\n");
+    std::printf(" -o file   also writes the table as CSV\n");
+}
+
+static bool parseCommandLine(int argc, char *argv[], Options &o) {
+    int opt;
+    while ((opt = getopt(argc, argv, "d:s:f:e:S:b:w:l:n:W:xr:B:m:a:go:h")) != -1) {
+        switch (opt) {
+        case 'd': o.dir = optarg; break;
+        case 's': o.data.bytes = std::strtoull(optarg, nullptr, 10) * MB; break;
+        case 'f': o.data.dist = optarg; break;
+        case 'e': o.data.kind = optarg; break;
+        case 'S': o.data.seed = std::strtoull(optarg, nullptr, 10); break;
+        case 'b': {
+            o.programs.clear();
+            std::string s = optarg;
+            for (size_t at = 0; at <= s.size(); ) {
+                const size_t comma = std::min(s.find(',', at), s.size());
+                o.programs.push_back(s.substr(at, comma - at));
+                at = comma + 1;
+            }
+        } break;
+        case 'w': o.workers = parseList(optarg); break;
+        case 'n': o.ranks = parseList(optarg); break;
+        case 'l': o.lworkers = std::strtol(optarg, nullptr, 10); break;
+        case 'W': o.hybridWorkers = std::strtol(optarg, nullptr, 10); break;
+        case 'x': o.weak = true; break;
+        case 'r': o.reps = std::atoi(optarg); break;
+        case 'B': o.bindir = optarg; break;
+        case 'm': o.launcher = optarg; break;
+        case 'a': o.extra = optarg; break;
+        case 'g': o.genOnly = true; break;
+        case 'o': o.csv = optarg; break;
+        default:
+            usage(argv[0]);
+            return false;
+        }
+    }
+    if (o.data.bytes == 0 || o.workers.empty() || o.ranks.empty() || o.reps <= 0 || o.lworkers <= 0 || o.hybridWorkers <= 0) {
+        std::fprintf(stderr, "Error: invalid size, list of workers/ranks, repetitions or workers\n");
+        usage(argv[0]);
+        return false;
+    }
+    if ((o.data.dist != "tiny" && o.data.dist != "huge" && o.data.dist != "pareto") ||
+        (o.data.kind != "text" && o.data.kind != "random" && o.data.kind != "zero" && o.data.kind != "mixed")) {
+        std::fprintf(stderr, "Error: unknown file size distribution or content\n");
+        usage(argv[0]);
+        return false;
+    }
+    for (const auto &name : o.programs) {
+        if (std::none_of(std::begin(PROGRAMS), std::end(PROGRAMS), [&](const Program &p) { return p.name == name; })) {
+            std::fprintf(stderr, "Error: unknown program %s\n", name.c_str());
+            usage(argv[0]);
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    Options o;
+    if (!parseCommandLine(argc, argv, o)) return -1;
+    std::error_code ec;
+    fs::create_directories(o.dir, ec);
+    o.dir = fs::absolute(o.dir).string();
+
+    // the dataset of p: the same one in strong scaling, p times the size in weak scaling
+    std::map<long, std::string> datasets;
+    auto dataset = [&](long p) -> const std::string * {
+        const long unit = o.weak ? p : 0;
+        auto it = datasets.find(unit);
+        if (it != datasets.end()) return &it->second;
+        DatasetParams dp = o.data;
+        std::string dir = o.dir + "/data";
+        if (o.weak) {
+            dp.bytes *= p;
+            dir += "_" + std::to_string(p);
+        }
+        if (!makeDataset(dir, dp)) return nullptr;
+        datasets[unit] = dir;
+        return &datasets[unit];
+    };
+
+    // the runs to do, in the order of -b
+    std::vector<std::pair<const Program*, long>> runs;
+    for (const auto &name : o.programs) {
+        const Program &prog = *std::find_if(std::begin(PROGRAMS), std::end(PROGRAMS), [&](const Program &p) { return p.name == name; });
+        if (prog.name == "seq")     runs.push_back({&prog, 1});
+        else if (prog.name == "ff") for (long w : o.workers) runs.push_back({&prog, w});
+        else                        for (long n : o.ranks)   runs.push_back({&prog, n});
+    }
+    if (o.genOnly) {
+        for (auto &r : runs)
+            if (!dataset(r.second)) return -1;
+        return 0;
+    }
+
+    std::vector<Row> rows;
+    for (auto &[prog, p] : runs) {
+        const std::string *dir = dataset(p);
+        if (!dir) return -1;
+        std::map<std::string, uint64_t> hashes;
+        if (!hashDataset(*dir, hashes)) {
+            std::fprintf(stderr, "Failed to read the dataset %s\n", dir->c_str());
+            return -1;
+        }
+        uint64_t bytes = 0;
+        for (auto &h : hashes) bytes += fs::file_size(h.first);
+        removeArchives(*dir);   // left by an interrupted run
+
+        Row c{prog->name, "compress",   p, hashes.size(), bytes, 1e30, 0, 0, 0, true};
+        Row d{prog->name, "decompress", p, hashes.size(), bytes, 1e30, 0, 0, 0, true};
+        for (int r = 0; r < o.reps && c.ok && d.ok; ++r) {
+            std::fprintf(stderr, "%s p=%ld, run %d of %d\n", prog->name.c_str(), p, r + 1, o.reps);
+            double ms;
+            if (!runCommand(command(o, *prog, p, "-C 0", *dir), ms)) c.ok = false;
+            c.ms = std::min(c.ms, ms);
+            if (!c.ok) break;
+            if (!runCommand(command(o, *prog, p, "-D 0", *dir), ms)) d.ok = false;
+            d.ms = std::min(d.ms, ms);
+            // the decompressed files have overwritten the originals
+            std::map<std::string, uint64_t> back;
+            if (d.ok && (!hashDataset(*dir, back) || back != hashes)) {
+                std::fprintf(stderr, "%s p=%ld: the decompressed files differ from the originals\n", prog->name.c_str(), p);
+                d.ok = false;
+            }
+            const uint64_t zipped = removeArchives(*dir);
+            c.ratio = d.ratio = zipped ? (double)bytes / zipped : 0.0;
+        }
+        rows.push_back(c);
+        rows.push_back(d);
+    }
+
+    // speedup and efficiency, from mainseq or from the smallest p of the same program
+    for (Row &row : rows) {
+        const Row *base = nullptr;
+        for (const Row &b : rows) {
+            if (b.op != row.op || !b.ok) continue;
+            if (b.program == "seq") { base = &b; break; }
+            if (b.program == row.program && (!base || b.p < base->p)) base = &b;
+        }
+        if (!base || !row.ok) continue;
+        const double baseP = (base->program == "seq") ? 1 : base->p;
+        // MB/s over MB/s: T(1)/T(p) in strong scaling, the scaled speedup in weak scaling
+        row.speedup    = (row.bytes / row.ms) / (base->bytes / base->ms) * baseP;
+        row.efficiency = row.speedup / row.p;
+    }
+
+    FILE *csv = nullptr;
+    if (!o.csv.empty() && !(csv = std::fopen(o.csv.c_str(), "w"))) {
+        perror("fopen");
+        std::fprintf(stderr, "Failed to create %s\n", o.csv.c_str());
+    }
+    const char *scaling = o.weak ? "weak" : "strong";
+    std::printf("dataset: %s, %s, %s, seed %lu, %.1f MB%s\n", o.data.dist.c_str(), o.data.kind.c_str(), scaling,
+                (unsigned long)o.data.seed, o.data.bytes / (double)MB, o.weak ? " per unit of p" : "");
+    std::printf("%-8s %-10s %4s %7s %10s %11s %9s %7s %8s %10s\n", "program", "op", "p", "files", "MB", "time ms", "MB/s",
+                "ratio", "speedup", "efficiency");
+    if (csv) std::fprintf(csv, "scaling,program,op,p,files,bytes,ms,mbps,ratio,speedup,efficiency,ok\n");
+    for (const Row &r : rows) {
+        const double mbps = r.ok ? r.bytes / (double)MB / (r.ms / 1000.0) : 0.0;
+        if (r.ok)
+            std::printf("%-8s %-10s %4ld %7zu %10.1f %11.1f %9.1f %7.3f %8.2f %10.2f\n", r.program.c_str(), r.op.c_str(), r.p,
+                        r.files, r.bytes / (double)MB, r.ms, mbps, r.ratio, r.speedup, r.efficiency);
+        else
+            std::printf("%-8s %-10s %4ld %7zu %10.1f %11s\n", r.program.c_str(), r.op.c_str(), r.p, r.files, r.bytes / (double)MB, "failed");
+        if (csv)
+            std::fprintf(csv, "%s,%s,%s,%ld,%zu,%lu,%.3f,%.3f,%.4f,%.4f,%.4f,%d\n", scaling, r.program.c_str(), r.op.c_str(), r.p,
+                         r.files, (unsigned long)r.bytes, r.ok ? r.ms : 0.0, mbps, r.ratio, r.speedup, r.efficiency, r.ok ? 1 : 0);
+    }
+    if (csv) std::fclose(csv);
+    return std::all_of(rows.begin(), rows.end(), [](const Row &r) { return r.ok; }) ? 0 : -1;
+}
@@ -0,0 +1,56 @@
+/*
+ * Block size of the auto mode (-t 0): a power of two picked from the sizes of
+ * the files and the number of workers.
+ *
+ * The big files are split in blocks of BIGFILE_LOW_THRESHOLD bytes, each block
+ * (or small file) is a task. Small blocks cost compression ratio and per-block
+ * overhead (tasks, messages, index entries); big blocks leave workers idle when
+ * there are only a few big files. The auto mode looks at the sizes of the files
+ * found and at the number of workers:
+ *
+ *  -   it takes the biggest power of two in [AUTO_BLOCK_MIN, AUTO_BLOCK_MAX]
+ *      that still gives at least AUTO_BLOCKS_PER_WORKER tasks per worker;
+ *  -   if not even AUTO_BLOCK_MIN does, there is not enough data to keep all
+ *      the workers busy and the efficiency floor AUTO_BLOCK_MIN is used;
+ *  -   it never goes above the size of the biggest file, bigger buffers
+ *      would only waste memory.
+ */
+
+#if !defined _BLOCKSIZE_HPP
+#define _BLOCKSIZE_HPP
+
+#include <cstdio>
+#include <algorithm>
+
+static const size_t AUTO_BLOCK_MIN         = 512 * 1024;         // efficiency floor
+static const size_t AUTO_BLOCK_MAX         = 16 * 1024 * 1024;   // every pool buffer is this big
+static const size_t AUTO_BLOCKS_PER_WORKER = 4;                  // parallel slack
+
+// n. of tasks the files are split in with blocks of blockSize bytes
+template <typename Files>
+static inline size_t countBlocks(const Files &files, size_t blockSize) {
+    size_t nblocks = 0;
+    for (const auto &f : files)
+        nblocks += (f.size <= blockSize) ? 1 : (f.size + blockSize - 1) / blockSize;
+    return nblocks;
+}
+
+// block size for the files (anything with a size member) processed by workers
+// workers; if report is true the choice is printed on stdout
+template <typename Files>
+static inline size_t autoBlockSize(const Files &files, size_t workers, bool report) {
+    size_t biggest = 0;
+    for (const auto &f : files) biggest = std::max<size_t>(biggest, f.size);
+    const size_t wanted = AUTO_BLOCKS_PER_WORKER * std::max<size_t>(1, workers);
+
+    size_t blockSize = AUTO_BLOCK_MIN;
+    while (blockSize < AUTO_BLOCK_MAX && blockSize < biggest) blockSize *= 2;
+    while (blockSize > AUTO_BLOCK_MIN && countBlocks(files, blockSize) < wanted) blockSize /= 2;
+
+    if (report)
+        std::printf("Block size: %zu KB (auto, %zu blocks for %zu workers)\n",
+                    blockSize / 1024, countBlocks(files, blockSize), std::max<size_t>(1, workers));
+    return blockSize;
+}
+
+#endif // _BLOCKSIZE_HPP
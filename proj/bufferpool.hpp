@@ -0,0 +1,153 @@
+/*
+ * Pool of fixed-size buffers carved from slabs of perSlab (8) buffers, each
+ * buffer rounded up to whole pages. A buffer belongs to the pool it was taken
+ * from and must be given back to it, not freed.
+ *
+ * Every block of a file needs an output buffer (and, in some drivers, an input
+ * copy) of at most compressBound(BIGFILE_LOW_THRESHOLD) bytes. Allocating and
+ * freeing them with new/delete for every block shows up as allocator churn and
+ * page faults on first touch. A BufferPool hands out buffers carved from big
+ * mmapped slabs that are pre-faulted when they are created and recycled through
+ * the pipeline instead of being freed.
+ *
+ *  -   Slabs are pre-faulted (MAP_POPULATE) by the thread that grows the pool.
+ *      With the default first-touch policy the pages end up on the NUMA node
+ *      of that thread, so each worker should create (and grow) its own pool.
+ *  -   If POOL_HUGEPAGES is defined, slabs are backed by huge pages: explicit
+ *      ones (MAP_HUGETLB) if reserved, transparent ones otherwise.
+ *  -   Requests bigger than the buffer size are served with new[]; put()
+ *      recognises them and frees them, so callers do not need to care.
+ *  -   get() and put() can be called by different threads (e.g. an R-Worker
+ *      gets a buffer and the Merger gives it back).
+ *  -   setSlabHook() is told about every slab, e.g. to register it with the
+ *      kernel for asynchronous I/O (see uring.hpp).
+ */
+
+#if !defined _BUFFERPOOL_HPP
+#define _BUFFERPOOL_HPP
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#if defined(POOL_HUGEPAGES)
+#define POOL_HUGEPAGES_DEFAULT true
+#else
+#define POOL_HUGEPAGES_DEFAULT false
+#endif
+
+class BufferPool {
+public:
+    // bufsize is the size of each buffer, perSlab the n. of buffers allocated
+    // at once when the pool is empty
+    BufferPool(size_t bufsize, size_t perSlab=8, bool hugepages=POOL_HUGEPAGES_DEFAULT):
+        bufSize(pageRound(bufsize)), perSlab(perSlab), hugepages(hugepages) {}
+    ~BufferPool() {
+        for (auto &slab : slabs) munmap(slab.first, slab.second);
+    }
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    // returns a buffer of at least size bytes
+    unsigned char *get(size_t size) {
+        if (size > bufSize) return new unsigned char[size];
+        std::lock_guard<std::mutex> lock(mtx);
+        if (freelist.empty() && !grow()) return new unsigned char[size];
+        unsigned char *ptr = freelist.back();
+        freelist.pop_back();
+        return ptr;
+    }
+    // gives back a buffer obtained with get
+    void put(unsigned char *ptr) {
+        if (ptr == nullptr) return;
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!owns(ptr)) {
+            delete [] ptr;
+            return;
+        }
+        freelist.push_back(ptr);
+    }
+    size_t bufferSize() const { return bufSize; }
+    // hook is called for the slabs already there and for every new one
+    void setSlabHook(std::function<void(unsigned char*, size_t)> hook) {
+        std::lock_guard<std::mutex> lock(mtx);
+        slabHook = std::move(hook);
+        for (auto &slab : slabs) slabHook(slab.first, slab.second);
+    }
+    // changes the size of the buffers (e.g. once the block size is known),
+    // all the buffers obtained with get have to be given back already
+    void reset(size_t bufsize) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (pageRound(bufsize) == bufSize) return;
+        for (auto &slab : slabs) munmap(slab.first, slab.second);
+        slabs.clear();
+        freelist.clear();
+        bufSize = pageRound(bufsize);
+    }
+
+private:
+    // buffers never share a page
+    static size_t pageRound(size_t size) {
+        static const size_t pagesize = sysconf(_SC_PAGESIZE);
+        return ((size + pagesize - 1) / pagesize) * pagesize;
+    }
+    // allocates a new slab and adds its buffers to the free list (mtx held)
+    bool grow() {
+        const size_t slabSize = bufSize * perSlab;
+        void *slab = MAP_FAILED;
+        size_t mapped = slabSize;
+#if defined(MAP_HUGETLB)
+        if (hugepages) {
+            const size_t hugepagesize = 2 * 1024 * 1024;
+            mapped = ((slabSize + hugepagesize - 1) / hugepagesize) * hugepagesize;
+            slab = mmap(nullptr, mapped, PROT_READ|PROT_WRITE,
+                        MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB|MAP_POPULATE, -1, 0);
+        }
+#endif
+        if (slab == MAP_FAILED) {
+            mapped = slabSize;
+            slab = mmap(nullptr, mapped, PROT_READ|PROT_WRITE,
+                        MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
+            if (slab == MAP_FAILED) {
+                perror("BufferPool mmap");
+                return false;
+            }
+#if defined(MADV_HUGEPAGE)
+            if (hugepages) madvise(slab, mapped, MADV_HUGEPAGE);
+#endif
+        }
+        unsigned char *base = static_cast<unsigned char*>(slab);
+        slabs.emplace(base, mapped);
+        if (slabHook) slabHook(base, mapped);
+        for (size_t i = 0; i < perSlab; ++i)
+            freelist.push_back(base + i * bufSize);
+        return true;
+    }
+    bool owns(unsigned char *ptr) const {
+        auto it = slabs.upper_bound(ptr);
+        if (it == slabs.begin()) return false;
+        --it;
+        return ptr < it->first + it->second;
+    }
+
+    size_t bufSize;
+    const size_t perSlab;
+    const bool hugepages;
+    std::mutex mtx;
+    std::vector<unsigned char*> freelist;
+    std::map<unsigned char*, size_t> slabs;  // base address -> mapped size
+    std::function<void(unsigned char*, size_t)> slabHook;
+};
+
+// gives back a buffer obtained from pool, or allocated with new[] if there is no pool
+static inline void releaseBuffer(BufferPool *pool, unsigned char *ptr) {
+    if (pool) pool->put(ptr);
+    else      delete [] ptr;
+}
+
+#endif // _BUFFERPOOL_HPP
@@ -6,17 +6,24 @@
 #include <ff/ff.hpp>
 #include <utility.hpp>
 
-// Global variables, defined elsewhere
+// some global variables. A few others are in utility.hpp -----------------------------------
+static size_t SWEEP_SAMPLE=0;  // -B, bytes of input compressed at every level, 0 normal run
 // ------------------------------------------------------------------------------------------
 
 static inline void usage(const char *argv0) {
     std::printf("--------------------\n");
     std::printf("Usage: %s [options] file-or-directory [file-or-directory]\n", argv0);
     std::printf("\nOptions:\n");
-    std::printf(" -t set the \"BIG file\" low threshold (in Mbyte -- min. and default %ld Mbyte)\n", BIGFILE_LOW_THRESHOLD / (1024 * 1024));
+    std::printf(" -t set the \"BIG file\" low threshold (in Mbyte -- min. and default %ld Mbyte, 0 auto)\n", BIGFILE_LOW_THRESHOLD / (1024 * 1024));
     std::printf(" -r 0 does not recur, 1 will process the content of all subdirectories (default r=%d)\n", RECUR ? 1 : 0);
     std::printf(" -C compress: 0 preserves, 1 removes the original file (default C=%d)\n", REMOVE_ORIGIN && comp ? 1 : 0);
     std::printf(" -D decompress: 0 preserves, 1 removes the original file (default D=%d)\n", REMOVE_ORIGIN && !comp ? 1 : 0);
+    std::printf(" -L compression level from 0 (store) to 10 (best), default is miniz's 6\n");
+    std::printf(" -Z deflate strategy: default, filtered, huffman or rle (default Z=%s)\n", STRATEGY_NAMES[STRATEGY]);
+    std::printf(" -F n restart points every n Mbyte in the blocks, they can be decompressed in parallel (default F=0, none)\n");
+    std::printf(" -H 1 the blocks of a file equal to an earlier one are stored once, without compressing them (default H=0)\n");
+    std::printf(" -T file writes a trace of the stages to file (Chrome trace JSON) and prints where the time went\n");
+    std::printf(" -B n compresses a sample of n Mbyte of the input at every level, prints MB/s and ratio, writes nothing\n");
     std::printf(" -q 0 silent mode, 1 prints only error messages to stderr, 2 verbose (default q=%d)\n", QUITE_MODE);
     std::printf(" -v 0 normal, 1 verbose for debugging (default v=%d)\n", VERBOSE);
     std::printf("--------------------\n");
@@ -24,7 +31,7 @@ static inline void usage(const char *argv0) {
 
 int parseCommandLine(int argc, char *argv[]) {
     extern char *optarg;
-    const std::string optstr = "t:r:C:D:q:v:";
+    const std::string optstr = "t:r:C:D:L:Z:F:H:T:B:q:v:";
     long opt, start = 1;
     bool cpresent = false, dpresent = false;
 
@@ -37,6 +44,12 @@ int parseCommandLine(int argc, char *argv[]) {
                     usage(argv[0]);
                     return -1;
                 }
+                // 0: auto mode, the threshold is picked once the files are known
+                if (t == 0) {
+                    AUTO_BLOCKSIZE = true;
+                    start += 2;
+                    break;
+                }
 
                 // Set the minimum threshold to 2 MB
                 t = std::max(2L, t);
@@ -85,6 +98,58 @@ int parseCommandLine(int argc, char *argv[]) {
                 comp = false; // Set mode to decompression
                 start += 2;
             } break;
+            case 'L': {
+                long l = 0;
+                if (!isNumber(optarg, l) || l < 0 || l > 10) {
+                    std::fprintf(stderr, "Error: wrong '-L' option, the level goes from 0 to 10\n");
+                    usage(argv[0]);
+                    return -1;
+                }
+                LEVEL = l;
+                start += 2;
+            } break;
+            case 'F': {
+                long f = 0;
+                if (!isNumber(optarg, f) || f < 0) {
+                    std::fprintf(stderr, "Error: wrong '-F' option\n");
+                    usage(argv[0]);
+                    return -1;
+                }
+                RESTART_INTERVAL = f * 1024 * 1024;
+                start += 2;
+            } break;
+            case 'H': {
+                long h = 0;
+                if (!isNumber(optarg, h) || h < 0 || h > 1) {
+                    std::fprintf(stderr, "Error: wrong '-H' option\n");
+                    usage(argv[0]);
+                    return -1;
+                }
+                DEDUP = (h == 1);
+                start += 2;
+            } break;
+            case 'T': {
+                traceEnable(optarg);
+                start += 2;
+            } break;
+            case 'Z': {
+                if (!parseStrategy(optarg, STRATEGY)) {
+                    std::fprintf(stderr, "Error: wrong '-Z' option\n");
+                    usage(argv[0]);
+                    return -1;
+                }
+                start += 2;
+            } break;
+            case 'B': {
+                long b = 0;
+                if (!isNumber(optarg, b) || b <= 0) {
+                    std::fprintf(stderr, "Error: wrong '-B' option\n");
+                    usage(argv[0]);
+                    return -1;
+                }
+                SWEEP_SAMPLE = b * (1024 * 1024);
+                start += 2;
+            } break;
             case 'q': {
                 long q = 0;
                 if (!isNumber(optarg, q)) {
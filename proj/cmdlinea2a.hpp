@@ -5,11 +5,19 @@
 #include <string>
 #include <ff/ff.hpp>
 #include <utility.hpp>
+#include <autosplit.hpp>
 
 // some global variables. A few others are in utility.hpp -----------------------------------
 static long lworkers=2;  // the number of left Workers
 static long rworkers=ff_numCores()-3;  // the number of right Workers
 static bool cc=false;    // concurrency control, default is blocking
+static size_t membudget=0; // in-flight memory budget (bytes) of the streaming mode, 0 disables it
+static bool   rangemode=false; // decompress only the bytes [rangeOffset, rangeOffset+rangeLength)
+static size_t rangeOffset=0;
+static size_t rangeLength=0;
+static bool   batching=false;  // the small files are sent to the R-Workers in batches
+static int    iomode=0;        // 0 blocking I/O, 1 io_uring, 2 io_uring with O_DIRECT reads (see uring.hpp)
+static bool   autosplit=false; // the split between L-Workers and R-Workers is picked while running (see autosplit.hpp)
 // ------------------------------------------------------------------------------------------
 
 static inline void usage(const char *argv0) {
@@ -18,10 +26,20 @@ static inline void usage(const char *argv0) {
     std::printf("\nOptions:\n");
     std::printf(" -l set the n. of Left Workers (default nworkers=2)\n");
     std::printf(" -w set the n. of Right Workers (default nworkers=%ld)\n", ff_numCores()-3);
-    std::printf(" -t set the \"BIG file\" low threshold (in Mbyte -- min. and default %ld Mbyte)\n",BIGFILE_LOW_THRESHOLD/(1024*1024) );
+    std::printf(" -A 1 the l+w workers are split between Left and Right Workers from their utilisation in the first %ld ms (default A=0)\n", AUTO_WINDOW_MS);
+    std::printf(" -t set the \"BIG file\" low threshold (in Mbyte -- min. and default %ld Mbyte, 0 auto)\n",BIGFILE_LOW_THRESHOLD/(1024*1024) );
+    std::printf(" -M streaming mode: in-flight memory budget in Mbyte (default M=0, the files are mapped up front)\n");
     std::printf(" -r 0 does not recur, 1 will process the content of all subdirectories (default r=0)\n");
     std::printf(" -C compress: 0 preserves, 1 removes the original file (default C=0)\n");
     std::printf(" -D decompress: 0 preserves, 1 removes the original file\n");
+    std::printf(" -R offset:length decompress only that byte range of each file into <file>.range (with -D 0)\n");
+    std::printf(" -S 0 one task per small file, 1 small files are packed in tasks of about a block (default S=0)\n");
+    std::printf(" -U 0 blocking I/O, 1 io_uring, 2 io_uring and O_DIRECT reads of the blocks in streaming mode (default U=0)\n");
+    std::printf(" -L compression level from 0 (store) to 10 (best), default is miniz's 6\n");
+    std::printf(" -Z deflate strategy: default, filtered, huffman or rle (default Z=default)\n");
+    std::printf(" -F n restart points every n Mbyte in the blocks, they can be decompressed in parallel (default F=0, none)\n");
+    std::printf(" -H 1 the blocks of a file equal to an earlier one are stored once, without compressing them (default H=0)\n");
+    std::printf(" -T file writes a trace of the stages to file (Chrome trace JSON) and prints where the time went\n");
     std::printf(" -q 0 silent mode, 1 prints only error messages to stderr, 2 verbose (default q=1)\n");
     std::printf(" -b 0 blocking, 1 non-blocking concurrency control (default b=0)\n");
     std::printf(" -v 0 normal, 1 verbose for debugging\n");
@@ -30,7 +48,7 @@ static inline void usage(const char *argv0) {
 
 int parseCommandLine(int argc, char *argv[]) {
     extern char *optarg;
-    const std::string optstr="l:w:t:r:C:D:q:a:b:v:";
+    const std::string optstr="l:w:A:t:M:r:C:D:R:S:U:L:Z:F:H:T:q:a:b:v:";
     long opt, start = 1;
     bool cpresent = false, dpresent = false;
 
@@ -56,6 +74,16 @@ int parseCommandLine(int argc, char *argv[]) {
             rworkers = w;
             start += 2;
         } break;
+        case 'A': {
+            long a = 0;
+            if (!isNumber(optarg, a) || a < 0 || a > 1) {
+                std::fprintf(stderr, "Error: wrong '-A' option\n");
+                usage(argv[0]);
+                return -1;
+            }
+            autosplit = (a == 1);
+            start += 2;
+        } break;
         case 't': {
             long t = 0;
             if (!isNumber(optarg, t)) {
@@ -63,6 +91,12 @@ int parseCommandLine(int argc, char *argv[]) {
                 usage(argv[0]);
                 return -1;
             }
+            // 0: auto mode, the threshold is picked once the files are known
+            if (t == 0) {
+                AUTO_BLOCKSIZE = true;
+                start += 2;
+                break;
+            }
 
             // Set the minimum threshold to 2 MB
             printf("t: %ld\n", t);
@@ -77,6 +111,16 @@ int parseCommandLine(int argc, char *argv[]) {
                 return -1;
             }
         } break;
+        case 'M': {
+            long m = 0;
+            if (!isNumber(optarg, m) || m < 0) {
+                std::fprintf(stderr, "Error: wrong '-M' option\n");
+                usage(argv[0]);
+                return -1;
+            }
+            membudget = m * (1024 * 1024);  // Convert MB to bytes
+            start += 2;
+        } break;
         case 'r': {
             long n = 0;
             if (!isNumber(optarg, n)) {
@@ -110,6 +154,82 @@ int parseCommandLine(int argc, char *argv[]) {
             comp = false;
             start += 2;
         } break;
+        case 'R': {
+            // offset:length, in bytes
+            const char *colon = strchr(optarg, ':');
+            long o = 0, l = 0;
+            if (!colon || !isNumber(std::string(optarg, colon - optarg).c_str(), o) || !isNumber(colon+1, l) || o < 0 || l <= 0) {
+                std::fprintf(stderr, "Error: wrong '-R' option, it should be offset:length\n");
+                usage(argv[0]);
+                return -1;
+            }
+            rangemode   = true;
+            rangeOffset = o;
+            rangeLength = l;
+            start += 2;
+        } break;
+        case 'S': {
+            long b = 0;
+            if (!isNumber(optarg, b) || b < 0 || b > 1) {
+                std::fprintf(stderr, "Error: wrong '-S' option\n");
+                usage(argv[0]);
+                return -1;
+            }
+            batching = (b == 1);
+            start += 2;
+        } break;
+        case 'U': {
+            long u = 0;
+            if (!isNumber(optarg, u) || u < 0 || u > 2) {
+                std::fprintf(stderr, "Error: wrong '-U' option\n");
+                usage(argv[0]);
+                return -1;
+            }
+            iomode = u;
+            start += 2;
+        } break;
+        case 'L': {
+            long l = 0;
+            if (!isNumber(optarg, l) || l < 0 || l > 10) {
+                std::fprintf(stderr, "Error: wrong '-L' option, the level goes from 0 to 10\n");
+                usage(argv[0]);
+                return -1;
+            }
+            LEVEL = l;
+            start += 2;
+        } break;
+        case 'F': {
+            long f = 0;
+            if (!isNumber(optarg, f) || f < 0) {
+                std::fprintf(stderr, "Error: wrong '-F' option\n");
+                usage(argv[0]);
+                return -1;
+            }
+            RESTART_INTERVAL = f * 1024 * 1024;
+            start += 2;
+        } break;
+        case 'H': {
+            long h = 0;
+            if (!isNumber(optarg, h) || h < 0 || h > 1) {
+                std::fprintf(stderr, "Error: wrong '-H' option\n");
+                usage(argv[0]);
+                return -1;
+            }
+            DEDUP = (h == 1);
+            start += 2;
+        } break;
+        case 'T': {
+            traceEnable(optarg);
+            start += 2;
+        } break;
+        case 'Z': {
+            if (!parseStrategy(optarg, STRATEGY)) {
+                std::fprintf(stderr, "Error: wrong '-Z' option\n");
+                usage(argv[0]);
+                return -1;
+            }
+            start += 2;
+        } break;
         case 'q': {
             long q = 0;
             if (!isNumber(optarg, q)) {
@@ -152,6 +272,12 @@ int parseCommandLine(int argc, char *argv[]) {
         return -1;
     }
 
+    if (rangemode && (comp || REMOVE_ORIGIN)) {
+        std::fprintf(stderr, "Error: -R can be used only with -D 0!\n");
+        usage(argv[0]);
+        return -1;
+    }
+
     if ((argc - start) <= 0) {
         std::fprintf(stderr, "Error: at least one file or directory should be provided!\n");
         usage(argv[0]);
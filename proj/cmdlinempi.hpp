@@ -5,17 +5,28 @@
 #include <utilitympi.hpp>
 
 
-
+// some global variables. The others are in utilitympi.hpp -----------------------------------
+static long lworkers=2;  // the number of left Workers of each process (mainhybrid)
+static long rworkers=std::max(1L, sysconf(_SC_NPROCESSORS_ONLN)-3);  // the number of right Workers (mainhybrid)
 // ------------------------------------------------------------------------------------------
 
 static inline void usage(const char *argv0) {
     std::printf("--------------------\n");
     std::printf("Usage: %s [options] file-or-directory [file-or-directory]\n", argv0);
     std::printf("\nOptions:\n");
-    std::printf(" -t set the \"BIG file\" low threshold (in Mbyte -- min. and default %ld Mbyte)\n", BIGFILE_LOW_THRESHOLD / (1024 * 1024));
+    std::printf(" -l set the n. of Left Workers of each process (only mainhybrid, default l=%ld)\n", lworkers);
+    std::printf(" -w set the n. of Right Workers of each process (only mainhybrid, default w=%ld)\n", rworkers);
+    std::printf(" -t set the \"BIG file\" low threshold (in Mbyte -- min. and default %ld Mbyte, 0 auto)\n", BIGFILE_LOW_THRESHOLD / (1024 * 1024));
     std::printf(" -r 0 does not recur, 1 will process the content of all subdirectories (default r=%d)\n", RECUR ? 1 : 0);
     std::printf(" -C compress: 0 preserves, 1 removes the original file (default C=%d)\n", REMOVE_ORIGIN ? 1 : 0);
     std::printf(" -D decompress: 0 preserves, 1 removes the original file\n");
+    std::printf(" -I 1 MPI-IO mode, every rank reads and writes its blocks (needs a shared filesystem, not mainhybrid, default I=%d)\n", MPIIO_MODE ? 1 : 0);
+    std::printf(" -O k on-demand scheduling, each worker keeps k blocks in flight (only mainmpirr, default O=%d static split)\n", ONDEMAND);
+    std::printf(" -L compression level from 0 (store) to 10 (best), default is miniz's 6\n");
+    std::printf(" -Z deflate strategy: default, filtered, huffman or rle (default Z=%s)\n", STRATEGY_NAMES[STRATEGY]);
+    std::printf(" -F n restart points every n Mbyte in the blocks, they can be decompressed in parallel (default F=0, none)\n");
+    std::printf(" -H 1 the blocks of a file equal to an earlier one are stored once, without compressing them (not with -I 1, default H=0)\n");
+    std::printf(" -T file writes a trace of the stages of every rank to <file>.<rank> (Chrome trace JSON) and prints where the time went\n");
     std::printf(" -q 0 silent mode, 1 prints only error messages to stderr, 2 verbose (default q=%d)\n", QUITE_MODE);
     std::printf(" -v 0 normal, 1 verbose for debugging (default v=%d)\n", VERBOSE);
     std::printf("--------------------\n");
@@ -23,13 +34,33 @@ static inline void usage(const char *argv0) {
 
 int parseCommandLine(int argc, char *argv[], int rank) {
     extern char *optarg;
-    const std::string optstr = "t:r:C:D:q:v:";
+    const std::string optstr = "l:w:t:r:C:D:I:O:L:Z:F:H:T:q:v:";
 
     long opt, start = 1;
     bool cpresent = false, dpresent = false;
 
     while ((opt = getopt(argc, argv, optstr.c_str())) != -1) {
         switch (opt) {
+            case 'l': {
+                long l = 0;
+                if (!isNumber(optarg, l) || l <= 0) {
+                    std::fprintf(stderr, "Error: wrong '-l' option\n");
+                    usage(argv[0]);
+                    return -1;
+                }
+                lworkers = l;
+                start += 2;
+            } break;
+            case 'w': {
+                long w = 0;
+                if (!isNumber(optarg, w) || w <= 0) {
+                    std::fprintf(stderr, "Error: wrong '-w' option\n");
+                    usage(argv[0]);
+                    return -1;
+                }
+                rworkers = w;
+                start += 2;
+            } break;
             case 't': {
                 long t = 0;
                 if (!isNumber(optarg, t)) {
@@ -37,6 +68,12 @@ int parseCommandLine(int argc, char *argv[], int rank) {
                     usage(argv[0]);
                     return -1;
                 }
+                // 0: auto mode, the threshold is picked once the files are known
+                if (t == 0) {
+                    AUTO_BLOCKSIZE = true;
+                    start += 2;
+                    break;
+                }
                 t = std::max(2L, t); // Ensure minimum threshold is 2 MB
                 BIGFILE_LOW_THRESHOLD = t * (1024 * 1024); // Convert MB to bytes
                 start += 2;
@@ -78,6 +115,68 @@ int parseCommandLine(int argc, char *argv[], int rank) {
                 comp = false; // Set mode to decompression
                 start += 2;
             } break;
+            case 'I': {
+                long i = 0;
+                if (!isNumber(optarg, i)) {
+                    std::fprintf(stderr, "Error: wrong '-I' option\n");
+                    usage(argv[0]);
+                    return -1;
+                }
+                MPIIO_MODE = (i == 1);
+                start += 2;
+            } break;
+            case 'O': {
+                long k = 0;
+                if (!isNumber(optarg, k) || k < 0) {
+                    std::fprintf(stderr, "Error: wrong '-O' option\n");
+                    usage(argv[0]);
+                    return -1;
+                }
+                ONDEMAND = k;
+                start += 2;
+            } break;
+            case 'L': {
+                long l = 0;
+                if (!isNumber(optarg, l) || l < 0 || l > 10) {
+                    std::fprintf(stderr, "Error: wrong '-L' option, the level goes from 0 to 10\n");
+                    usage(argv[0]);
+                    return -1;
+                }
+                LEVEL = l;
+                start += 2;
+            } break;
+            case 'F': {
+                long f = 0;
+                if (!isNumber(optarg, f) || f < 0) {
+                    std::fprintf(stderr, "Error: wrong '-F' option\n");
+                    usage(argv[0]);
+                    return -1;
+                }
+                RESTART_INTERVAL = f * 1024 * 1024;
+                start += 2;
+            } break;
+            case 'H': {
+                long h = 0;
+                if (!isNumber(optarg, h) || h < 0 || h > 1) {
+                    std::fprintf(stderr, "Error: wrong '-H' option\n");
+                    usage(argv[0]);
+                    return -1;
+                }
+                DEDUP = (h == 1);
+                start += 2;
+            } break;
+            case 'T': {
+                traceEnable(optarg);
+                start += 2;
+            } break;
+            case 'Z': {
+                if (!parseStrategy(optarg, STRATEGY)) {
+                    std::fprintf(stderr, "Error: wrong '-Z' option\n");
+                    usage(argv[0]);
+                    return -1;
+                }
+                start += 2;
+            } break;
             case 'q': {
                 long q = 0;
                 if (!isNumber(optarg, q)) {
@@ -111,6 +210,12 @@ int parseCommandLine(int argc, char *argv[], int rank) {
         return -1;
     }
 
+    // -I 1: the ranks read their own blocks, nobody sees all the blocks of a file
+    if (DEDUP && MPIIO_MODE) {
+        if (!rank) std::fprintf(stderr, "Error: -H 1 cannot be used with -I 1\n");
+        return -1;
+    }
+
     // Ensure at least one file or directory is provided
     if ((argc - start) <= 0) {
         if (!rank) std::fprintf(stderr, "Error: at least one file or directory should be provided!\n");
@@ -0,0 +1,234 @@
+/*
+ * Deflate/inflate streams kept across blocks: every call starts from a reset
+ * stream, so the result of a block never depends on the blocks before it.
+ *
+ * compress()/uncompress() from miniz allocate, initialise and free a fresh
+ * deflate (~300KB) / inflate state for every call. With many small files (or
+ * small blocks) that is paid once per block. A Codec owns one deflate and one
+ * inflate stream, set up once, and only resets them (mz_deflateReset/
+ * mz_inflateReset) between blocks. Each worker (R-Worker,
+ * MPI rank, the sequential loop) owns its own Codec, it is not thread safe.
+ *
+ * The streams produced are regular zlib streams, the same that compress()
+ * produces, so they can be read back by uncompress() and vice versa.
+ *
+ * encode()/decode() add the stored blocks on top: deflating data that is
+ * already compressed (JPEGs, videos, gzipped logs) burns CPU for nothing, so
+ * encode() first deflates at level 1 a sample of the block (the probe) and,
+ * if it does not shrink enough, copies the block as it is. The container
+ * marks those blocks (BLOCK_STORED), decode() copies them back.
+ *
+ * The level (-L, 0..10, 10 is miniz's "uber" level) and the strategy (-Z) are
+ * the ones of mz_deflateInit2, so any of them gives a regular zlib stream and
+ * decompression does not need to know which one was used.
+ *
+ * With restart points (-F n) a block bigger than n Mbyte is deflated as a
+ * single stream with a full flush every n Mbyte: the dictionary is dropped
+ * and the output is byte aligned, so the data between two flushes (a piece)
+ * can be inflated without the ones before it. encode() appends the offsets of
+ * the flushes to the block (BLOCK_RESTARTS, see blockEntries in container.hpp),
+ * the archive has an index entry per piece and decode() inflates a piece with
+ * tinfl, the raw inflater of miniz, that does not need the whole stream.
+ */
+
+#if !defined _CODEC_HPP
+#define _CODEC_HPP
+
+#include <cstring>
+#include <vector>
+#include <miniz/miniz.h>
+#include <container.hpp>
+
+static const size_t PROBE_SAMPLE    = 64 * 1024;  // blocks up to this size are not probed
+static const double PROBE_MAX_RATIO = 0.9;        // compressed/original of the sample to be worth it
+
+// -Z names of the deflate strategies, in the order of their MZ_ values
+static const char *STRATEGY_NAMES[] = { "default", "filtered", "huffman", "rle" };
+static const int   NSTRATEGIES      = sizeof(STRATEGY_NAMES) / sizeof(STRATEGY_NAMES[0]);
+
+// strategy from its -Z name, false if unknown
+static inline bool parseStrategy(const char *name, int &strategy) {
+    for (int i = 0; i < NSTRATEGIES; ++i)
+        if (std::strcmp(name, STRATEGY_NAMES[i]) == 0) { strategy = i; return true; }
+    return false;
+}
+
+// level defaults to MZ_DEFAULT_COMPRESSION, as compress() does: in miniz that
+// selects greedy parsing, so the output is the same compress() would produce.
+class Codec {
+public:
+    // restart: bytes between two restart points, 0 for none
+    Codec(int level=MZ_DEFAULT_COMPRESSION, int strategy=MZ_DEFAULT_STRATEGY, size_t restart=0)
+        : level(level), restart(restart) {
+        std::memset(&dstream, 0, sizeof(dstream));
+        std::memset(&istream, 0, sizeof(istream));
+        dok = (mz_deflateInit2(&dstream, level, MZ_DEFLATED, MZ_DEFAULT_WINDOW_BITS, 9, strategy) == MZ_OK);
+        iok = (mz_inflateInit(&istream) == MZ_OK);
+    }
+    ~Codec() {
+        if (dok) mz_deflateEnd(&dstream);
+        if (iok) mz_inflateEnd(&istream);
+        if (pok) mz_deflateEnd(&pstream);
+    }
+    Codec(const Codec&) = delete;
+    Codec& operator=(const Codec&) = delete;
+
+    // same semantics of compress(): on input dstLen is the size of dst
+    // (at least compressBound(srcLen) to be sure), on output the size of the
+    // compressed data. Returns Z_OK, Z_BUF_ERROR, Z_MEM_ERROR or Z_STREAM_ERROR.
+    int compress(unsigned char *dst, size_t *dstLen, const unsigned char *src, size_t srcLen) {
+        if (!dok) return Z_MEM_ERROR;
+        if ((srcLen | *dstLen) > 0xFFFFFFFFU) return Z_PARAM_ERROR;
+        mz_deflateReset(&dstream);
+        dstream.next_in   = src;
+        dstream.avail_in  = (mz_uint32)srcLen;
+        dstream.next_out  = dst;
+        dstream.avail_out = (mz_uint32)*dstLen;
+        int status = mz_deflate(&dstream, MZ_FINISH);
+        if (status != MZ_STREAM_END) return (status == MZ_OK) ? Z_BUF_ERROR : status;
+        *dstLen = dstream.total_out;
+        return Z_OK;
+    }
+
+    // same semantics of uncompress(): on input dstLen is the size of dst,
+    // on output the size of the uncompressed data. The adler32 of the stream
+    // is checked. Returns Z_OK, Z_BUF_ERROR, Z_MEM_ERROR or Z_DATA_ERROR.
+    int uncompress(unsigned char *dst, size_t *dstLen, const unsigned char *src, size_t srcLen) {
+        if (!iok) return Z_MEM_ERROR;
+        if ((srcLen | *dstLen) > 0xFFFFFFFFU) return Z_PARAM_ERROR;
+        mz_inflateReset(&istream);
+        istream.next_in   = src;
+        istream.avail_in  = (mz_uint32)srcLen;
+        istream.next_out  = dst;
+        istream.avail_out = (mz_uint32)*dstLen;
+        int status = mz_inflate(&istream, MZ_FINISH);
+        if (status != MZ_STREAM_END)
+            return ((status == MZ_BUF_ERROR) && (!istream.avail_in)) ? Z_DATA_ERROR : status;
+        *dstLen = istream.total_out;
+        return Z_OK;
+    }
+
+    // as compress(), but if the block is not worth compressing (see probe) or
+    // the compressed data would not be smaller, the block is copied in dst as
+    // it is and flags is BLOCK_STORED. dst has to be at least compressBound(srcLen).
+    // At level 0 deflate would only wrap the data, the blocks are stored.
+    // A block bigger than the restart interval gets restart points, flags is
+    // BLOCK_RESTARTS and dst ends with their table.
+    int encode(unsigned char *dst, size_t *dstLen, const unsigned char *src, size_t srcLen, uint32_t &flags) {
+        flags = 0;
+        if (level == 0 || !probe(src, srcLen)) return store(dst, dstLen, src, srcLen, flags);
+        if (restart && srcLen > restart) {
+            const size_t cap = *dstLen;
+            int err = compressRestarts(dst, dstLen, src, srcLen);
+            if (err == Z_BUF_ERROR || (err == Z_OK && *dstLen >= srcLen)) {
+                *dstLen = cap;
+                return store(dst, dstLen, src, srcLen, flags);
+            }
+            if (err == Z_OK) flags = BLOCK_RESTARTS;
+            return err;
+        }
+        int err = compress(dst, dstLen, src, srcLen);
+        if (err != Z_OK) return err;
+        if (*dstLen >= srcLen) return store(dst, dstLen, src, srcLen, flags);
+        return Z_OK;
+    }
+
+    // the inverse of encode, flags are the ones of the index entry: a stored
+    // block is just copied, a piece is inflated by itself
+    int decode(unsigned char *dst, size_t *dstLen, const unsigned char *src, size_t srcLen, uint32_t flags) {
+        if (flags & BLOCK_PIECE) return inflatePiece(dst, dstLen, src, srcLen, flags);
+        if (!(flags & BLOCK_STORED)) return uncompress(dst, dstLen, src, srcLen);
+        if (srcLen > *dstLen) return Z_BUF_ERROR;
+        std::memcpy(dst, src, srcLen);
+        *dstLen = srcLen;
+        return Z_OK;
+    }
+
+    // Compressibility probe: false if PROBE_SAMPLE bytes from the middle of
+    // the block, deflated at level 1, do not shrink below PROBE_MAX_RATIO.
+    // Small blocks are always worth a try, the probe would cost as much.
+    bool probe(const unsigned char *src, size_t srcLen) {
+        if (srcLen <= PROBE_SAMPLE) return true;
+        if (!pok) {
+            std::memset(&pstream, 0, sizeof(pstream));
+            if (mz_deflateInit2(&pstream, 1, MZ_DEFLATED, MZ_DEFAULT_WINDOW_BITS, 9, MZ_DEFAULT_STRATEGY) != MZ_OK)
+                return true;
+            pok = true;
+            sample.resize(compressBound(PROBE_SAMPLE));
+        }
+        mz_deflateReset(&pstream);
+        pstream.next_in   = src + (srcLen - PROBE_SAMPLE) / 2;
+        pstream.avail_in  = (mz_uint32)PROBE_SAMPLE;
+        pstream.next_out  = sample.data();
+        pstream.avail_out = (mz_uint32)sample.size();
+        if (mz_deflate(&pstream, MZ_FINISH) != MZ_STREAM_END) return true;
+        return pstream.total_out <= PROBE_MAX_RATIO * PROBE_SAMPLE;
+    }
+
+private:
+    int store(unsigned char *dst, size_t *dstLen, const unsigned char *src, size_t srcLen, uint32_t &flags) {
+        if (srcLen > *dstLen) return Z_BUF_ERROR;
+        if (srcLen) std::memcpy(dst, src, srcLen);
+        *dstLen = srcLen;
+        flags   = BLOCK_STORED;
+        return Z_OK;
+    }
+
+    // one zlib stream, full flush every restart bytes, then the table of the
+    // restart points (see blockEntries). Z_BUF_ERROR if it does not fit in dst.
+    int compressRestarts(unsigned char *dst, size_t *dstLen, const unsigned char *src, size_t srcLen) {
+        if (!dok) return Z_MEM_ERROR;
+        if ((srcLen | *dstLen) > 0xFFFFFFFFU) return Z_PARAM_ERROR;
+        const size_t n = (srcLen + restart - 1) / restart;
+        const size_t tableBytes = (2 * (n - 1) + 1) * sizeof(uint64_t);
+        if (*dstLen <= tableBytes) return Z_BUF_ERROR;
+        std::vector<uint64_t> table;
+        table.reserve(2 * n - 1);
+        mz_deflateReset(&dstream);
+        dstream.next_in   = src;
+        dstream.next_out  = dst;
+        dstream.avail_out = (mz_uint32)(*dstLen - tableBytes);
+        for (size_t i = 0; i < n; ++i) {
+            const bool last = (i + 1 == n);
+            dstream.avail_in = (mz_uint32)(last ? srcLen - i * restart : restart);
+            int status = mz_deflate(&dstream, last ? MZ_FINISH : MZ_FULL_FLUSH);
+            if (last) {
+                if (status != MZ_STREAM_END) return (status == MZ_OK) ? Z_BUF_ERROR : status;
+                break;
+            }
+            // the flush is complete only if there is still room for the output
+            if (status != MZ_OK || dstream.avail_in || !dstream.avail_out) return (status == MZ_OK) ? Z_BUF_ERROR : status;
+            table.push_back(dstream.total_out);
+            table.push_back(dstream.total_in);
+        }
+        table.push_back(n);
+        std::memcpy(dst + dstream.total_out, table.data(), tableBytes);
+        *dstLen = dstream.total_out + tableBytes;
+        return Z_OK;
+    }
+
+    // a piece starts at a restart point, nothing before it is referenced; only
+    // the first one has the zlib header, only the last one ends the stream
+    int inflatePiece(unsigned char *dst, size_t *dstLen, const unsigned char *src, size_t srcLen, uint32_t flags) {
+        tinfl_init(&piece);
+        size_t in = srcLen, out = *dstLen;
+        const mz_uint32 tflags = TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF |
+                                 ((flags & BLOCK_FIRST) ? TINFL_FLAG_PARSE_ZLIB_HEADER : 0) |
+                                 ((flags & BLOCK_LAST) ? 0 : TINFL_FLAG_HAS_MORE_INPUT);
+        tinfl_status status = tinfl_decompress(&piece, src, &in, dst, dst, &out, tflags);
+        if (status == TINFL_STATUS_HAS_MORE_OUTPUT) return Z_BUF_ERROR;
+        if (status != ((flags & BLOCK_LAST) ? TINFL_STATUS_DONE : TINFL_STATUS_NEEDS_MORE_INPUT)) return Z_DATA_ERROR;
+        *dstLen = out;
+        return Z_OK;
+    }
+
+    mz_stream dstream, istream;
+    mz_stream pstream;              // level 1, for the probe
+    tinfl_decompressor piece;       // for the pieces of a stream with restart points
+    int       level;
+    size_t    restart;
+    bool      dok, iok, pok=false;
+    std::vector<unsigned char> sample;
+};
+
+#endif // _CODEC_HPP
@@ -0,0 +1,362 @@
+/*
+ * The .zip container written and read by the sequential, FastFlow and MPI
+ * drivers.
+ *
+ *   +--------------+---------+---------+-----+-------------+--------+
+ *   | FileHeader   | block 1 | block 2 | ... | BlockEntry  | Footer |
+ *   | magic, vers, |  zlib   |  zlib   |     |   x nblocks |        |
+ *   | blockSize    | stream  | stream  |     |  (index)    |        |
+ *   +--------------+---------+---------+-----+-------------+--------+
+ *
+ *  -   Every block is an independent zlib stream of (at most) blockSize bytes
+ *      of the original file, the last one may be shorter.
+ *  -   The index is written after the data, so a file can be produced in one
+ *      streaming pass: the header first, the blocks as soon as they are in
+ *      order, the index and the footer at the end.
+ *  -   The index is in the order of the original file, but the blocks do not
+ *      have to be stored in that order: several writers can put each block
+ *      in the next free range as soon as it is ready (mainffa2a).
+ *  -   The footer has a fixed size and sits at the end of the file: a reader
+ *      gets it, then the index, and can reach any block in O(1), or only the
+ *      blocks covering a range of the uncompressed file (blockRange).
+ *  -   A block that does not compress (see Codec::encode) is stored as it is,
+ *      with BLOCK_STORED in the flags of its index entry.
+ *  -   A block compressed with restart points (-F) is a single zlib stream
+ *      whose deflate state is reset (full flush) every few Mbyte: each piece
+ *      between two restart points can be inflated by itself, so each one has
+ *      its own index entry (BLOCK_PIECE) and the decompressors spread the
+ *      pieces over the workers like any other block, whatever block size was
+ *      used to compress. The Adler32 of such a stream is not checked, the
+ *      CRC32 of each piece is.
+ *  -   The entries of a block equal to an earlier one of the same file (-H,
+ *      see dedup.hpp) are copies of the entries of the earlier block: they
+ *      point to the same bytes, which are stored once.
+ *  -   Each index entry has the CRC32 of the compressed block, checked before
+ *      decompressing it (the zlib stream already has the Adler32 of the
+ *      uncompressed data); the footer has the CRC32 of the index.
+ *
+ * All the fields are little-endian, fixed width.
+ */
+
+#if !defined _CONTAINER_HPP
+#define _CONTAINER_HPP
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <miniz/miniz.h>
+
+static const char     CONTAINER_MAGIC[4]   = {'S','P','M','Z'};
+static const char     CONTAINER_FOOTER[4]  = {'Z','M','P','S'};
+static const uint16_t CONTAINER_VERSION    = 1;
+
+struct FileHeader {
+    char     magic[4];      // CONTAINER_MAGIC
+    uint16_t version;       // CONTAINER_VERSION
+    uint16_t flags;         // reserved, 0
+    uint64_t blockSize;     // uncompressed size of every block but the last one
+};
+
+struct BlockEntry {
+    uint64_t offset;        // of the compressed block from the beginning of the file
+    uint64_t cmpSize;       // compressed size
+    uint64_t rawSize;       // uncompressed size
+    uint32_t crc;           // CRC32 of the compressed block
+    uint32_t flags;         // BLOCK_STORED, BLOCK_PIECE (and FIRST/LAST) or 0
+};
+
+// the block is not a zlib stream, it is the original data
+static const uint32_t BLOCK_STORED   = 1;
+// the block is a piece of a zlib stream with restart points, raw deflate data
+// that starts at a restart point; the first piece also has the zlib header,
+// the last one the end of the stream
+static const uint32_t BLOCK_PIECE    = 2;
+static const uint32_t BLOCK_FIRST    = 4;
+static const uint32_t BLOCK_LAST     = 8;
+// never in an archive: the block produced by Codec::encode ends with the table
+// of its restart points, blockEntries turns it into BLOCK_PIECE entries
+static const uint32_t BLOCK_RESTARTS = 16;
+
+struct Footer {
+    uint64_t indexOffset;   // of the first BlockEntry
+    uint64_t nblocks;
+    uint64_t rawSize;       // uncompressed size of the whole file
+    uint32_t indexCrc;      // CRC32 of the index
+    char     magic[4];      // CONTAINER_FOOTER
+};
+
+static_assert(sizeof(FileHeader) == 16, "FileHeader layout");
+static_assert(sizeof(BlockEntry) == 32, "BlockEntry layout");
+static_assert(sizeof(Footer)     == 32, "Footer layout");
+
+// checksum stored in the index for a compressed block
+static inline uint32_t blockChecksum(const unsigned char *ptr, size_t size) {
+    return (uint32_t)mz_crc32(MZ_CRC32_INIT, ptr, size);
+}
+
+// header of a container of blocks of blockSize bytes
+static inline FileHeader containerHeader(uint64_t blockSize) {
+    FileHeader hdr;
+    std::memcpy(hdr.magic, CONTAINER_MAGIC, sizeof(hdr.magic));
+    hdr.version   = CONTAINER_VERSION;
+    hdr.flags     = 0;
+    hdr.blockSize = blockSize;
+    return hdr;
+}
+
+// The index entries of a block (cmpSize bytes at ptr, from Codec::encode) that
+// is written at offset of the archive, appended to entries: one entry, or one
+// per piece if the block has restart points. Returns the n. of bytes of the
+// block to write, the table of the restart points at its end is not written.
+//
+// Table: the offsets (compressed, uncompressed) where pieces 1..n-1 start,
+// then n, all uint64_t.
+static inline size_t blockEntries(const unsigned char *ptr, size_t cmpSize, size_t rawSize, uint32_t crc,
+                                  uint32_t flags, uint64_t offset, std::vector<BlockEntry> &entries) {
+    if (!(flags & BLOCK_RESTARTS)) {
+        entries.push_back({offset, cmpSize, rawSize, crc, flags});
+        return cmpSize;
+    }
+    uint64_t n;
+    std::memcpy(&n, ptr + cmpSize - sizeof(n), sizeof(n));
+    const size_t tableBytes = (2 * (n - 1) + 1) * sizeof(uint64_t);
+    const size_t streamBytes = cmpSize - tableBytes;
+    std::vector<uint64_t> table(2 * (n - 1));
+    std::memcpy(table.data(), ptr + streamBytes, table.size() * sizeof(uint64_t));
+    for (uint64_t i = 0; i < n; ++i) {
+        const uint64_t cmpStart = i ? table[2 * (i - 1)] : 0;
+        const uint64_t rawStart = i ? table[2 * (i - 1) + 1] : 0;
+        const uint64_t cmpEnd   = (i + 1 < n) ? table[2 * i] : streamBytes;
+        const uint64_t rawEnd   = (i + 1 < n) ? table[2 * i + 1] : rawSize;
+        const uint32_t pflags   = BLOCK_PIECE | (i == 0 ? BLOCK_FIRST : 0) | (i + 1 == n ? BLOCK_LAST : 0);
+        entries.push_back({offset + cmpStart, cmpEnd - cmpStart, rawEnd - rawStart,
+                           blockChecksum(ptr + cmpStart, cmpEnd - cmpStart), pflags});
+    }
+    return streamBytes;
+}
+
+// footer of a container whose index (nblocks entries) starts at indexOffset
+static inline Footer containerFooter(const BlockEntry *index, size_t nblocks, uint64_t indexOffset) {
+    Footer footer;
+    footer.indexOffset = indexOffset;
+    footer.nblocks     = nblocks;
+    footer.rawSize     = 0;
+    for (size_t i = 0; i < nblocks; ++i) footer.rawSize += index[i].rawSize;
+    footer.indexCrc    = blockChecksum(reinterpret_cast<const unsigned char*>(index), nblocks * sizeof(BlockEntry));
+    std::memcpy(footer.magic, CONTAINER_FOOTER, sizeof(footer.magic));
+    return footer;
+}
+
+// write all the size bytes starting from ptr, retrying on short writes
+static inline bool writeAll(int fd, const void *buf, size_t size) {
+    const unsigned char *ptr = static_cast<const unsigned char*>(buf);
+    while (size) {
+        ssize_t n = write(fd, ptr, size);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("write");
+            return false;
+        }
+        ptr += n; size -= n;
+    }
+    return true;
+}
+
+// read exactly size bytes at offset
+static inline bool preadAll(int fd, void *buf, size_t size, off_t offset) {
+    unsigned char *ptr = static_cast<unsigned char*>(buf);
+    while (size) {
+        ssize_t n = pread(fd, ptr, size, offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("pread");
+            return false;
+        }
+        if (n == 0) return false;
+        ptr += n; size -= n; offset += n;
+    }
+    return true;
+}
+
+// write exactly size bytes at offset, the file position is not used
+static inline bool pwriteAll(int fd, const void *buf, size_t size, off_t offset) {
+    const unsigned char *ptr = static_cast<const unsigned char*>(buf);
+    while (size) {
+        ssize_t n = pwrite(fd, ptr, size, offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("pwrite");
+            return false;
+        }
+        ptr += n; size -= n; offset += n;
+    }
+    return true;
+}
+
+// Writes a container in a single pass. The blocks have to be appended in order.
+class ContainerWriter {
+public:
+    ContainerWriter() = default;
+    ~ContainerWriter() { if (fd >= 0) ::close(fd); }
+    ContainerWriter(const ContainerWriter&) = delete;
+    ContainerWriter& operator=(const ContainerWriter&) = delete;
+
+    // creates (truncates) filename and writes the header
+    bool open(const std::string &filename, uint64_t blockSize) {
+        fd = ::open(filename.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if (fd < 0) {
+            perror("open");
+            std::fprintf(stderr, "Failed to open output file: %s\n", filename.c_str());
+            return false;
+        }
+        FileHeader hdr = containerHeader(blockSize);
+        pos = sizeof(hdr);
+        index.clear();
+        blocks.clear();
+        return writeAll(fd, &hdr, sizeof(hdr));
+    }
+    // appends the next compressed block, crc is its blockChecksum; a block
+    // with restart points gets an index entry per piece (see blockEntries)
+    bool append(const unsigned char *ptr, size_t cmpSize, size_t rawsize, uint32_t crc, uint32_t flags=0) {
+        blocks.push_back(index.size());
+        const size_t bytes = blockEntries(ptr, cmpSize, rawsize, crc, flags, pos, index);
+        if (!writeAll(fd, ptr, bytes)) return false;
+        pos += bytes;
+        return true;
+    }
+    // the next block is the same as block n (0-based) appended before, only
+    // its index entries are repeated
+    bool duplicate(size_t n) {
+        if (n >= blocks.size()) return false;
+        const size_t first = blocks[n], last = (n + 1 < blocks.size()) ? blocks[n + 1] : index.size();
+        blocks.push_back(index.size());
+        index.reserve(index.size() + last - first);
+        for (size_t i = first; i < last; ++i) index.push_back(index[i]);
+        return true;
+    }
+    bool append(const unsigned char *ptr, size_t cmpSize, size_t rawsize) {
+        return append(ptr, cmpSize, rawsize, blockChecksum(ptr, cmpSize));
+    }
+    // writes the index and the footer and closes the file
+    bool close() {
+        const size_t indexBytes = index.size() * sizeof(BlockEntry);
+        Footer footer = containerFooter(index.data(), index.size(), pos);
+        bool ok = writeAll(fd, index.data(), indexBytes) && writeAll(fd, &footer, sizeof(footer));
+        if (::close(fd) < 0) {
+            perror("close");
+            ok = false;
+        }
+        fd = -1;
+        return ok;
+    }
+
+private:
+    int                     fd=-1;
+    uint64_t                pos=0;       // where the next block goes
+    std::vector<BlockEntry> index;
+    std::vector<size_t>     blocks;      // first entry of each block
+};
+
+// Parses the header, the footer and the index of a container, either already
+// in memory (mapped or read) or from a file descriptor (only the metadata is
+// read, the blocks are left on disk).
+class ContainerReader {
+public:
+    bool open(const unsigned char *ptr, size_t size) {
+        base = ptr;
+        if (size < sizeof(FileHeader) + sizeof(Footer)) return fail("file too short");
+        std::memcpy(&hdr, ptr, sizeof(hdr));
+        std::memcpy(&footer, ptr + size - sizeof(footer), sizeof(footer));
+        if (!checkMeta(size)) return false;
+        index.resize(footer.nblocks);
+        std::memcpy(index.data(), ptr + footer.indexOffset, footer.nblocks * sizeof(BlockEntry));
+        return checkIndex();
+    }
+    bool open(int fd, size_t size) {
+        base = nullptr;
+        if (size < sizeof(FileHeader) + sizeof(Footer)) return fail("file too short");
+        if (!preadAll(fd, &hdr, sizeof(hdr), 0) ||
+            !preadAll(fd, &footer, sizeof(footer), size - sizeof(footer))) return fail("cannot read the header");
+        if (!checkMeta(size)) return false;
+        index.resize(footer.nblocks);
+        if (!preadAll(fd, index.data(), footer.nblocks * sizeof(BlockEntry), footer.indexOffset))
+            return fail("cannot read the index");
+        return checkIndex();
+    }
+
+    size_t            nblocks()   const { return index.size(); }
+    uint64_t          blockSize() const { return hdr.blockSize; }
+    uint64_t          rawSize()   const { return footer.rawSize; }
+    const BlockEntry& block(size_t i) const { return index[i]; }
+    // compressed data of block i, only if the container has been opened from memory
+    const unsigned char *blockData(size_t i) const { return base + index[i].offset; }
+    // offset in the uncompressed file of the first byte of block i
+    uint64_t          rawOffset(size_t i) const { return starts[i]; }
+    // the blocks [first, last] cover the uncompressed bytes [offset, offset+length),
+    // the range is clamped to the end of the file. False if it is empty.
+    bool blockRange(uint64_t offset, uint64_t length, size_t &first, size_t &last) const {
+        if (length == 0 || offset >= footer.rawSize) return false;
+        const uint64_t end = (length > footer.rawSize - offset) ? footer.rawSize : offset + length;
+        // the last block starting at or before offset (and the one holding end-1)
+        first = std::upper_bound(starts.begin(), starts.end(), offset)  - starts.begin() - 1;
+        last  = std::upper_bound(starts.begin(), starts.end(), end - 1) - starts.begin() - 1;
+        return true;
+    }
+    // why the last open failed
+    const char *error() const { return err; }
+
+private:
+    bool fail(const char *why) { err = why; return false; }
+    bool checkMeta(size_t size) {
+        if (std::memcmp(hdr.magic, CONTAINER_MAGIC, sizeof(hdr.magic)) != 0 ||
+            std::memcmp(footer.magic, CONTAINER_FOOTER, sizeof(footer.magic)) != 0)
+            return fail("not a valid archive");
+        if (hdr.version != CONTAINER_VERSION) return fail("unsupported archive version");
+        if (footer.indexOffset < sizeof(FileHeader) ||
+            footer.nblocks > (size - sizeof(Footer) - footer.indexOffset) / sizeof(BlockEntry) ||
+            footer.indexOffset + footer.nblocks * sizeof(BlockEntry) + sizeof(Footer) != size)
+            return fail("corrupted footer");
+        return true;
+    }
+    bool checkIndex() {
+        const size_t indexBytes = index.size() * sizeof(BlockEntry);
+        if (blockChecksum(reinterpret_cast<const unsigned char*>(index.data()), indexBytes) != footer.indexCrc)
+            return fail("corrupted index");
+        uint64_t total = 0;
+        starts.resize(index.size());
+        for (size_t i = 0; i < index.size(); ++i) {
+            const BlockEntry &e = index[i];
+            if (e.offset < sizeof(FileHeader) || e.offset > footer.indexOffset ||
+                e.cmpSize > footer.indexOffset - e.offset ||
+                ((e.flags & BLOCK_STORED) && (e.cmpSize != e.rawSize || (e.flags & BLOCK_PIECE))) ||
+                (e.flags & BLOCK_RESTARTS))
+                return fail("corrupted index");
+            starts[i] = total;
+            total += e.rawSize;
+        }
+        if (total != footer.rawSize) return fail("corrupted index");
+        return true;
+    }
+
+    const unsigned char    *base=nullptr;
+    FileHeader              hdr{};
+    Footer                  footer{};
+    std::vector<BlockEntry> index;
+    std::vector<uint64_t>   starts;      // rawOffset of each block
+    const char             *err="";
+};
+
+// true if data (the compressed block described by e) is not corrupted
+static inline bool verifyBlock(const BlockEntry &e, const unsigned char *data) {
+    return blockChecksum(data, e.cmpSize) == e.crc;
+}
+
+#endif // _CONTAINER_HPP
@@ -0,0 +1,178 @@
+/*
+ * Deduplication of the blocks of a file (-H 1).
+ *
+ * Backups are full of repeated regions: VM images with the same (often
+ * zeroed) extents, datasets copied inside a bigger file. Before a block of a
+ * big file is compressed its content is hashed with xxHash64; a block equal to
+ * an earlier block of the same file is not compressed at all, the index of the
+ * archive gets a copy of the entries of the earlier one (see
+ * ContainerWriter::duplicate), so its data is stored once. Nothing changes
+ * when decompressing: two entries simply point to the same bytes.
+ *
+ * Only the blocks of the same file are compared, each archive stays
+ * self-contained. A block is a duplicate only if its bytes are equal to the
+ * earlier one, a hash match alone is never trusted: the earlier block is
+ * compared in memory if it is still there or, in streaming mode, where it has
+ * already been released, read back from the file (pread) first. The re-read
+ * only happens when the hashes match, the unique blocks cost nothing more.
+ *
+ * The stages that split the files (L-Workers, the sequential loop, the main
+ * MPI process) hash the blocks, DedupStats collects what has been skipped and
+ * an estimate of the compression time saved, from the time the compressors
+ * spent on the other blocks.
+ */
+
+#if !defined _DEDUP_HPP
+#define _DEDUP_HPP
+
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <unordered_map>
+#include <vector>
+
+// xxHash64 (https://github.com/Cyan4973/xxHash), scalar version
+static const uint64_t XXH_PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t XXH_PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t XXH_PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t XXH_PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t xxhRotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+static inline uint64_t xxhRead64(const unsigned char *p) { uint64_t v; std::memcpy(&v, p, sizeof(v)); return v; }
+static inline uint32_t xxhRead32(const unsigned char *p) { uint32_t v; std::memcpy(&v, p, sizeof(v)); return v; }
+static inline uint64_t xxhRound(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    return xxhRotl(acc, 31) * XXH_PRIME64_1;
+}
+static inline uint64_t xxhMerge(uint64_t acc, uint64_t val) {
+    acc ^= xxhRound(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static inline uint64_t xxh64(const unsigned char *p, size_t len, uint64_t seed=0) {
+    const unsigned char *end = p + len;
+    uint64_t h;
+    if (len >= 32) {
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2, v2 = seed + XXH_PRIME64_2;
+        uint64_t v3 = seed, v4 = seed - XXH_PRIME64_1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = xxhRound(v1, xxhRead64(p));
+            v2 = xxhRound(v2, xxhRead64(p + 8));
+            v3 = xxhRound(v3, xxhRead64(p + 16));
+            v4 = xxhRound(v4, xxhRead64(p + 24));
+        }
+        h = xxhRotl(v1, 1) + xxhRotl(v2, 7) + xxhRotl(v3, 12) + xxhRotl(v4, 18);
+        h = xxhMerge(h, v1);
+        h = xxhMerge(h, v2);
+        h = xxhMerge(h, v3);
+        h = xxhMerge(h, v4);
+    } else {
+        h = seed + XXH_PRIME64_5;
+    }
+    h += len;
+    for (; p + 8 <= end; p += 8) h = xxhRotl(h ^ xxhRound(0, xxhRead64(p)), 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    if (p + 4 <= end) {
+        h = xxhRotl(h ^ (xxhRead32(p) * XXH_PRIME64_1), 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; ++p) h = xxhRotl(h ^ (*p * XXH_PRIME64_5), 11) * XXH_PRIME64_1;
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+// the blocks seen so far of the file being split, reset for every file
+class BlockDedup {
+public:
+    static const size_t NONE = SIZE_MAX;
+
+    void reset() { seen.clear(); }
+    // block n (0-based) of the file, len bytes at ptr: the n. of an earlier
+    // block with the same content, NONE if there is none (the block is then
+    // remembered). The earlier block is compared in memory, it has to be
+    // still valid.
+    size_t find(size_t n, const unsigned char *ptr, size_t len) {
+        const Seen *s = lookup(n, ptr, len);
+        if (!s || std::memcmp(s->ptr, ptr, len) != 0) return NONE;
+        return s->block;
+    }
+    // streaming mode: the earlier blocks are no longer in memory, the one
+    // with the same hash is read back from fd (block i at i*blockSize) first
+    size_t find(size_t n, const unsigned char *ptr, size_t len, int fd, size_t blockSize) {
+        const Seen *s = lookup(n, ptr, len);
+        if (!s) return NONE;
+        scratch.resize(len);
+        const off_t offset = s->block * blockSize;
+        size_t done = 0;
+        while (done < len) {
+            const ssize_t r = pread(fd, scratch.data() + done, len - done, offset + done);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) return NONE;   // then it is simply compressed
+            done += r;
+        }
+        if (std::memcmp(scratch.data(), ptr, len) != 0) return NONE;
+        return s->block;
+    }
+
+private:
+    struct Seen {
+        size_t               block;
+        const unsigned char *ptr;
+        size_t               len;
+    };
+    // the earlier block with the same hash and size, nullptr if there is none
+    // (the block is then remembered). A collision is only compressed, the
+    // first block keeps the hash.
+    const Seen *lookup(size_t n, const unsigned char *ptr, size_t len) {
+        const uint64_t h = xxh64(ptr, len);
+        auto it = seen.find(h);
+        if (it == seen.end()) {
+            seen.emplace(h, Seen{n, ptr, len});
+            return nullptr;
+        }
+        return it->second.len == len ? &it->second : nullptr;
+    }
+    std::unordered_map<uint64_t, Seen> seen;
+    std::vector<unsigned char> scratch;   // the earlier block read back
+};
+
+// what -H has saved, updated by all the threads
+struct DedupStats {
+    std::atomic<uint64_t> blocks{0}, bytes{0};        // blocks of big files hashed
+    std::atomic<uint64_t> dupBlocks{0}, dupBytes{0};  // the duplicates among them
+    std::atomic<uint64_t> encodeNs{0}, encoded{0};    // time spent compressing the other blocks
+
+    void addBlock(size_t len, bool dup) {
+        blocks.fetch_add(1, std::memory_order_relaxed);
+        bytes.fetch_add(len, std::memory_order_relaxed);
+        if (!dup) return;
+        dupBlocks.fetch_add(1, std::memory_order_relaxed);
+        dupBytes.fetch_add(len, std::memory_order_relaxed);
+    }
+    // a block of len bytes compressed since start
+    void addEncode(std::chrono::steady_clock::time_point start, size_t len) {
+        const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        encodeNs.fetch_add(ns, std::memory_order_relaxed);
+        encoded.fetch_add(len, std::memory_order_relaxed);
+    }
+    void print() const {
+        const double mb = 1024.0 * 1024.0;
+        const uint64_t in = bytes.load(), dup = dupBytes.load(), e = encoded.load();
+        // the duplicates would have cost as much as the average block compressed
+        const double savedMs = e ? (double)encodeNs.load() / e * dup / 1e6 : 0.0;
+        std::printf("Dedup: %lu of %lu blocks are duplicates (%.1f of %.1f MB), ratio %.3f, ~%.1f ms of compression (one core) saved\n",
+                    (unsigned long)dupBlocks.load(), (unsigned long)blocks.load(), dup / mb, in / mb,
+                    (in > dup) ? (double)in / (in - dup) : 1.0, savedMs);
+    }
+};
+static DedupStats dedupStats;
+
+#endif // _DEDUP_HPP
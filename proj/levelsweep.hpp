@@ -0,0 +1,89 @@
+/*
+ * Throughput vs ratio of the compression levels (mainseq -B n).
+ *
+ * Up to n Mbyte are taken from the input files (the same share from each of
+ * them, so a single big file does not fill the whole sample), cut in blocks of
+ * the block size as the drivers do, and compressed with a Codec at every level
+ * from 0 to 10 with the strategy selected by -Z. For each level it prints the
+ * compression and decompression speed of one core and the ratio, nothing is
+ * written. Stored blocks (see Codec::encode) count as they would in an archive.
+ */
+
+#if !defined _LEVELSWEEP_HPP
+#define _LEVELSWEEP_HPP
+
+#include <cstdio>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <codec.hpp>
+
+static inline double sweepElapsedMs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// files: anything with size and ptr (the mapped content) members
+template <typename Files>
+static inline bool levelSweep(const Files &files, size_t sampleSize, size_t blockSize, int strategy) {
+    size_t nonEmpty = 0;
+    for (const auto &f : files) if (f.size) ++nonEmpty;
+    if (!nonEmpty) {
+        std::fprintf(stderr, "Error: no data to sample\n");
+        return false;
+    }
+
+    // the same share from the beginning of every file
+    const size_t share = std::max<size_t>(1, sampleSize / nonEmpty);
+    std::vector<unsigned char> sample;
+    sample.reserve(sampleSize);
+    for (const auto &f : files) {
+        if (sample.size() >= sampleSize) break;
+        const size_t n = std::min({f.size, share, sampleSize - sample.size()});
+        sample.insert(sample.end(), f.ptr, f.ptr + n);
+    }
+    const size_t nblocks = (sample.size() + blockSize - 1) / blockSize;
+
+    std::vector<unsigned char> cmp(nblocks * compressBound(blockSize));
+    std::vector<size_t> cmpSize(nblocks);
+    std::vector<uint32_t> flags(nblocks);
+    std::vector<unsigned char> back(blockSize);
+
+    std::printf("Sample: %zu KB in %zu blocks of %zu KB, strategy %s\n",
+                sample.size() / 1024, nblocks, blockSize / 1024, STRATEGY_NAMES[strategy]);
+    std::printf("level   comp MB/s  decomp MB/s    ratio\n");
+    const double mb = sample.size() / (1024.0 * 1024.0);
+    for (int level = 0; level <= 10; ++level) {
+        Codec codec(level, strategy);
+        size_t total = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < nblocks; ++i) {
+            const size_t raw = std::min(blockSize, sample.size() - i * blockSize);
+            size_t len = compressBound(blockSize);
+            uint32_t f;
+            if (codec.encode(&cmp[i * compressBound(blockSize)], &len, &sample[i * blockSize], raw, f) != Z_OK) {
+                std::fprintf(stderr, "Error: compression failed at level %d\n", level);
+                return false;
+            }
+            cmpSize[i] = len;
+            flags[i]   = f;
+            total += len;
+        }
+        const double cms = sweepElapsedMs(start);
+
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < nblocks; ++i) {
+            size_t len = blockSize;
+            if (codec.decode(back.data(), &len, &cmp[i * compressBound(blockSize)], cmpSize[i], flags[i]) != Z_OK) {
+                std::fprintf(stderr, "Error: decompression failed at level %d\n", level);
+                return false;
+            }
+        }
+        const double dms = sweepElapsedMs(start);
+
+        std::printf("%5d %11.1f %12.1f %8.3f\n", level, mb / (std::max(cms, 1e-3) / 1000.0), mb / (std::max(dms, 1e-3) / 1000.0),
+                    total ? (double)sample.size() / total : 0.0);
+    }
+    return true;
+}
+
+#endif // _LEVELSWEEP_HPP
@@ -7,20 +7,53 @@
 //          L-Worker --|   |--> R-Worker --|  
 //      
 //
-//  -   Each L-Worker manages a partition of the initial files. It sends sub-partitions
-//      to the R-Workers in a round-robin fashion.
+//  -   The L-Workers take the files from a queue filled by the directory walker
+//      while the scan is still going on (see walker.hpp). Each L-Worker sends
+//      sub-partitions of its files to the R-Workers in a round-robin fashion.
 //  -   Each R-Worker compresses/decompresses the files in the sub-partition received.
-//  -   The Merger reassembles the compressed/decompressed files.
+//      The blocks of big files are written by the R-Workers themselves, in
+//      parallel, on the output opened by the L-Worker (see OutFile): with pwrite
+//      when compressing, straight into the mapped output when decompressing.
+//  -   The Merger only gets the position of each compressed block: once all the
+//      blocks of a file are done it writes the index of the archive and closes it.
+//      A decompressed file is closed by the R-Worker that finishes its last block.
+//
+//  With -S the small files (a single block) are not sent one by one: each
+//  L-Worker packs them in batches of about a block, and an R-Worker processes
+//  all the files of a batch in a loop with a single output buffer.
+//
+//  The blocks are never copied: the tasks point into the mapping of the file
+//  (the archive when decompressing) and hold a reference to it, the last block
+//  to be done unmaps it (see FileMapping), while the other files are still
+//  being processed.
+//
+//  In streaming mode (-M) the files are not mapped up front: the L-Workers map
+//  one block at a time and the R-Workers unmap it as soon as it has been processed.
+//  The memory in flight is bounded by a CreditGate shared by all the nodes.
+//
+//  With -U the reads and writes go through an IoRing (see uring.hpp): the
+//  R-Workers queue the writes of their output and go on with the next block,
+//  a completion thread releases the buffers (and closes the small files) once
+//  they are done. In streaming mode the L-Workers read the blocks into buffers
+//  of their pool, a few of them ahead, instead of mapping them (-U 2: with
+//  O_DIRECT when compressing). If io_uring is not available the blocking calls
+//  are used.
 //
 
 
 #include <utility.hpp>
 #include <cmdlinea2a.hpp>
+#include <uring.hpp>
+#include <autosplit.hpp>
 
 #include <cstdio>
 #include <string>
 #include <vector>
+#include <atomic>
+#include <unordered_map>
+#include <memory>
 #include <iostream>
+#include <thread>
 
 #include <time.h>
 
@@ -30,6 +63,64 @@
 using namespace ff;
 
 
+// The output of a multi-block file, shared by the tasks of its blocks.
+// When decompressing, the position of each block is known from the index: the
+// file is created with its final size and mapped (see outmap.hpp), the blocks
+// are decompressed in place and the last one done unmaps and closes it.
+// When compressing, each R-Worker takes the next free range of the archive
+// for its block as soon as it is compressed: the blocks are stored in the
+// order they are done, the index (in the order of the file) says where.
+struct OutFile {
+	int                   fd=-1;
+	std::atomic<uint64_t> end{sizeof(FileHeader)}; // compression: first free byte
+	std::atomic<size_t>   writes{0};       // -U: writes of blocks still in flight
+	std::atomic<bool>     ioFailed{false}; // -U: one of them failed
+	unsigned char        *map=nullptr;     // decompression: the mapped output
+	size_t                mapSize=0;
+	std::atomic<size_t>   left{0};         // decompression: blocks not done yet
+	std::atomic<bool>     failed{false};   // decompression: one of them failed
+};
+
+// A file mapped by the walker, shared by the tasks of its blocks (and of the
+// batches with the file): every one of them holds a reference, the L-Worker
+// splitting the file holds one too. The last one released unmaps the file.
+struct FileMapping {
+	unsigned char      *ptr;
+	size_t              size;
+	std::atomic<size_t> refs{1};
+};
+static inline FileMapping *acquireMapping(FileMapping *m) {
+	if (m) m->refs.fetch_add(1, std::memory_order_relaxed);
+	return m;
+}
+static inline void releaseMapping(FileMapping *m) {
+	if (!m || m->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+	unmapFile(m->ptr, m->size);
+	delete m;
+}
+
+// -U, streaming mode: blocks read ahead by an L-Worker (IO_READAHEAD at most),
+// the reads are submitted IO_BATCH at a time
+static const size_t IO_READAHEAD = 8;
+static const size_t IO_BATCH     = 4;
+static const size_t IO_ALIGN     = 4096;  // O_DIRECT: offsets, sizes and buffers
+
+
+// -S: a small file of a batch, it has its own output file
+struct Member {
+	std::string    filename;
+	unsigned char *ptr;              // the file, or its only compressed block
+	size_t         size;             // input size
+	size_t         rawSize;          // uncompressed size
+	uint32_t       crc;              // decompression: checksum of the block
+	uint32_t       flags=0;          // decompression: BLOCK_STORED or 0
+	unsigned char *mapBase=nullptr;  // streaming mode: mapping to release once done
+	size_t         mapSize=0;
+	FileMapping   *file=nullptr;     // otherwise: the file ptr points into
+};
+// a batch is sent as soon as it has about a block of data, or this many files
+static const size_t BATCH_MAX_FILES = 1024;
+
 struct Task {
     Task(unsigned char *ptr, size_t size, const std::string &name):
         ptr(ptr),size(size),filename(name) {}
@@ -41,182 +132,614 @@ struct Task {
     size_t            blockid=1;     // block identifier (for "BIG files")
     size_t            nblocks=1;     // #blocks in which a "BIG file" is split
 	size_t			  nfiles=1;      // #files in a directory
-	size_t            lastBlock=0;   // last block size
+	size_t            rawSize=0;     // uncompressed size of the block
+	uint32_t          crc=0;         // checksum of the compressed block
+	uint32_t          flags=0;       // BLOCK_STORED if the block is not compressed
     const std::string filename;      // source file name
 	bool			  compress=true;  // compress or decompress
 	bool			  isSingleBlock=true; // single block file
-	unsigned char     *filePtr=nullptr; // original pointer
+	FileMapping       *file=nullptr; // the file ptr points into (not in streaming mode), released once the block is done
+	unsigned char     *mapBase=nullptr; // streaming mode: mapping to release once the block is done
+	BufferPool        *inPool=nullptr;  // -U streaming mode: ptr is a buffer of this pool
+	size_t            mapSize=0;     // streaming mode: size of the mapping
+	size_t            credits=0;     // streaming mode: credits to give back to the gate
+	BufferPool        *pool=nullptr; // pool ptrOut comes from
+	size_t            skip=0;        // range mode: uncompressed bytes of the block to skip
+	size_t            keep=0;        // range mode: uncompressed bytes of the block to keep
+	size_t            outOffset=0;   // position of the block in the output file
+	OutFile           *out=nullptr;  // multi-block files: where the block is written
+	std::vector<BlockEntry> entries; // compression: its index entries, one per piece with restart points
+	size_t            dupOf=0;       // -H: the earlier block (blockid) with the same content, 0 if none
+	bool              failed=false;  // the block could not be processed
+	std::vector<Member> batch;       // -S: the small files of the task, if any
 };
 
+// name of the decompressed file: the archive name without SUFFIX,
+// in range mode the slice goes to a different file
+static inline std::string decompressedName(const std::string &fname) {
+	const std::string name = fname.substr(0, fname.size() - 4);
+	return rangemode ? name + ".range" : name;
+}
+
 
 struct L_Worker : ff::ff_monode_t<Task> {
-    L_Worker(const std::vector<FileData>& group) : group(group) {}
+    L_Worker(ScanQueue<FileData> *files, CreditGate *gate=nullptr, IoRing *io=nullptr,
+			 SplitTuner *tuner=nullptr, size_t idx=0) :
+		files(files), gate(gate), io(gate ? io : nullptr), tuner(tuner), idx(idx),
+		clock(tuner ? tuner->clockL(idx) : nullptr) {}
+	~L_Worker() { delete pool; }
+
+	// -U, streaming mode: the blocks are read in buffers of this pool, given
+	// back by the R-Workers. Its slabs are registered with the ring.
+	int svc_init() {
+		traceThread("L-Worker", get_my_id());
+		if (io && !pool) {
+			pool = new BufferPool(compressBound(BIGFILE_LOW_THRESHOLD));
+			pool->setSlabHook([this](unsigned char *base, size_t size) { io->addBuffers(base, size); });
+		}
+		return 0;
+	}
 
 
+	// -T: the blocks queued to the R-Workers are counted from here to R_Worker::svc
+	// -A: to the active R-Worker with the fewest blocks queued, a full queue is not work
+	void send(Task *t) {
+		traceLevel(TL_BLOCKS, 1);
+		if (!tuner) {
+			ff_send_out(t);
+			return;
+		}
+		WorkerClock::Pause pause(clock);
+		ff_send_out_to(t, tuner->pickR());
+	}
+
+	/* Open the output of a multi-block file, shared by the tasks of its blocks.
+	 * When compressing, the header of the archive is written right away,
+	 * the index by the Merger once all the blocks have been written.
+	 * When decompressing, the output (rawSize bytes, nblocks blocks) is mapped. */
+	OutFile *openOutFile(const std::string &fname, size_t rawSize=0, size_t nblocks=0) {
+		const std::string outfile = comp ? fname + SUFFIX : decompressedName(fname);
+		OutFile *out = new OutFile;
+		if (!comp) {
+			if (!mapOutputFile(outfile, rawSize, out->fd, out->map)) {
+				delete out;
+				return nullptr;
+			}
+			out->mapSize = rawSize;
+			out->left    = nblocks;
+			return out;
+		}
+		out->fd = open(outfile.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+		if (out->fd < 0) {
+			perror("open");
+			std::cerr << "Failed to open output file: " << outfile << std::endl;
+			delete out;
+			return nullptr;
+		}
+		const FileHeader hdr = containerHeader(BIGFILE_LOW_THRESHOLD);
+		if (!writeAll(out->fd, &hdr, sizeof(hdr))) {
+			std::cerr << "Failed to write output file: " << outfile << std::endl;
+			close(out->fd);
+			delete out;
+			return nullptr;
+		}
+		return out;
+	}
+
+	/* -S: the small files are added to a batch, sent once it has about a block of data. */
+	void addToBatch(Member m, size_t credits) {
+		batchBytes   += m.size;
+		batchCredits += credits;
+		m.file = acquireMapping(mapping);
+		batch.push_back(std::move(m));
+		if (batchBytes >= BIGFILE_LOW_THRESHOLD || batch.size() >= BATCH_MAX_FILES) flushBatch();
+	}
+	void flushBatch() {
+		if (batch.empty()) return;
+		Task *t = new Task(nullptr, batchBytes, "");
+		t->batch.swap(batch);
+		t->credits = batchCredits;
+		batchBytes = batchCredits = 0;
+		send(t);
+	}
+	/* Streaming mode: the credits of a block. If they are not available the
+	 * batch is sent out before waiting, the gate may be waiting for the
+	 * credits it holds. */
+	void acquireCredits(size_t credits) {
+		if (gate->tryAcquire(credits)) return;
+		flushBatch();
+		drainReads();
+		WorkerClock::Pause pause(clock);
+		gate->acquire(credits);
+	}
+
+	/* -U, streaming mode: the block of t (len bytes at offset of fd) is read in
+	 * a buffer of the pool instead of being mapped. The task is sent out by
+	 * sendRead, in order, once the block is there. */
+	void queueRead(Task *t, int fd, uint64_t offset, size_t len, bool direct) {
+		// O_DIRECT reads whole sectors, the last one is short at the end of the file
+		const size_t n = direct ? (len + IO_ALIGN - 1) / IO_ALIGN * IO_ALIGN : len;
+		t->ptr    = pool->get(n);
+		t->inPool = pool;
+		reads.emplace_back();
+		PendingRead *pr = &reads.back();
+		pr->task = t;
+		ops.push_back({false, fd, t->ptr, n, offset, [pr](ssize_t r) {
+			pr->res = r;
+			pr->done.store(true);
+			pr->done.notify_one();
+		}});
+		if (ops.size() >= IO_BATCH) io->submit(ops);
+		if (reads.size() > IO_READAHEAD) sendRead();
+	}
+	// waits for the oldest read and sends its task out
+	void sendRead() {
+		if (!ops.empty()) io->submit(ops);
+		PendingRead &pr = reads.front();
+		if (!pr.done.load()) {
+			TraceSpan wait(TR_WAIT);
+			WorkerClock::Pause pause(clock);
+			pr.done.wait(false);
+		}
+		Task *t = pr.task;
+		const ssize_t res = pr.res;
+		reads.pop_front();
+		if (res < (ssize_t)t->size) {
+			if (res < 0) errno = -res;
+			perror("read");
+			std::fprintf(stderr, "Failed to read block %zu of file %s\n", t->blockid, t->filename.c_str());
+			readFailed = true;
+			t->inPool->put(t->ptr);
+			t->inPool = nullptr;
+			t->ptr    = nullptr;
+			// it still counts to close the output, its credits go back with it
+			if (t->out) {
+				t->failed = true;
+				send(t);
+				return;
+			}
+			gate->release(t->credits);
+			delete t;
+			return;
+		}
+		markDuplicate(t);
+		send(t);
+	}
+	/* -H 1: a block of a multi-block file equal to an earlier one of the same
+	 * file is marked, it is not compressed. In streaming mode (dedupFd) the
+	 * earlier block may have been released already, it is read back to be
+	 * compared. */
+	void markDuplicate(Task *t) {
+		if (!DEDUP || !comp || t->isSingleBlock) return;
+		const size_t dup = dedupFd >= 0 ? dedup.find(t->blockid - 1, t->ptr, t->size, dedupFd, BIGFILE_LOW_THRESHOLD)
+		                                : dedup.find(t->blockid - 1, t->ptr, t->size);
+		dedupStats.addBlock(t->size, dup != BlockDedup::NONE);
+		if (dup != BlockDedup::NONE) t->dupOf = dup + 1;
+	}
+	/* Streaming mode: the blocks from..nblocks (blockid) of a multi-block file
+	 * that will not be read. They are sent as failed, so that the output is
+	 * closed and removed once the blocks already sent are done. */
+	void failBlocks(OutFile *out, const std::string &fname, size_t from, size_t nblocks) {
+		if (!out) return;
+		for (size_t b = from; b <= nblocks; ++b) {
+			Task *t = new Task(nullptr, 0, fname);
+			t->blockid       = b;
+			t->nblocks       = nblocks;
+			t->isSingleBlock = false;
+			t->out           = out;
+			t->failed        = true;
+			send(t);
+		}
+	}
+	// sends out all the blocks being read, false if any read of the file failed
+	bool drainReads() {
+		while (!reads.empty()) sendRead();
+		const bool ok = !readFailed;
+		return ok;
+	}
+
 	/* The function will check if the file is a large file.
 	   * if not, it will send the file to the next stage
 	   * if it is, it will partition the file and send the partitions to the next stage */ 
 	bool doWorkCompress(unsigned char *ptr, size_t size, const std::string &fname) {
-		if (size<= BIGFILE_LOW_THRESHOLD) {
+		if (size<= BIGFILE_LOW_THRESHOLD && batching) {
+			addToBatch({fname, ptr, size, size, 0}, 0);
+		} else if (size<= BIGFILE_LOW_THRESHOLD) {
 			/* if a file is smaller than the threshold it does not need partitioning */
 			/* we save the information to create the header */
 			Task *t = new Task(ptr, size, fname);
+			t->file=acquireMapping(mapping);
 			t->isSingleBlock=true;
 			t->nblocks=1;
-			t->lastBlock=size;
-			ff_send_out(t); // sending to the next stage
+			t->rawSize=size;
+			send(t); // sending to the next stage
 		} else {
 			/* if a file is bigger than the threshold it needs partitioning */
+			OutFile *out = openOutFile(fname);
+			if (!out) return false;
+			dedup.reset();
 			const size_t fullblocks  = size / BIGFILE_LOW_THRESHOLD;
 			const size_t partialblock= size % BIGFILE_LOW_THRESHOLD;
 			for(size_t i=0;i<fullblocks;++i) {
 				Task *t = new Task(ptr+(i*BIGFILE_LOW_THRESHOLD), BIGFILE_LOW_THRESHOLD, fname);
+				t->file=acquireMapping(mapping);
 				t->blockid=i+1;
 				t->nblocks=fullblocks+(partialblock>0);
 				t->isSingleBlock=false;
+				t->rawSize=BIGFILE_LOW_THRESHOLD;
+				t->out=out;
+				markDuplicate(t);
 				// the files are sent to the next stage in a round-robin fashion
-				ff_send_out(t); // sending to the next stage
+				send(t); // sending to the next stage
 			}
 			if (partialblock) {
 				Task *t = new Task(ptr+(fullblocks*BIGFILE_LOW_THRESHOLD), partialblock, fname);
+				t->file=acquireMapping(mapping);
 				t->blockid=fullblocks+1;
 				t->nblocks=fullblocks+1;
 				t->isSingleBlock=false;
-				ff_send_out(t); // sending to the next stage
+				t->rawSize=partialblock;
+				t->out=out;
+				markDuplicate(t);
+				send(t); // sending to the next stage
 			}
 		}
 		return true;
     }
 
 
-	/* The same as before but the partitioning will be done according to the header informations. */
+	/* The blocks of the archive to decompress: all of them or, in range mode,
+	 * only the ones covering the requested range. False if there are none. */
+	bool selectBlocks(const ContainerReader &reader, const std::string &fname, size_t &first, size_t &last) {
+		if (!rangemode) {
+			first = 0;
+			last  = reader.nblocks() - 1;
+			return reader.nblocks() > 0;
+		}
+		if (!reader.blockRange(rangeOffset, rangeLength, first, last)) {
+			if (QUITE_MODE>=1) std::fprintf(stderr, "The range is past the end of file %s\n", fname.c_str());
+			return false;
+		}
+		return true;
+	}
+	/* The size of the output: the whole file or, in range mode, the range. */
+	size_t outputSize(const ContainerReader &reader, size_t last) {
+		if (!rangemode) return reader.rawSize();
+		const uint64_t stop = reader.rawOffset(last) + reader.block(last).rawSize;
+		return std::min<uint64_t>(stop, rangeOffset + std::min<uint64_t>(rangeLength, stop)) - rangeOffset;
+	}
+	/* In range mode even a single block goes through the multi-block path. */
+	bool singleBlock(const ContainerReader &reader) {
+		return !rangemode && (reader.nblocks() == 1);
+	}
+	/* Fill the task of block i (of the selected blocks [first, last]). */
+	void setBlock(Task *t, const ContainerReader &reader, size_t i, size_t first, size_t last, OutFile *out) {
+		const BlockEntry &e = reader.block(i);
+		t->blockid = i - first + 1;
+		t->nblocks = last - first + 1;
+		t->isSingleBlock = singleBlock(reader);
+		t->out = out;
+		t->rawSize = e.rawSize;
+		t->crc = e.crc;
+		t->flags = e.flags;
+		const size_t start = reader.rawOffset(i);
+		t->outOffset = start;
+		if (rangemode) {
+			const size_t end   = std::min(start + e.rawSize, rangeOffset + rangeLength);
+			t->skip = (rangeOffset > start) ? rangeOffset - start : 0;
+			t->keep = end - start - t->skip;
+			t->outOffset = start + t->skip - rangeOffset;
+		}
+	}
+
+	/* The same as before but the partitioning is done according to the index of the archive. */
 	bool doWorkDecompress(unsigned char *ptr, size_t size, const std::string &fname) {
 		
-		// Read the header to determine if it's a single block or multi-block file
-		size_t header;
-		memcpy(&header, ptr, sizeof(header));
-		
-		if (header == 1) {
-			// Single block file
-			ff_send_out(new Task(ptr, size, fname));
+		// the index is at the end of the archive, it has the position and the sizes of each block
+		ContainerReader reader;
+		if (!reader.open(ptr, size)) {
+			std::cerr << "Error with the header during decompression (" << reader.error() << "): " << fname << std::endl;
+			return false;
+		}
+		if (QUITE_MODE>2) std::cout << "numBlocks: " << reader.nblocks() << std::endl;
+		if (batching && singleBlock(reader)) {
+			const BlockEntry &e = reader.block(0);
+			addToBatch({fname, const_cast<unsigned char*>(reader.blockData(0)), e.cmpSize, e.rawSize, e.crc, e.flags}, 0);
 			return true;
-		} else {
-			// Multi-block file
-			size_t numBlocks = header;
-
-			// Read the sizes of each block
-			if (QUITE_MODE>2) std::cout << "numBlocks: " << numBlocks << std::endl;
-			std::vector<size_t> blockSizes(numBlocks);
-			for (size_t i = 0; i < numBlocks; ++i) {
-				size_t blockSize;
-				// we have to consider the offset of the header
-				memcpy(&blockSize, ptr + sizeof(header) + i * sizeof(blockSize), sizeof(blockSize));
-				blockSizes[i] = blockSize;
+		}
+		size_t first, last;
+		if (!selectBlocks(reader, fname, first, last)) return true;
+		OutFile *out = nullptr;
+		if (!singleBlock(reader) && !(out = openOutFile(fname, outputSize(reader, last), last - first + 1))) return false;
+
+		// the blocks are not copied, the tasks point into the mapping of the archive
+		for (size_t i = first; i <= last; ++i) {
+			Task *t = new Task(const_cast<unsigned char*>(reader.blockData(i)), reader.block(i).cmpSize, fname);
+			t->file = acquireMapping(mapping);
+			setBlock(t, reader, i, first, last, out);
+			send(t);
+		}
+		return true;
+	}
+
+	/* Streaming version of doWorkCompress: the file is not mapped in memory,
+	 * each block is mapped just before being sent to the R-Workers, and only
+	 * once enough credits are available (input block + compressed output). */
+	bool doWorkCompressLazy(size_t size, const std::string &fname) {
+		int fd = open(fname.c_str(), O_RDONLY);
+		if (fd<0) {
+			perror("open");
+			std::fprintf(stderr, "Failed opening file %s\n", fname.c_str());
+			return false;
+		}
+		const size_t nblocks = (size<=BIGFILE_LOW_THRESHOLD) ? 1 : (size+BIGFILE_LOW_THRESHOLD-1)/BIGFILE_LOW_THRESHOLD;
+		if (batching && nblocks == 1) {
+			const size_t credits = size + compressBound(size);
+			acquireCredits(credits);
+			Member m{fname, nullptr, size, size, 0};
+			const bool ok = mapRegion(fd, 0, size, m.mapBase, m.mapSize, m.ptr);
+			if (ok) addToBatch(std::move(m), credits);
+			else    gate->release(credits);
+			close(fd);
+			return ok;
+		}
+		OutFile *out = nullptr;
+		if (nblocks > 1 && !(out = openOutFile(fname))) {
+			close(fd);
+			return false;
+		}
+		// -U 2: the blocks start at multiples of the block size, they can be read with O_DIRECT
+		const int dfd = (io && iomode == 2) ? open(fname.c_str(), O_RDONLY|O_DIRECT) : -1;
+		readFailed = false;
+		dedup.reset();
+		dedupFd = fd;
+		for(size_t i=0;i<nblocks;++i) {
+			const size_t offset = i*BIGFILE_LOW_THRESHOLD;
+			const size_t len    = (nblocks==1) ? size : std::min(size-offset, BIGFILE_LOW_THRESHOLD);
+			const size_t credits= len + compressBound(len);
+			acquireCredits(credits);
+			Task *t = new Task(nullptr, len, fname);
+			t->credits=credits;
+			t->blockid=i+1;
+			t->nblocks=nblocks;
+			t->isSingleBlock=(nblocks==1);
+			t->rawSize=len;
+			t->out=out;
+			if (io) {
+				queueRead(t, dfd >= 0 ? dfd : fd, offset, len, dfd >= 0);
+				continue;
 			}
-			/* when decompressing a multi-block file, every block will be BIGFILE_LOW_THRESHOLD
-			 * except the last one that will be the remaining size */
-			size_t lastBlock;
-			memcpy(&lastBlock, ptr + sizeof(header) + numBlocks * sizeof(size_t), sizeof(lastBlock));
-
-			//calculate the size of the header, which will be the offset
-			size_t headerSize = sizeof(header) + numBlocks * sizeof(size_t) + sizeof(lastBlock);
-
-			//now we have the information to read the data
-			size_t currentPos = 0; // this keeps track of the current position of the header
-
-			// Read the compressed data of each block
-			for (size_t i = 0; i < numBlocks; ++i) {
-				
-				size_t blockSize = blockSizes[i];
-				unsigned char *blockDataPtr = new unsigned char[blockSize];
-				// for retrieving the data we have to consider the offset of the header
-				memcpy(blockDataPtr, ptr + headerSize + currentPos, blockSize);
-				currentPos += blockSize;
-				
-				Task *t = new Task(blockDataPtr, blockSize, fname);
-				t->blockid = i + 1;
-				t->nblocks = numBlocks;
-				t->isSingleBlock = false;
-				if (i == numBlocks - 1) {
-					t->size = lastBlock;
-				}
-				ff_send_out(t);
+			if (!mapRegion(fd, offset, len, t->mapBase, t->mapSize, t->ptr)) {
+				gate->release(credits);
+				delete t;
+				failBlocks(out, fname, i + 1, nblocks);
+				drainReads();
+				dedupFd = -1;
+				if (dfd >= 0) close(dfd);
+				close(fd);
+				return false;
 			}
+			markDuplicate(t);
+			send(t);
+		}
+		const bool ok = drainReads();
+		dedupFd = -1;
+		if (dfd >= 0) close(dfd);
+		close(fd);
+		return ok;
+	}
 
-			// CHECK since i send copy of the datablock I should be able to delete the original one
+	/* Streaming version of doWorkDecompress: the index is read with pread,
+	 * then each compressed block is mapped only when it is sent out. */
+	bool doWorkDecompressLazy(size_t size, const std::string &fname) {
+		int fd = open(fname.c_str(), O_RDONLY);
+		if (fd<0) {
+			perror("open");
+			std::fprintf(stderr, "Failed opening file %s\n", fname.c_str());
+			return false;
+		}
+		ContainerReader reader;
+		if (!reader.open(fd, size)) {
+			std::cerr << "Error with the header during decompression (" << reader.error() << "): " << fname << std::endl;
+			close(fd);
+			return false;
+		}
+		if (batching && singleBlock(reader)) {
+			const BlockEntry &e = reader.block(0);
+			const size_t credits = e.cmpSize + e.rawSize;
+			acquireCredits(credits);
+			Member m{fname, nullptr, e.cmpSize, e.rawSize, e.crc, e.flags};
+			const bool ok = mapRegion(fd, e.offset, e.cmpSize, m.mapBase, m.mapSize, m.ptr);
+			if (ok) addToBatch(std::move(m), credits);
+			else    gate->release(credits);
+			close(fd);
+			return ok;
+		}
+		size_t first, last;
+		if (!selectBlocks(reader, fname, first, last)) {
+			close(fd);
 			return true;
 		}
-		std::cerr << "Error with the header during decompression" << std::endl;
-		return false;
+		OutFile *out = nullptr;
+		if (!singleBlock(reader) && !(out = openOutFile(fname, outputSize(reader, last), last - first + 1))) {
+			close(fd);
+			return false;
+		}
+		readFailed = false;
+		for (size_t i = first; i <= last; ++i) {
+			const BlockEntry &e = reader.block(i);
+			const size_t credits = e.cmpSize + e.rawSize;
+			acquireCredits(credits);
+			Task *t = new Task(nullptr, e.cmpSize, fname);
+			t->credits = credits;
+			setBlock(t, reader, i, first, last, out);
+			if (io) {
+				queueRead(t, fd, e.offset, e.cmpSize, false);
+				continue;
+			}
+			if (!mapRegion(fd, e.offset, e.cmpSize, t->mapBase, t->mapSize, t->ptr)) {
+				gate->release(credits);
+				delete t;
+				failBlocks(out, fname, i - first + 1, last - first + 1);
+				drainReads();
+				close(fd);
+				return false;
+			}
+			send(t);
+		}
+		const bool ok = drainReads();
+		close(fd);
+		return ok;
 	}
 
 	/* Task for the Left Workers */
      
     Task *svc(Task *task) {
 
-		// for each file assigned to this worker
-        for (size_t i = 0; i < group.size(); ++i) {
-			const FileData& file = group[i];
-			if (comp){
-				if (!doWorkCompress(file.ptr, file.size, file.filename)){
-					error("doWorkCompress\n");
+		// for each file taken from the queue, until the walker is done.
+		// -A: a parked L-Worker waits here until it is active again or the files are over
+		FileData file(nullptr, "", 0);
+        while ((!tuner || tuner->waitActive(idx)) && files->pop(file)) {
+			TraceSpan span(TR_DISPATCH);
+			span.bytes(file.size, 0);
+			WorkerClock::Run run(clock);
+			if (gate) {
+				bool ok = comp ? doWorkCompressLazy(file.size, file.filename)
+					           : doWorkDecompressLazy(file.size, file.filename);
+				if (!ok) {
+					error("doWorkLazy\n");
+					if (tuner) tuner->filesDone();
 					return EOS;
 				}
+				continue;
 			}
-			else{
-				if (!doWorkDecompress(file.ptr, file.size, file.filename)){
-					error("doWorkDecompress\n");
-					return EOS;
-				}
+			// the tasks of the file take their references while it is split
+			mapping = file.ptr ? new FileMapping{file.ptr, file.size} : nullptr;
+			const bool ok = comp ? doWorkCompress(file.ptr, file.size, file.filename)
+				                 : doWorkDecompress(file.ptr, file.size, file.filename);
+			releaseMapping(mapping);
+			mapping = nullptr;
+			if (!ok) {
+				error(comp ? "doWorkCompress\n" : "doWorkDecompress\n");
+				if (tuner) tuner->filesDone();
+				return EOS;
 			}
 		}
+		// the parked L-Workers leave too
+		if (tuner) tuner->filesDone();
+		// the last, partial, batch
+		flushBatch();
         
         return EOS;
 
     }
 	private:
-		std::vector<FileData> group;
+		// -U: a block being read, its task is sent once done is set
+		struct PendingRead {
+			Task             *task=nullptr;
+			ssize_t           res=0;
+			std::atomic<bool> done{false};
+		};
+		ScanQueue<FileData> *files;
+		CreditGate *gate;
+		IoRing     *io;                  // -U, only in streaming mode
+		SplitTuner *tuner;               // -A
+		const size_t idx;
+		WorkerClock *clock;
+		BufferPool *pool=nullptr;
+		std::deque<PendingRead> reads;   // in the order of the blocks
+		std::vector<IoOp> ops;           // reads not submitted yet
+		bool readFailed=false;
+		BlockDedup dedup;                // -H: the blocks of the file being split
+		int dedupFd=-1;                  // -H, streaming mode: the file, to read the earlier blocks back
+		FileMapping *mapping=nullptr;    // the file being split, if mapped up front
+		std::vector<Member> batch;   // -S: the small files not sent yet
+		size_t batchBytes=0;
+		size_t batchCredits=0;
 };
 
 //--------------------------------------------------------------------
 // R_Worker: compress/decompress the files
 // If the block is a single file, it will be handled by the worker
-// If the block is part of a multi-block file, it will be sent to the merger
+// If the block is part of a multi-block file, it is written by the worker
+// and its position is sent to the merger
 
 struct R_Worker : ff_minode_t<Task> {
-    R_Worker(size_t Lw) : Lw(Lw) {}
+    R_Worker(size_t Lw, CreditGate *gate=nullptr, IoRing *io=nullptr, SplitTuner *tuner=nullptr, size_t idx=0) :
+		Lw(Lw), gate(gate), io(io), tuner(tuner), idx(idx), clock(tuner ? tuner->clockR(idx) : nullptr) {}
+	~R_Worker() { delete pool; delete codec; }
+
+	// the output buffers are given back to this pool as soon as the block
+	// has been written.
+	// The pool is created here so that its pages are first touched by this thread.
+	// The codec keeps the deflate/inflate state of this worker across blocks.
+	int svc_init() {
+		if (!pool)  pool  = new BufferPool(compressBound(BIGFILE_LOW_THRESHOLD));
+		if (!codec) codec = new Codec(LEVEL, STRATEGY, RESTART_INTERVAL);
+		traceThread("R-Worker", get_my_id());
+		if (io) pool->setSlabHook([this](unsigned char *base, size_t size) { io->addBuffers(base, size); });
+		return 0;
+	}
 
     Task *svc(Task *in) {
-        
+		traceLevel(TL_BLOCKS, -1);
+		if (tuner) tuner->taken(idx);
+		WorkerClock::Run run(clock);
+		// a block the L-Worker could not read, it only counts to close its file
+		if (in->failed) {
+			failBlock(in);
+			return GO_ON;
+		}
+		if (!in->batch.empty()) {
+			processBatch(in);
+			return GO_ON;
+		}
+		if (comp && in->dupOf) {
+			// -H: only the Merger has something to do, the entries of the first copy are repeated
+			doneBlock(in);
+			return GO_ON;
+		}
 		if (comp) {
 			//--------------compression
 			unsigned char * inPtr = in->ptr;	
 			size_t          inSize= in->size;
 			// get an estimation of the maximum compression size
 			size_t cmp_len = compressBound(inSize);
-			// allocate memory to store compressed data in memory
-			unsigned char *ptrOut = new unsigned char[cmp_len];
-			if (compress(ptrOut, &cmp_len, (const unsigned char *)inPtr, inSize) != Z_OK) {
-				if (QUITE_MODE>=1) std::fprintf(stderr, "Failed to compress file in memory\n");
-				//success = false;
-				delete [] ptrOut;
-				delete in;
-				return GO_ON;
+			// get a buffer to store compressed data in memory
+			unsigned char *ptrOut = pool->get(cmp_len);
+			in->pool = pool;
+			// the blocks that do not compress are stored as they are
+			uint32_t flags;
+			const auto t0 = std::chrono::steady_clock::now();
+			{
+				TraceSpan span(TR_COMPRESS);
+				if (codec->encode(ptrOut, &cmp_len, (const unsigned char *)inPtr, inSize, flags) != Z_OK) {
+					if (QUITE_MODE>=1) std::fprintf(stderr, "Failed to compress file in memory\n");
+					//success = false;
+					pool->put(ptrOut);
+					failBlock(in);
+					return GO_ON;
+				}
+				span.bytes(inSize, cmp_len);
 			}
+			if (DEDUP) dedupStats.addEncode(t0, inSize);
+			releaseInput(in);
 			//cmp_len now has the real size of the compressed data
 			in->ptrOut   = ptrOut;
 			in->cmp_size = cmp_len;
+			in->crc      = blockChecksum(ptrOut, cmp_len);
+			in->flags    = flags;
 			bool oneblockfile = (in->nblocks == 1);
             if (oneblockfile) { // single block file compression are handled without the merger
 				if(VERBOSE) std::cout << "Compressing single block file: " << in->filename << std::endl;
                 if(!handleSingleBlock(in)){
 					std::cerr << "Failed to compress single block file: " << in->filename << std::endl;
-					delete in;
+					cleanupTask(in);
 					return GO_ON;
 				}
-			// multi-block files are sent to the merger
+			// the blocks of multi-block files are written here, the merger writes the index
 			} else {
-				ff_send_out(in);
+				writeBlock(in);
 			}
 			return GO_ON;
 
@@ -224,33 +747,39 @@ struct R_Worker : ff_minode_t<Task> {
 		//--------------decompression
 		// to refactor to use the same style as the compression for clarity
 		else{
+			// the checksum of the block is in the index of the archive
+			if (blockChecksum(in->ptr, in->size) != in->crc) {
+				std::cerr << "Corrupted block: " << in->blockid << " of file: " << in->filename << std::endl;
+				failBlock(in);
+				return GO_ON;
+			}
 			if (in->isSingleBlock) {
 				if(VERBOSE) std::cout << "Decompressing single block file: " << in->filename << std::endl;
 				// Decompress a single block file
 				if (!decompressSingleBlock(in)) {
 					std::cerr << "Failed to decompress single block file: " << in->filename << std::endl;
-					delete in;
+					cleanupTask(in);
 					return GO_ON;
 				}
 			} else {
-				// Decompress a multi-block file		
-				// if it is not the last block, the size is BIGFILE_LOW_THRESHOLD		
-				unsigned long decmp_len = BIGFILE_LOW_THRESHOLD; // block upper bound
-				// If it is the last block, use the lastBlock size
-				if (in->lastBlock){
-					decmp_len = in->lastBlock;
-				}
-        		unsigned char *ptrOut = new unsigned char[decmp_len];
-				if (!decompressBlock(in->ptr, in->size, ptrOut, decmp_len)) {
+				// Decompress a multi-block file straight at its position in the mapped
+				// output, the uncompressed size of the block is in the index of the archive.
+				// In range mode the blocks cut by the range go through a buffer.
+				const bool inPlace = !rangemode || (in->skip == 0 && in->keep == in->rawSize);
+				size_t decmp_len = in->rawSize;
+				unsigned char *dst = inPlace ? in->out->map + in->outOffset : pool->get(decmp_len);
+				if (!decompressBlock(in->ptr, in->size, dst, decmp_len, in->flags) || decmp_len != in->rawSize) {
 					std::cerr << "Failed to decompress block: " << in->blockid << " of file: " << in->filename << std::endl;
-					delete[] ptrOut;
-					delete in;
+					if (!inPlace) pool->put(dst);
+					failBlock(in);
 					return GO_ON;
 				}
-				in->cmp_size = decmp_len;
-				in->ptrOut = ptrOut;
-				//to the merger since it is a multi-block file
-				ff_send_out(in);
+				releaseInput(in);
+				if (!inPlace) {
+					std::memcpy(in->out->map + in->outOffset, dst + in->skip, in->keep);
+					pool->put(dst);
+				}
+				finishBlock(in);
 			}
 			return GO_ON;
 		}
@@ -258,239 +787,408 @@ struct R_Worker : ff_minode_t<Task> {
 		return GO_ON;
 	}
 
-	/* Decompress a single block file, write the decompressed data to the output file
-	 * the data in input consists in the compressed data and the header.
-	 * For single block files the header is composed of three 8-byte values:
-	 * 1. A value of 1 to indicate it's a single block file
-	 * 2. The size of the compressed data
-	 * 3. The size of the uncompressed data */
-	
-	bool decompressSingleBlock(Task* in) {
+	/* -S: the files of a batch one after the other, with a single output buffer. */
+	void processBatch(Task* in) {
+		size_t bufSize = 0;
+		for (const Member &m : in->batch)
+			bufSize = std::max(bufSize, comp ? (size_t)compressBound(m.size) : m.rawSize);
+		unsigned char *buf = pool->get(bufSize);
+		for (Member &m : in->batch) {
+			const bool ok = comp ? compressMember(m, buf) : decompressMember(m, buf);
+			if (!ok)
+				std::cerr << "Failed to " << (comp ? "compress" : "decompress") << " file: " << m.filename << std::endl;
+			else if (REMOVE_ORIGIN)
+				unlink(m.filename.c_str());
+			if (m.mapBase) unmapFile(m.mapBase, m.mapSize);
+			releaseMapping(m.file);
+		}
+		pool->put(buf);
+		if (gate) gate->release(in->credits);
+		delete in;
+	}
+	bool compressMember(const Member &m, unsigned char *buf) {
+		size_t cmp_len = compressBound(m.size);
+		uint32_t flags;
+		{
+			TraceSpan span(TR_COMPRESS);
+			if (codec->encode(buf, &cmp_len, m.ptr, m.size, flags) != Z_OK) return false;
+			span.bytes(m.size, cmp_len);
+		}
+		TraceSpan span(TR_WRITE);
+		span.bytes(0, cmp_len);
+		ContainerWriter writer;
+		return writer.open(m.filename + SUFFIX, BIGFILE_LOW_THRESHOLD) &&
+			   writer.append(buf, cmp_len, m.size, blockChecksum(buf, cmp_len), flags) &&
+			   writer.close();
+	}
+	bool decompressMember(const Member &m, unsigned char *buf) {
+		if (blockChecksum(m.ptr, m.size) != m.crc) {
+			std::cerr << "Corrupted block: 1 of file: " << m.filename << std::endl;
+			return false;
+		}
+		size_t len = m.rawSize;
+		if (!decompressBlock(m.ptr, m.size, buf, len, m.flags) || len != m.rawSize) return false;
+		const std::string outfile = decompressedName(m.filename);
+		TraceSpan span(TR_WRITE);
+		span.bytes(0, len);
+		int fd = open(outfile.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+		if (fd < 0) {
+			perror("open");
+			return false;
+		}
+		const bool ok = writeAll(fd, buf, len);
+		return (close(fd) == 0) && ok;
+	}
 
-    	// Read the first three 8-byte values from the beginning of the file
-    	size_t* header = reinterpret_cast<size_t*>(in->ptr);
-		// get the size of the compressed data
-    	size_t uncompressedSize = header[2];
+	/* Decompress a single block file, write the decompressed data to the output file */
+	bool decompressSingleBlock(Task* in) {
 
-		// Prepare buffer for decompression
-		size_t compressedSize = in->size - (3 * sizeof(size_t));  // Exclude the header byte
-		// save the data without the header
-		unsigned char* compressedData = in->ptr + (3 * sizeof(size_t));
+		size_t uncompressedSize = in->rawSize;
 		// prepare the buffer for the decompressed data
-		unsigned char* uncompressedData = new unsigned char[uncompressedSize];
+		unsigned char* uncompressedData = pool->get(uncompressedSize);
 		// Decompress
-		if (!decompressBlock(compressedData, compressedSize, uncompressedData, uncompressedSize)) {
+		if (!decompressBlock(in->ptr, in->size, uncompressedData, uncompressedSize, in->flags) ||
+			uncompressedSize != in->rawSize) {
 			std::cerr << "Failed to decompress single block file: " << in->filename << std::endl;
+			pool->put(uncompressedData);
 			return false;
 		}
 
 		// Write decompressed data to output file
 		// Remove the ".zip" suffix
-		std::string outputFile = in->filename.substr(0, in->filename.size() - 4);
+		std::string outputFile = decompressedName(in->filename);
+		if (io) {
+			releaseInput(in);
+			in->ptrOut = uncompressedData;
+			in->pool   = pool;
+			AsyncOut *a = openAsync(outputFile, in);
+			if (!a) return false;
+			writeAsync(a, {{true, a->fd, uncompressedData, uncompressedSize, 0, nullptr}});
+			return true;
+		}
+		TraceSpan span(TR_WRITE);
+		span.bytes(0, uncompressedSize);
 		std::ofstream outFile(outputFile, std::ios::binary);
 
 		if (!outFile.is_open()) {
 			std::cerr << "Failed to open output file: " << outputFile << std::endl;
+			pool->put(uncompressedData);
 			return false;
 		}
 
-		// Write the decompressed data to the output file
+		// Write the decompressed data to the output file, the input is
+		// removed only once the output is complete
 		outFile.write(reinterpret_cast<char*>(uncompressedData), uncompressedSize);
+		outFile.close();
+		pool->put(uncompressedData);
+		if (outFile.fail()) {
+			std::cerr << "Failed to write output file: " << outputFile << std::endl;
+			return false;
+		}
 		if (REMOVE_ORIGIN) {
             	unlink(in->filename.c_str());
         }
-
-		delete[] uncompressedData;
-		delete[] compressedData;
 		cleanupTask(in);
-		outFile.close();
 
 		return true;
 	}
 
-	// Decompress a block of data
-	bool decompressBlock(unsigned char* input, size_t inputSize, unsigned char* output, size_t& outputSize) {
+	// Decompress a block of data, a stored block is just copied
+	bool decompressBlock(unsigned char* input, size_t inputSize, unsigned char* output, size_t& outputSize, uint32_t flags) {
 		int err;
-		if ((err = uncompress(output, &outputSize, input, inputSize)) != Z_OK) {
+		TraceSpan span(TR_DECOMPRESS);
+		if ((err = codec->decode(output, &outputSize, input, inputSize, flags)) != Z_OK) {
 			std::cerr << "Failed to decompress block, error: " << err << std::endl;
 			return false;
 		}
+		span.bytes(inputSize, outputSize);
 		return true;
 	}
 
-	/* Handle a single block file, write the compressed data to the output file
-	 * The data in input consists in the file's stream of data.
-	 * we have to add a header to the file to indicate that it is a single block file
-	 * with information about:
-	 * 1. Number of blocks (1 in this case)
-	 * 2. Compressed size of each block (1 in this case)
-	 * 3. Last block uncompressed size */
-
+	/* Handle a single block file, write the archive with its only block */
 	bool handleSingleBlock(Task* in) {
 		// add .zip to the output file
         std::string outfile = in->filename + SUFFIX;
-        std::ofstream outFile(outfile, std::ios::binary);
-        if (!outFile.is_open()) {
-            std::cerr << "Failed to open output file: " << outfile << std::endl;
+		if (io) {
+			// header, block, index and footer in a single submission
+			AsyncOut *a = openAsync(outfile, in);
+			if (!a) return false;
+			a->hdr = containerHeader(BIGFILE_LOW_THRESHOLD);
+			std::vector<BlockEntry> entries;
+			const size_t bytes = blockEntries(in->ptrOut, in->cmp_size, in->rawSize, in->crc, in->flags, sizeof(FileHeader), entries);
+			const Footer footer = containerFooter(entries.data(), entries.size(), sizeof(FileHeader) + bytes);
+			const size_t indexBytes = entries.size() * sizeof(BlockEntry);
+			a->tail.resize(indexBytes + sizeof(footer));
+			std::memcpy(a->tail.data(), entries.data(), indexBytes);
+			std::memcpy(a->tail.data() + indexBytes, &footer, sizeof(footer));
+			writeAsync(a, {{true, a->fd, (unsigned char *)&a->hdr, sizeof(FileHeader), 0, nullptr},
+						   {true, a->fd, in->ptrOut, bytes, sizeof(FileHeader), nullptr},
+						   {true, a->fd, a->tail.data(), a->tail.size(), sizeof(FileHeader) + bytes, nullptr}});
+			return true;
+		}
+        TraceSpan span(TR_WRITE);
+        span.bytes(0, in->cmp_size);
+        ContainerWriter writer;
+        if (!writer.open(outfile, BIGFILE_LOW_THRESHOLD) ||
+            !writer.append(in->ptrOut, in->cmp_size, in->rawSize, in->crc, in->flags) ||
+            !writer.close()) {
             return false;
         }
-
-        // Write a header indicating it's a single block file
-        size_t header = 1; // 1 indicates a single block
-        outFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
-		//save the compressed size
-		size_t cmp_size = in->cmp_size;
-		outFile.write(reinterpret_cast<const char*>(&cmp_size), sizeof(cmp_size));
-		//save the last block size
-		size_t lastBlock = in->lastBlock;
-		outFile.write(reinterpret_cast<const char*>(&lastBlock), sizeof(lastBlock));
-        // Write the compressed data
-        outFile.write(reinterpret_cast<const char*>(in->ptrOut), in->cmp_size);
 		
         if (REMOVE_ORIGIN) {
             unlink(in->filename.c_str());
         }
 
         cleanupTask(in);
-		outFile.close();
 		return true;
     }
 
+	/* Write a compressed block of a multi-block file: it takes the next free
+	 * range of the archive, the table of its restart points (if any) is not written. */
+	void writeBlock(Task* in) {
+		const size_t bytes = blockEntries(in->ptrOut, in->cmp_size, in->rawSize, in->crc, in->flags, 0, in->entries);
+		in->outOffset = in->out->end.fetch_add(bytes);
+		for (BlockEntry &e : in->entries) e.offset += in->outOffset;
+		in->cmp_size = bytes;
+		if (io) {
+			// the buffer and the credits are given back once the write is done,
+			// the Merger waits for it before closing the file
+			OutFile *out = in->out;
+			BufferPool *bpool = in->pool;
+			unsigned char *buf = in->ptrOut;
+			const size_t len = in->cmp_size, credits = in->credits;
+			CreditGate *g = gate;
+			out->writes.fetch_add(1);
+			std::vector<IoOp> ops{{true, out->fd, buf, len, in->outOffset, [=](ssize_t r) {
+				if (r != (ssize_t)len) out->ioFailed.store(true);
+				releaseBuffer(bpool, buf);
+				if (g) g->release(credits);
+				out->writes.fetch_sub(1, std::memory_order_release);  // the last access to out
+			}}};
+			io->submit(ops);
+			in->ptrOut  = nullptr;
+			in->credits = 0;
+			doneBlock(in);
+			return;
+		}
+		{
+			TraceSpan span(TR_WRITE);
+			span.bytes(0, in->cmp_size);
+			if (!pwriteAll(in->out->fd, in->ptrOut, in->cmp_size, in->outOffset)) {
+				std::cerr << "Failed to write block " << in->blockid << " of file: " << in->filename << std::endl;
+				in->failed = true;
+			}
+		}
+		doneBlock(in);
+	}
+
+	/* The memory (and the credits) of a block of a multi-block file are given
+	 * back right away, only the description of the block goes to the Merger. */
+	void doneBlock(Task* in) {
+		releaseInput(in);
+		releaseBuffer(in->pool, in->ptrOut);
+		in->ptrOut = nullptr;
+		if (gate) gate->release(in->credits);
+		in->credits = 0;
+		ff_send_out(in);
+	}
+
+	/* A block that cannot be processed: it still counts to close a multi-block file. */
+	void failBlock(Task* in) {
+		if (!in->out) {
+			cleanupTask(in);
+			return;
+		}
+		in->failed = true;
+		if (comp) doneBlock(in);
+		else      finishBlock(in);
+	}
+
+	/* Decompression: the block is in place in the mapped output, the Merger has
+	 * nothing to do. The last block of the file unmaps and closes it. */
+	void finishBlock(Task* in) {
+		OutFile *out = in->out;
+		const std::string filename = in->filename;
+		if (in->failed) out->failed = true;
+		cleanupTask(in);
+		if (out->left.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+		TraceSpan span(TR_WRITE);
+		span.bytes(0, out->mapSize);
+		if (!unmapOutputFile(out->fd, out->map, out->mapSize)) {
+			std::cerr << "Failed to write output file: " << decompressedName(filename) << std::endl;
+			out->failed = true;
+		}
+		if (out->failed) unlink(decompressedName(filename).c_str());
+		else if (REMOVE_ORIGIN) unlink(filename.c_str());
+		delete out;
+	}
+
+	/* The input of a task can be released as soon as it has been processed.
+	 * In streaming mode it is the mapping of the block, otherwise it is a
+	 * reference to the mapping of the whole file. */
+	void releaseInput(Task* in) {
+		releaseMapping(in->file);
+		in->file = nullptr;
+		if (in->mapBase) {
+			unmapFile(in->mapBase, in->mapSize);
+			in->mapBase = nullptr;
+		}
+		if (in->inPool) {
+			in->inPool->put(in->ptr);
+			in->inPool = nullptr;
+		}
+	}
+
+	/* -U: a small output file (a single block) written with io_uring. The last
+	 * of its writes to complete closes it, removes the origin if everything
+	 * went well and releases the task, on the completion thread. */
+	struct AsyncOut {
+		int                 fd=-1;
+		std::string         outfile;
+		Task               *task=nullptr;
+		CreditGate         *gate=nullptr;
+		std::atomic<size_t> left{0};
+		std::atomic<bool>   failed{false};
+		FileHeader          hdr;         // compression: the metadata of the archive
+		std::vector<unsigned char> tail; // the index and the footer, written together after the block
+	};
+	AsyncOut *openAsync(const std::string &outfile, Task *in) {
+		int fd = open(outfile.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+		if (fd < 0) {
+			perror("open");
+			std::cerr << "Failed to open output file: " << outfile << std::endl;
+			return nullptr;
+		}
+		AsyncOut *a = new AsyncOut;
+		a->fd = fd;
+		a->outfile = outfile;
+		a->task = in;
+		a->gate = gate;
+		return a;
+	}
+	void writeAsync(AsyncOut *a, std::vector<IoOp> ops) {
+		a->left = ops.size();
+		for (IoOp &op : ops) {
+			const size_t len = op.len;
+			op.done = [a, len](ssize_t r) {
+				if (r != (ssize_t)len) a->failed = true;
+				if (--a->left == 0) finishAsync(a);
+			};
+		}
+		io->submit(ops);
+	}
+	static void finishAsync(AsyncOut *a) {
+		if (close(a->fd) < 0) a->failed = true;
+		if (a->failed) std::cerr << "Failed to write output file: " << a->outfile << std::endl;
+		else if (REMOVE_ORIGIN) unlink(a->task->filename.c_str());
+		releaseBuffer(a->task->pool, a->task->ptrOut);
+		if (a->gate) a->gate->release(a->task->credits);
+		delete a->task;
+		delete a;
+	}
+
 	void cleanupTask(Task* in) {
-        unmapFile(in->ptr, in->size);  
-        delete[] in->ptrOut;
+		releaseInput(in);
+		releaseBuffer(in->pool, in->ptrOut);
+		if (gate) gate->release(in->credits);
         delete in;
     }
 
     
 	//bool success = true;
 	const size_t Lw;
+	CreditGate *gate;
+	IoRing     *io;                 // -U
+	SplitTuner *tuner;              // -A
+	const size_t idx;
+	WorkerClock *clock;
+	BufferPool *pool=nullptr;
+	Codec      *codec=nullptr;
 };
 
 
 
 //--------------------------------------------------------------------
-// Merger: reassemble the compressed/decompressed files
+// Merger: finalize the archives of the multi-block files. The blocks have already
+// been written by the R-Workers, it gets their position and, once all the blocks
+// of a file are done, writes the index and the footer of the archive.
+// It gets nothing when decompressing.
 
 struct Merger : ff_minode_t<Task> {
     Merger(size_t Rw) : Rw(Rw) {
         (void)Rw;  // This will mark the variable as "used"
     }
 
+	int svc_init() override {
+		traceThread("Merger");
+		return 0;
+	}
+
     Task* svc(Task* in) override {
-		// the worker will receive the blocks in the order they were sent
-		// the blocks are stored in a map, when all the blocks are received
-		// the blocks are reassembled in the correct order
-		handleMultiBlock(in);
-		// print just to use the Rw variable or it gives a warning
-		if (in->filename == "_warning_") {
-			std::cerr << "Error in Merger, R-workers: " << Rw << std::endl;
-		}
+		// the blocks of a file arrive in any order
+		handleBlock(in);
         return GO_ON;
     }
 
-	// FileMerger is a vector where we will store the recevied blocks, for each file.
 private:
-    struct FileMerger {
-        std::vector<Partition> partitions;
-    };
-	// we will use a map to manage the different files.
-    std::unordered_map<std::string, FileMerger> fileMergers; // Keyed by filename
-
-
-	/* The function is the same for both compression and decompression
-	 * The function will handle the blocks of a multi-block file
-	 * When all the blocks are received, the corresponding function
-	 * for compression or decompression will be called
-	*/
-    void handleMultiBlock(Task* in) {
-        auto& fileMerger = fileMergers[in->filename];
-		// note for decompression the in->cmp_size is the maximum size of the block BIGFILE_LOW_THRESHOLD
-        fileMerger.partitions.push_back({in->blockid, in->ptrOut, in->cmp_size, in->size});
-		// for the received file, if i have all the blocks, I can merge them
-        if (fileMerger.partitions.size() == in->nblocks) {
-			if (VERBOSE) std::cout << "Merging file: " << in->filename << std::endl;
-            if(comp){
-				std::string outfile = in->filename + SUFFIX;
-				regroupAndZip(outfile, fileMerger);
+	// the blocks of a file done so far
+	struct FileIndex {
+		std::vector<std::vector<BlockEntry>> blocks; // the entries of each block, in the order of the file
+		std::vector<size_t> dupOf;        // -H: for each block, the earlier one it repeats (blockid), or 0
+		size_t done=0;
+		bool failed=false;
+	};
+	std::unordered_map<OutFile*, FileIndex> files;
+
+	/* Once all the blocks of the file are done the archive is closed. */
+	void handleBlock(Task* in) {
+		OutFile *out = in->out;
+		auto& fi = files[out];
+		fi.blocks.resize(in->nblocks);
+		fi.dupOf.resize(in->nblocks);
+		fi.blocks[in->blockid - 1] = std::move(in->entries);
+		fi.dupOf[in->blockid - 1]  = in->dupOf;
+		fi.failed = fi.failed || in->failed;
+		++fi.done;
+		const std::string filename = in->filename;
+		const size_t nblocks = in->nblocks;
+		delete in;
+		if (fi.done < nblocks) return;
+
+		// all the blocks have been written, with -U the last writes may still be
+		// in flight: they are short, the Merger spins (the completion thread
+		// touches out until the very end, it cannot be woken up safely)
+		while (out->writes.load(std::memory_order_acquire) != 0) std::this_thread::yield();
+		fi.failed = fi.failed || out->ioFailed.load();
+		if (VERBOSE) std::cout << "Merging file: " << filename << std::endl;
+		TraceSpan span(TR_MERGE);
+		if (!fi.failed) {
+			// the index of the blocks and the footer, after the last block
+			std::vector<BlockEntry> index;
+			for (size_t b = 0; b < nblocks; ++b) {
+				const auto &e = fi.dupOf[b] ? fi.blocks[fi.dupOf[b] - 1] : fi.blocks[b];
+				index.insert(index.end(), e.begin(), e.end());
 			}
-			else{
-				std::string outfile = in->filename.substr(0, in->filename.size() - 4);
-				regroupAndWrite(outfile, fileMerger);
-
+			const uint64_t indexOffset = out->end.load();
+			const Footer footer = containerFooter(index.data(), index.size(), indexOffset);
+			const size_t indexBytes = index.size() * sizeof(BlockEntry);
+			if (!pwriteAll(out->fd, index.data(), indexBytes, indexOffset) ||
+				!pwriteAll(out->fd, &footer, sizeof(footer), indexOffset + indexBytes)) {
+				std::cerr << "Failed to write output file: " << filename + SUFFIX << std::endl;
+				fi.failed = true;
 			}
-			if (REMOVE_ORIGIN) {
-           		unlink(in->filename.c_str());
-        	}            
-			fileMergers.erase(in->filename); // Remove the completed file from map
-        }
-        delete in; // Cleanup task
-    }
-
-	// The function will reassemble the compressed blocks of a multi-block file
-	// and write the compressed data to the output file
-    void regroupAndWrite(const std::string &outputFilename, FileMerger& fileMerger) {
-		std::ofstream outFile(outputFilename, std::ios::binary);
-		if (!outFile.is_open()) {
-			std::cerr << "Failed to open output file: " << outputFilename << std::endl;
-			return;
 		}
-
-		// sort the blocks
-		std::sort(fileMerger.partitions.begin(), fileMerger.partitions.end(),
-				[](const Partition& a, const Partition& b) {
-					return a.npart < b.npart;
-				});
-
-		// Write the decompressed data of each block, in order.
-		// note that the blocks received are already cleaned from the header
-		for (const auto& part : fileMerger.partitions) {
-			outFile.write(reinterpret_cast<const char*>(part.ptr), part.size_part);
-			delete[] part.ptr;  // Clean up memory after use
+		if (close(out->fd) < 0) {
+			perror("close");
+			fi.failed = true;
 		}
-		outFile.close();
+		// a partial archive is removed, the original is kept
+		if (fi.failed) unlink((filename + SUFFIX).c_str());
+		else if (REMOVE_ORIGIN) unlink(filename.c_str());
+		files.erase(out);
+		delete out;
 	}
 
-	void regroupAndZip(const std::string &outputFilename, FileMerger& fileMerger) {
-        std::ofstream outFile(outputFilename, std::ios::binary);
-        if (!outFile.is_open()) {
-            std::cerr << "Failed to open output file: " << outputFilename << std::endl;
-            return;
-        }
-
-        // Write a header indicating it's a multi-block file
-     	size_t header = static_cast<size_t>(fileMerger.partitions.size()); // Number of blocks
-        outFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
-
-        // sort the blocks
-        std::sort(fileMerger.partitions.begin(), fileMerger.partitions.end(),
-                  [](const Partition& a, const Partition& b) {
-                      return a.npart < b.npart;
-                  });
-
-		//write the blocks sizes in the header
-    	for (const auto& part : fileMerger.partitions) {
-        	size_t partSize = static_cast<size_t>(part.size_part);
-        	outFile.write(reinterpret_cast<const char*>(&partSize), sizeof(partSize));
-    	}
-
-		// write the size of the last block uncompressed
-		size_t lastBlock = static_cast<size_t>(fileMerger.partitions[fileMerger.partitions.size() - 1].size_uncompressed);
-		outFile.write(reinterpret_cast<const char*>(&lastBlock), sizeof(lastBlock));
-
-		// Write the compressed data of each block
-        for (const auto& part : fileMerger.partitions) {
-            outFile.write(reinterpret_cast<const char*>(part.ptr), part.size_part);
-            delete[] part.ptr;  // Clean up memory after use
-        }
-        outFile.close();
-    }
-
-    void cleanupTask(Task* in) {
-        unmapFile(in->ptr, in->size);  
-        delete[] in->ptrOut;
-        delete in;
-    }
 	const size_t Rw;
 };
 
@@ -511,40 +1209,45 @@ int main(int argc, char *argv[]) {
 
 	ffTime(START_TIME);
 	
-	//fileDataVec is a vector of FileData with the information of the requested files
-	std::vector<FileData> fileDataVec;
-	//implementation in utils.hpp
-    if (!walkDirAndGetPtr(argv[start], fileDataVec, comp)) {
-        std::cerr << "Failed to walk directory" << std::endl;
-    }
-	if (VERBOSE){
-		for (auto& fileData : fileDataVec) {
-			// print fileData.filename, fileData.size, fileData.ptr
-			std::cout << "File: " << fileData.filename 
-					<< ", Size: " << fileData.size 
-					<< std::endl;
-		}
-	}
+	// in streaming mode the files are mapped block by block by the L-Workers
+	const bool streaming = (membudget > 0);
+	std::unique_ptr<CreditGate> gate;
+	if (streaming) gate = std::make_unique<CreditGate>(membudget);
 
 	if (VERBOSE){
 		std::cout << "Number of L-Workers: " << lworkers << std::endl;
 		std::cout << "Number of R-Workers: " << rworkers << std::endl;
 	}
-	const size_t Lw = lworkers;
-    const size_t Rw = rworkers;
-
-	// Distribute the files into groups, one for each L-Worker
-	std::vector<std::vector<FileData>> groups = distributeFiles(fileDataVec, Lw);
-
-    //Output the groups
-	if (VERBOSE) {
-		for (size_t i = 0; i < Lw; ++i) {
-			std::cout << "Group " << i + 1 << ":\n";
-			for (const auto& file : groups[i]) {
-				std::cout << "  " << file.filename << " (Size: " << file.size << ")\n";
+	// -A: the threads of both sets are started, the split is picked while running
+	std::unique_ptr<SplitTuner> tuner;
+	if (autosplit && lworkers > 0 && rworkers > 0) tuner = std::make_unique<SplitTuner>(lworkers, rworkers);
+	const size_t Lw = tuner ? tuner->threadsL() : lworkers;
+    const size_t Rw = tuner ? tuner->threadsR() : rworkers;
+
+	// the files are handed to the L-Workers as soon as the walker finds them,
+	// their mappings are released by the tasks (see FileMapping)
+	ScanQueue<FileData> files;
+	std::vector<FileData> fileDataVec;
+	std::mutex fileDataMtx;
+	std::thread scanner([&] {
+		//implementation in utility.hpp
+		bool ok = walkDirAndStream(argv[start], comp, streaming, [&](const FileData &fileData) {
+			if (VERBOSE) std::cout << "File: " + fileData.filename + ", Size: " + std::to_string(fileData.size) + "\n";
+			{
+				std::lock_guard<std::mutex> lock(fileDataMtx);
+				fileDataVec.push_back(fileData);
 			}
-			std::cout << std::endl;
-		}
+			files.push(fileData);
+		});
+		if (!ok) std::cerr << "Failed to walk directory" << std::endl;
+		files.close();
+	});
+
+	// -t 0: the block size depends on all the files, the scan has to be over
+	// before the L-Workers start splitting them
+	if (comp && AUTO_BLOCKSIZE) {
+		scanner.join();
+		BIGFILE_LOW_THRESHOLD = autoBlockSize(fileDataVec, rworkers, QUITE_MODE>=1);
 	}
 
 	// -----------------------------------------------
@@ -560,12 +1263,20 @@ int main(int argc, char *argv[]) {
     std::vector<ff_node*> LW;
     std::vector<ff_node*> RW;
 
+	// -U: shared by all the nodes, it has to outlive them
+	IoRing ring;
+	IoRing *io = nullptr;
+	if (iomode) {
+		if (ring.init()) io = &ring;
+		else if (QUITE_MODE>=1) std::fprintf(stderr, "io_uring is not available, using the blocking I/O\n");
+	}
+
 	for(size_t i=0; i<Lw; ++i) {
-		LW.push_back(new L_Worker(groups[i]));
+		LW.push_back(new L_Worker(&files, gate.get(), io, tuner.get(), i));
     }
 
 	for(size_t i=0;i<Rw;++i)
-		RW.push_back(new R_Worker(Lw));
+		RW.push_back(new R_Worker(Lw, gate.get(), io, tuner.get(), i));
 
 	// the merger will be the last stage and will work only on multi-block files
 	Merger merger(Rw);
@@ -577,23 +1288,37 @@ int main(int argc, char *argv[]) {
 	// pipe with a2a and merger
 	ff_Pipe<> pipe(a2a, merger);
     
-	if (pipe.run_and_wait_end()<0) {
+	if (tuner) tuner->start();
+	const int res = pipe.run_and_wait_end();
+	if (tuner) tuner->stop();
+	if (res<0) {
 		error("running a2a\n");
+		if (scanner.joinable()) scanner.join();
 		return -1;
     }
+	if (scanner.joinable()) scanner.join();
+	// the small files may still be being written
+	ring.drain();
 
 	ffTime(STOP_TIME);
 	
     std::cout << "Time: " << ffTime(GET_TIME) << " (ms)\n";
+    if (DEDUP && comp) dedupStats.print();
+    if (tuner) tuner->print();
+    traceReport();
     if(VERBOSE) std::cout << "pipe(A2A, merger) Time: " << pipe.ffTime() << " (ms)\n";
 
 	// -----------------------------------------------
 	
 	// cleanup
-
-	for (auto& fileData : fileDataVec) {
-		if(fileData.ptr != nullptr)
-			unmapFile(fileData.ptr, fileData.size);
-		}
+	// the R-Workers own the buffer pools, they are deleted once the Merger is done
+	for (auto *node : LW) delete node;
+	for (auto *node : RW) delete node;
+
+	// the files left in the queue if an L-Worker has failed
+	FileData left(nullptr, "", 0);
+	while (files.pop(left)) {
+		if (left.ptr != nullptr) unmapFile(left.ptr, left.size);
+	}
 	return 0;
 }
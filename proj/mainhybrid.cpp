@@ -0,0 +1,433 @@
+//
+// Hybrid version: one MPI process per node, FastFlow inside the node.
+//
+//   -   Rank 0 builds the list of blocks and splits it among the processes, as
+//       mainmpi does (rank 0 works on a share of the blocks too).
+//   -   Every process runs an A2A on its share of the blocks:
+//
+//          L-Worker --|   |--> R-Worker --|
+//                     |-->|--> R-Worker --|---> Merger
+//          L-Worker --|   |--> R-Worker --|
+//
+//       each L-Worker manages a partition of the share, the R-Workers
+//       compress/decompress the blocks, the Merger collects the results.
+//   -   The results go back to rank 0 (MPI_Gatherv of the descriptors, then the
+//       data), which writes the files. When decompressing, the blocks of rank 0
+//       are decompressed, and the others received, straight into the mapped
+//       output files (see OutputFiles).
+//
+//  Only the main thread of a process makes MPI calls (MPI_THREAD_FUNNELED).
+//  Run it with one process per node (e.g. mpirun --map-by ppr:1:node) and
+//  -w set to the cores of the node.
+//
+
+#include <cstdio>
+#include <cmath> 
+#include <cassert>
+#include <string>
+#include <vector>
+#include <mpi.h>
+
+#include <cmdlinempi.hpp>
+#include <utilitympi.hpp>
+#include <iostream>
+#include <cstring>  // For memcpy
+
+#include <ff/ff.hpp>
+#include <ff/all2all.hpp>
+#include <ff/pipeline.hpp>
+using namespace ff;
+
+
+
+// a block of the share of this process
+struct Task {
+    size_t               idx;            // position in the share of the process
+    const unsigned char *ptr;            // input pointer
+    size_t               size;           // input size
+    size_t               rawSize=0;      // uncompressed size of the block
+    uint32_t             crc=0;          // checksum of the compressed block
+    uint32_t             flags=0;        // BLOCK_STORED if the block is not compressed
+    unsigned char       *ptrOut=nullptr; // output pointer, nullptr if the block failed
+    unsigned char       *dst=nullptr;    // rank 0, decompression: the position of the block in its output
+    size_t               cmp_size=0;     // output size
+    BufferPool          *pool=nullptr;   // pool ptrOut comes from
+};
+
+struct L_Worker : ff_monode_t<Task> {
+    L_Worker(std::vector<Task*> group) : group(std::move(group)) {}
+
+    // the blocks go to the R-Workers in a round-robin fashion
+    Task *svc(Task *) {
+        for (Task *t : group) ff_send_out(t);
+        return EOS;
+    }
+    private:
+        std::vector<Task*> group;
+};
+
+struct R_Worker : ff_minode_t<Task> {
+	~R_Worker() { delete pool; delete codec; }
+
+	// per-thread pool of output buffers and per-thread codec, as in mainffa2a
+	int svc_init() {
+		if (!pool)  pool  = new BufferPool(compressBound(BIGFILE_LOW_THRESHOLD));
+		if (!codec) codec = new Codec(LEVEL, STRATEGY, RESTART_INTERVAL);
+		traceThread("R-Worker", get_my_id());
+		return 0;
+	}
+
+    Task *svc(Task *in) {
+		size_t cmp_len;
+		int err;
+		if (comp) {
+			cmp_len = compressBound(in->size);
+			in->ptrOut = pool->get(cmp_len);
+			uint32_t flags;
+			const auto t0 = std::chrono::steady_clock::now();
+			TraceSpan span(TR_COMPRESS);
+			err = codec->encode(in->ptrOut, &cmp_len, in->ptr, in->size, flags);
+			span.bytes(in->size, cmp_len);
+			if (err == Z_OK) {
+				if (DEDUP) dedupStats.addEncode(t0, in->size);
+				in->crc   = blockChecksum(in->ptrOut, cmp_len);
+				in->flags = flags;
+			}
+		} else {
+			// the checksum of the compressed block is checked before decompressing it
+			if (blockChecksum(in->ptr, in->size) != in->crc) {
+				if (QUITE_MODE>=1) std::fprintf(stderr, "Corrupted block\n");
+				return in;
+			}
+			cmp_len = in->rawSize;
+			in->ptrOut = in->dst ? in->dst : pool->get(cmp_len);
+			TraceSpan span(TR_DECOMPRESS);
+			err = codec->decode(in->ptrOut, &cmp_len, in->ptr, in->size, in->flags);
+			span.bytes(in->size, cmp_len);
+			if (err == Z_OK && cmp_len != in->rawSize) err = Z_DATA_ERROR;
+		}
+		if (!in->dst) in->pool = pool;
+		if (err != Z_OK) {
+			if (QUITE_MODE>=1) std::fprintf(stderr, "Failed to %s block, error: %d\n", comp ? "compress" : "decompress", err);
+			if (!in->dst) pool->put(in->ptrOut);
+			in->ptrOut = nullptr;
+			return in;
+		}
+		in->cmp_size = cmp_len;
+		return in;
+    }
+	private:
+		BufferPool *pool  = nullptr;
+		Codec      *codec = nullptr;
+};
+
+// collects the blocks processed, they are already in place in the share of the process
+struct Merger : ff_minode_t<Task> {
+    Task *svc(Task *in) {
+		++done;
+		if (!in->ptrOut) ++failed;
+		return GO_ON;
+    }
+	size_t done = 0, failed = 0;
+};
+
+// runs the A2A on the blocks of the share of this process, true if all of them are ok
+static bool processShare(std::vector<Task> &tasks, std::vector<R_Worker*> &RW) {
+	const size_t Lw = std::max<size_t>(1, std::min<size_t>(lworkers, tasks.size()));
+	std::vector<ff_node*> LW;
+	for (size_t i = 0; i < Lw; ++i) {
+		// contiguous partitions of the share
+		std::vector<Task*> group;
+		for (size_t j = i * tasks.size() / Lw; j < (i + 1) * tasks.size() / Lw; ++j)
+			group.push_back(&tasks[j]);
+		LW.push_back(new L_Worker(std::move(group)));
+	}
+	std::vector<ff_node*> R(RW.begin(), RW.end());
+	Merger merger;
+
+	ff_a2a a2a;
+	a2a.add_firstset(LW, 0);
+	a2a.add_secondset(R);
+	ff_Pipe<> pipe(a2a, merger);
+	const bool ok = pipe.run_and_wait_end() >= 0;
+	for (auto *node : LW) delete node;
+	if (!ok) error("running a2a\n");
+	return ok && merger.done == tasks.size() && merger.failed == 0;
+}
+
+// main process, compression: the blocks of a file arrive in order, once the last
+// one is there the archive is written and the buffers are given back
+static void collectBlock(std::vector<DataRec> &allData, std::vector<BufferPool*> &pools,
+                         const FileData_test &d, unsigned char *buf, BufferPool *pool) {
+    DataRec dr;
+    std::memcpy(dr.filename, d.filename, sizeof(dr.filename));
+    dr.filename[sizeof(dr.filename) - 1] = '\0';
+    dr.size = d.size;
+    dr.recDataVec.push_back(buf);
+    dr.blockid = d.blockid;
+    dr.nblock = d.nblock;
+    dr.rawsize = d.rawsize;
+    dr.crc = d.crc;
+    dr.flags = d.flags;
+    allData.push_back(dr);
+    pools.push_back(pool);
+    if (dr.blockid != dr.nblock) return;
+
+    if (mergeAndZip(allData)) {
+        if (VERBOSE) std::cout << "File " << dr.filename << " merged and zipped successfully." << std::endl;
+    } else {
+        std::cerr << "Error merging and zipping file: " << dr.filename << std::endl;
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    for (size_t i = 0; i < allData.size(); ++i) releaseBuffer(pools[i], allData[i].recDataVec[0]);
+    allData.clear();
+    pools.clear();
+}
+
+
+int main(int argc, char* argv[]) {
+    int myrank;
+	int size;
+
+    // the FastFlow threads do not call MPI
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+    MPI_Comm_rank(MPI_COMM_WORLD, &myrank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    int start = 1;
+    start = parseCommandLine(argc, argv, myrank);
+    if (start<0){
+            MPI_Abort(MPI_COMM_WORLD, -1);
+            return -1;
+    }
+    // the blocks are always split in advance and go through the main process
+    if (MPIIO_MODE || ONDEMAND) {
+        if (!myrank) std::fprintf(stderr, "Error: '-I' and '-O' are not supported by %s\n", argv[0]);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+        return -1;
+    }
+
+    std::vector<FileData> fileDataVec;
+    std::vector<FileData_test> fileDataTestVec;
+    // main process, decompression: the outputs, the blocks are put straight in place
+    OutputFiles outputs;
+
+    // per-rank pool of the buffers of the blocks received; the R-Workers have their own
+    BufferPool pool(compressBound(BIGFILE_LOW_THRESHOLD));
+    std::vector<R_Worker*> RW;
+    for (long i = 0; i < rworkers; ++i) RW.push_back(new R_Worker);
+
+    double start_time = MPI_Wtime();
+    traceThread("rank", myrank);
+
+    // "header" to broadcast the number of files and the number of files each process will receive
+    InitialHeader bcastData;
+    if (!myrank){
+        // read the files and store the data in fileDataVec
+        if (walkDirAndGetFiles(argv[start], fileDataVec, comp)) {
+            if(VERBOSE) std::cout << "Files processed successfully." << std::endl;
+            // -t 0: the block size depends on the files found and on all the R-Workers
+            if (comp && AUTO_BLOCKSIZE) BIGFILE_LOW_THRESHOLD = autoBlockSize(fileDataVec, size * rworkers, QUITE_MODE>=1);
+
+            TraceSpan span(TR_DISPATCH);
+            fileDataTestVec.reserve(fileDataVec.size());
+            //for each file in fileDataVec, create a FileData_test object and store it in fileDataTestVec
+            for (size_t f = 0; f < fileDataVec.size(); ++f) {
+                if(!comp) { //decompression
+                    // the index at the end of the archive has the position and the sizes of each block
+                    ContainerReader reader;
+                    if (!reader.open(fileDataVec[f].ptr, fileDataVec[f].size)) {
+                        std::cerr << "Error with the header during decompression (" << reader.error() << "): " << fileDataVec[f].filename << std::endl;
+                        MPI_Abort(MPI_COMM_WORLD, -1);
+                    }
+                    const size_t nblocks = reader.nblocks();
+                    outputs.add(f, fileDataVec[f].filename, reader);
+                    FileData_test fdt;
+                    // for each block create the FileData_test object with all the infos and store it in fileDataTestVec
+                    for(size_t i = 0; i < nblocks; ++i) {
+                        const BlockEntry &e = reader.block(i);
+                        std::memcpy(fdt.filename, fileDataVec[f].filename, sizeof(fdt.filename));
+                        fdt.filename[sizeof(fdt.filename) - 1] = '\0';
+                        fdt.size = e.cmpSize;
+                        fdt.nblock = nblocks;
+                        fdt.blockid = i+1;
+                        fdt.fileIndex = f;
+                        fdt.lastblocksize = reader.block(nblocks-1).rawSize;
+                        fdt.offset = e.offset;
+                        fdt.rawsize = e.rawSize;
+                        fdt.crc = e.crc;
+                        fdt.flags = e.flags;
+                        fileDataTestVec.push_back(fdt);
+                    }
+                }else{ //compression
+                    if (fileDataVec[f].size > BIGFILE_LOW_THRESHOLD) {
+                        // File is large; split into blocks, without the duplicates with -H 1
+                        splitBlocks(fileDataVec[f], f, fileDataTestVec);
+                    } else {
+                        // File is small enough; add as a single block
+                        FileData_test fdt;
+                        std::strncpy(fdt.filename, fileDataVec[f].filename, sizeof(fdt.filename));
+                        fdt.size = fileDataVec[f].size;
+                        fdt.rawsize = fdt.size;
+                        fdt.nblock = 1;
+                        fdt.blockid = 1;
+                        fdt.fileIndex = f;
+                        // the last block size is the size of the file
+                        fdt.lastblocksize = fileDataVec[f].size;
+                        fileDataTestVec.push_back(fdt);
+                    }
+                }
+            }
+        } else {
+            std::cerr << "Error processing files in directory." << std::endl;
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+
+        // save the total number of blocks
+        bcastData.numFiles = fileDataTestVec.size();
+    }
+    // the other processes need the block size picked by the main process
+    shareBlockSize(pool);
+
+    // split the blocks among the processes
+    // in this version the main process (rank 0) is considered as a worker
+    // the block distribution follows a round-robin approach
+    // only the number of blocks is broadcast, the split is computed locally
+    MPI_Bcast(&bcastData.numFiles, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    bcastData.split(size, 0);
+    if(VERBOSE) std::cout << "Process " << myrank << " will receive " << bcastData.sendCounts[myrank] << " files." << std::endl;
+
+    //now everyone knows how many files they will receive
+    //and can allocate the necessary memory
+    MPI_Datatype fileDataType = createFileDataType();
+    std::vector<FileData_test> recvBuffer(bcastData.sendCounts[myrank]);
+
+    //scatter the file information to all the processes, each process has a vector of FileData_test
+    //ready to store the data thanks to the previous broadcast
+    {
+        TraceSpan wait(TR_WAIT);
+        MPI_Scatterv(fileDataTestVec.data(), bcastData.sendCounts.data(), bcastData.displs.data(), fileDataType,
+                     recvBuffer.data(), bcastData.sendCounts[myrank], fileDataType, 0, MPI_COMM_WORLD);
+    }
+
+    //store all the data untill all processes finish
+
+    // the share of this process: rank 0 reads its blocks from the mapping, the
+    // others receive them from rank 0
+    const int mycount = bcastData.sendCounts[myrank];
+    std::vector<Task> tasks(mycount);
+    for (int i = 0; i < mycount; ++i) {
+        const FileData_test &d = recvBuffer[i];
+        tasks[i].idx = i;
+        tasks[i].size = d.size;
+        tasks[i].rawSize = d.rawsize;
+        tasks[i].crc = d.crc;
+        tasks[i].flags = d.flags;
+        if (myrank) {
+            unsigned char *ptr = pool.get(d.size);
+            TraceSpan span(TR_RECV);
+            span.bytes(d.size, 0);
+            MPI_Recv(ptr, d.size, MPI_UNSIGNED_CHAR, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            tasks[i].ptr = ptr;
+        } else {
+            const FileData_test &blk = fileDataTestVec[i];
+            tasks[i].ptr = fileDataVec[blk.fileIndex].ptr + blk.offset;
+            if (!comp && !outputs.block(blk.fileIndex, blk.blockid, tasks[i].dst)) MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+    }
+
+    // main process: sending the blocks to the other processes, straight from the mapping
+    if (myrank == 0) {
+        for (int i = 1; i < size; ++i) {
+            for (int j = bcastData.displs[i]; j < bcastData.displs[i] + bcastData.sendCounts[i]; ++j) {
+                const size_t offset = fileDataTestVec[j].offset;
+                TraceSpan span(TR_SEND);
+                span.bytes(0, fileDataTestVec[j].size);
+                MPI_Send(fileDataVec[fileDataTestVec[j].fileIndex].ptr + offset,
+                        fileDataTestVec[j].size, MPI_UNSIGNED_CHAR, i, 0, MPI_COMM_WORLD);
+            }
+        }
+    }
+
+    // FastFlow part: every process compresses/decompresses its share with all the cores of the node
+    if (!processShare(tasks, RW)) {
+        std::cerr << "process" << myrank << ": failed to process its blocks" << std::endl;
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    for (int i = 0; i < mycount; ++i) {
+        if (myrank) pool.put(const_cast<unsigned char*>(tasks[i].ptr));
+        recvBuffer[i].size = tasks[i].cmp_size;
+        recvBuffer[i].crc = tasks[i].crc;
+        recvBuffer[i].flags = tasks[i].flags;
+    }
+
+    // the main process gets the descriptors of the results of the others
+    {
+        TraceSpan wait(TR_WAIT);
+        MPI_Gatherv(recvBuffer.data(), mycount, fileDataType,
+                    fileDataTestVec.data(), bcastData.sendCounts.data(), bcastData.displs.data(), fileDataType, 0, MPI_COMM_WORLD);
+    }
+
+    if (myrank) {
+        // each process sends the results to the main process
+        for (int i = 0; i < mycount; ++i) {
+            TraceSpan span(TR_SEND);
+            span.bytes(0, tasks[i].cmp_size);
+            MPI_Send(tasks[i].ptrOut, tasks[i].cmp_size, MPI_UNSIGNED_CHAR, 0, 0, MPI_COMM_WORLD);
+            releaseBuffer(tasks[i].pool, tasks[i].ptrOut);
+        }
+    } else {
+        // the blocks are split in order among the processes: first the ones of the main process,
+        // then the ones of process 1, and so on
+        // the decompressed blocks are already in place, or received there
+        std::vector<DataRec> allData;
+        std::vector<BufferPool*> pools;
+        for (int i = 0; i < mycount; ++i) {
+            if (!comp) {
+                if (!outputs.done(fileDataTestVec[i].fileIndex)) MPI_Abort(MPI_COMM_WORLD, -1);
+                continue;
+            }
+            collectBlock(allData, pools, fileDataTestVec[i], tasks[i].ptrOut, tasks[i].pool);
+        }
+        for (int i = 1; i < size; ++i) {
+            for (int j = bcastData.displs[i]; j < bcastData.displs[i] + bcastData.sendCounts[i]; ++j) {
+                if (!comp) {
+                    unsigned char *dst = nullptr;
+                    if (!outputs.block(fileDataTestVec[j].fileIndex, fileDataTestVec[j].blockid, dst)) MPI_Abort(MPI_COMM_WORLD, -1);
+                    {
+                        TraceSpan span(TR_RECV);
+                        span.bytes(fileDataTestVec[j].size, 0);
+                        MPI_Recv(dst, fileDataTestVec[j].size, MPI_UNSIGNED_CHAR, i, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+                    }
+                    if (!outputs.done(fileDataTestVec[j].fileIndex)) MPI_Abort(MPI_COMM_WORLD, -1);
+                    continue;
+                }
+                unsigned char *buf = pool.get(fileDataTestVec[j].size);
+                {
+                    TraceSpan span(TR_RECV);
+                    span.bytes(fileDataTestVec[j].size, 0);
+                    MPI_Recv(buf, fileDataTestVec[j].size, MPI_UNSIGNED_CHAR, i, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+                }
+                collectBlock(allData, pools, fileDataTestVec[j], buf, &pool);
+            }
+        }
+    }
+
+    double end_time = MPI_Wtime();
+
+    if (!myrank) {
+        if(VERBOSE) std::cout << "All files received by process 0." << std::endl;
+        std::cout << "Elapsed time: " << (end_time - start_time) * 1000 << " milliseconds." << std::endl;
+    }
+    reportDedup(myrank);
+    reportTrace(myrank, size);
+
+    for (auto &f : fileDataVec)
+        if (f.ptr) unmapFile(f.ptr, f.size);
+    for (auto *node : RW) delete node;
+
+    MPI_Type_free(&fileDataType);
+    MPI_Finalize();
+    return 0;
+}
@@ -9,6 +9,7 @@
 
 #include <cmdlinempi.hpp>
 #include <utilitympi.hpp>
+#include <mpiio.hpp>
 #include <iostream>
 #include <sstream>
 #include <cstring>  // For memcpy
@@ -17,37 +18,6 @@
 
 //static int numFiles = -1;
 
-struct FileData_test {
-        char filename[256];
-        size_t size;
-        size_t nblock = 1;
-        size_t blockid = 0;
-        size_t fileIndex = -1;
-        size_t lastblocksize = 0;
-        size_t offset = 0;
-};
-
-
-MPI_Datatype createFileDataType() {
-    MPI_Datatype new_Type;
-    MPI_Datatype old_types[7] = { MPI_CHAR, MPI_UNSIGNED_LONG, MPI_UNSIGNED_LONG, MPI_UNSIGNED_LONG, MPI_UNSIGNED_LONG, MPI_UNSIGNED_LONG, MPI_UNSIGNED_LONG };
-    int blocklen[7] = { 256, 1, 1, 1, 1, 1, 1};
-
-    // NOTE: using this since the MPI_Aint_displ in the slides is not working
-    MPI_Aint offsets[7];
-    offsets[0] = offsetof(FileData_test, filename);
-    offsets[1] = offsetof(FileData_test, size);
-    offsets[2] = offsetof(FileData_test, nblock);
-    offsets[3] = offsetof(FileData_test, blockid);
-    offsets[4] = offsetof(FileData_test, fileIndex);
-    offsets[5] = offsetof(FileData_test, lastblocksize);
-    offsets[6] = offsetof(FileData_test, offset);
-
-    MPI_Type_create_struct(7, blocklen, offsets, old_types, &new_Type);
-    MPI_Type_commit(&new_Type);
-
-    return new_Type;
-}
 
 
 int main(int argc, char* argv[]) {
@@ -67,8 +37,26 @@ int main(int argc, char* argv[]) {
 
     std::vector<FileData> fileDataVec;
     std::vector<FileData_test> fileDataTestVec;
+    // main process, decompression: the outputs, the blocks are put straight in place
+    OutputFiles outputs;
+
+    // per-rank pool of block buffers, recycled instead of allocated for every block,
+    // and per-rank codec, reset between blocks instead of allocated for every block
+    BufferPool pool(compressBound(BIGFILE_LOW_THRESHOLD));
+    Codec codec(LEVEL, STRATEGY, RESTART_INTERVAL);
 
     double start_time = MPI_Wtime();
+    traceThread("rank", myrank);
+
+    // the blocks do not go through the main process, see mpiio.hpp
+    if (MPIIO_MODE) {
+        mpiioRun(argv[start], myrank, size, pool, codec);
+        double end_time = MPI_Wtime();
+        if (!myrank) std::cout << "Elapsed time: " << (end_time - start_time) * 1000 << " milliseconds." << std::endl;
+        reportTrace(myrank, size);
+        MPI_Finalize();
+        return 0;
+    }
 
     // "header" to broadcast the number of files and the number of files each process will receive
     InitialHeader bcastData;
@@ -76,81 +64,49 @@ int main(int argc, char* argv[]) {
         // read the files and store the data in fileDataVec
         if (walkDirAndGetFiles(argv[start], fileDataVec, comp)) {
             if(VERBOSE) std::cout << "Files processed successfully." << std::endl;
+            // -t 0: the block size depends on the files found, all the processes compress
+            if (comp && AUTO_BLOCKSIZE) BIGFILE_LOW_THRESHOLD = autoBlockSize(fileDataVec, size, QUITE_MODE>=1);
 
+            TraceSpan span(TR_DISPATCH);
             fileDataTestVec.reserve(fileDataVec.size());
             //for each file in fileDataVec, create a FileData_test object and store it in fileDataTestVec
             for (size_t f = 0; f < fileDataVec.size(); ++f) {
                 if(!comp) { //decompression
-                    //read the first 8 bytes to get the number of blocks
-                    size_t offset = 0;
-                    size_t nblocks = 0;
-                    std::memcpy(&nblocks, fileDataVec[f].data.data(), sizeof(size_t));
-                    offset += sizeof(size_t);
-                    //for each block read the size of the blocks
-                    std::vector<size_t> blockSizes;
-                    for (size_t i = 0; i < nblocks; ++i) {
-                        size_t blocksize = 0;
-                        std::memcpy(&blocksize, fileDataVec[f].data.data() + offset, sizeof(size_t));
-                        offset += sizeof(size_t);
-                        blockSizes.push_back(blocksize);
+                    // the index at the end of the archive has the position and the sizes of each block
+                    ContainerReader reader;
+                    if (!reader.open(fileDataVec[f].ptr, fileDataVec[f].size)) {
+                        std::cerr << "Error with the header during decompression (" << reader.error() << "): " << fileDataVec[f].filename << std::endl;
+                        MPI_Abort(MPI_COMM_WORLD, -1);
                     }
-                    // save the size of the last block uncompressed
-                    size_t lastblocksize = 0;
-                    std::memcpy(&lastblocksize, fileDataVec[f].data.data() + offset, sizeof(size_t));
-                    // save the offset for later use
-                    offset += sizeof(size_t);
+                    const size_t nblocks = reader.nblocks();
+                    outputs.add(f, fileDataVec[f].filename, reader);
                     FileData_test fdt;
                     // for each block create the FileData_test object with all the infos and store it in fileDataTestVec
                     for(size_t i = 0; i < nblocks; ++i) {
+                        const BlockEntry &e = reader.block(i);
                         std::memcpy(fdt.filename, fileDataVec[f].filename, sizeof(fdt.filename));
                         fdt.filename[sizeof(fdt.filename) - 1] = '\0';
-                        fdt.size = blockSizes[i];
+                        fdt.size = e.cmpSize;
                         fdt.nblock = nblocks;
                         fdt.blockid = i+1;
                         fdt.fileIndex = f;
-                        fdt.lastblocksize = lastblocksize;
-                        fdt.offset = offset;
+                        fdt.lastblocksize = reader.block(nblocks-1).rawSize;
+                        fdt.offset = e.offset;
+                        fdt.rawsize = e.rawSize;
+                        fdt.crc = e.crc;
+                        fdt.flags = e.flags;
                         fileDataTestVec.push_back(fdt);
-                        offset += blockSizes[i];
                     }
                 }else{ //compression
                     if (fileDataVec[f].size > BIGFILE_LOW_THRESHOLD) {
-                        // File is large; split into blocks
-                        const size_t filesize = fileDataVec[f].size;
-                        const size_t fullblocks  = filesize / BIGFILE_LOW_THRESHOLD;
-                        const size_t partialblock= filesize % BIGFILE_LOW_THRESHOLD;
-                        for(size_t i=0;i<fullblocks;++i) {
-                            FileData_test fdt;
-                            //memcpy becouse strncpy skipped some copy during the loop
-                            std::memcpy(fdt.filename, fileDataVec[f].filename, sizeof(fdt.filename) - 1);
-                            //null-termination
-                            fdt.filename[sizeof(fdt.filename) - 1] = '\0';
-
-                            fdt.size = BIGFILE_LOW_THRESHOLD;
-                            fdt.nblock = fullblocks+(partialblock>0);
-                            fdt.blockid = i+1;
-                            fdt.fileIndex = f;
-                            // if there is not a partial block, the last block size is BIGFILE_LOW_THRESHOLD
-                            fdt.lastblocksize = partialblock ? partialblock : BIGFILE_LOW_THRESHOLD;
-                            fileDataTestVec.push_back(fdt);
-                        }
-                        // if there is a partial block, add it with the correct size
-                        if (partialblock) {
-                            FileData_test fdt;
-                            std::memcpy(fdt.filename, fileDataVec[f].filename, sizeof(fdt.filename) - 1);
-                            fdt.filename[sizeof(fdt.filename) - 1] = '\0';
-                            fdt.size = partialblock;
-                            fdt.nblock = fullblocks+1;
-                            fdt.blockid = fullblocks+1;
-                            fdt.fileIndex = f;
-                            fdt.lastblocksize = partialblock;
-                            fileDataTestVec.push_back(fdt);
-                        }
+                        // File is large; split into blocks, without the duplicates with -H 1
+                        splitBlocks(fileDataVec[f], f, fileDataTestVec);
                     } else {
                         // File is small enough; add as a single block
                         FileData_test fdt;
                         std::strncpy(fdt.filename, fileDataVec[f].filename, sizeof(fdt.filename));
                         fdt.size = fileDataVec[f].size;
+                        fdt.rawsize = fdt.size;
                         fdt.nblock = 1;
                         fdt.blockid = 1;
                         fdt.fileIndex = f;
@@ -168,20 +124,15 @@ int main(int argc, char* argv[]) {
         // save the total number of blocks
         bcastData.numFiles = fileDataTestVec.size();
     }
+    // the other processes need the block size picked by the main process
+    shareBlockSize(pool);
 
     // split the blocks among the processes
     // in this version the main process (rank 0) is considered as a worker
     // the block distribution follows a round-robin approach
-    int base = bcastData.numFiles / size;
-    int remainder = bcastData.numFiles % size;
-    for (int i = 0; i < size; ++i) {
-        bcastData.sendCounts[i] = base + (i < remainder ? 1 : 0);
-        bcastData.displs[i] = (i > 0) ? (bcastData.displs[i - 1] + bcastData.sendCounts[i - 1]) : 0;
-    }
-    MPI_Datatype iHeaderDataType = createIHeaderDataType(size);
-
-    //bdacst the information needed to all the processes (inclusing process 0)
-    MPI_Bcast(&bcastData, 1, iHeaderDataType, 0, MPI_COMM_WORLD);
+    // only the number of blocks is broadcast, the split is computed locally
+    MPI_Bcast(&bcastData.numFiles, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    bcastData.split(size, 0);
     if(VERBOSE) std::cout << "Process " << myrank << " will receive " << bcastData.sendCounts[myrank] << " files." << std::endl;
 
     //now everyone knows how many files they will receive
@@ -191,8 +142,11 @@ int main(int argc, char* argv[]) {
 
     //scatter the file information to all the processes, each process has a vector of FileData_test
     //ready to store the data thanks to the previous broadcast
-    MPI_Scatterv(fileDataTestVec.data(), bcastData.sendCounts, bcastData.displs, fileDataType,
-                 recvBuffer.data(), bcastData.sendCounts[myrank], fileDataType, 0, MPI_COMM_WORLD);
+    {
+        TraceSpan wait(TR_WAIT);
+        MPI_Scatterv(fileDataTestVec.data(), bcastData.sendCounts.data(), bcastData.displs.data(), fileDataType,
+                     recvBuffer.data(), bcastData.sendCounts[myrank], fileDataType, 0, MPI_COMM_WORLD);
+    }
 
     //store all the data untill all processes finish
     std::vector<unsigned char*> myDataVec(bcastData.sendCounts[myrank]);
@@ -206,7 +160,9 @@ int main(int argc, char* argv[]) {
         // First loop: Receive the data
         for (int i = 0; i < bcastData.sendCounts[myrank]; ++i) {
             
-            myData = new unsigned char[recvBuffer[i].size];
+            myData = pool.get(recvBuffer[i].size);
+            TraceSpan span(TR_RECV);
+            span.bytes(recvBuffer[i].size, 0);
             MPI_Recv(myData, recvBuffer[i].size, MPI_UNSIGNED_CHAR, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
             dataVec[i] = myData;  // Store the received data for later processing
         }
@@ -220,33 +176,48 @@ int main(int argc, char* argv[]) {
             if (comp) {
                 // Compression
                 cmp_len = compressBound(inSize);
-                ptrOut = new unsigned char[cmp_len];
+                ptrOut = pool.get(cmp_len);
                 int err;
-                if ((err = compress(ptrOut, &cmp_len, (const unsigned char*)dataVec[i], inSize)) != Z_OK) {
+                uint32_t flags;
+                const auto t0 = std::chrono::steady_clock::now();
+                TraceSpan span(TR_COMPRESS);
+                if ((err = codec.encode(ptrOut, &cmp_len, (const unsigned char*)dataVec[i], inSize, flags)) != Z_OK) {
                     if (QUITE_MODE >= 1) {
                         std::cerr << "Process " << myrank << " failed to compress block, error: " << err << std::endl;
                     }
-                    delete[] ptrOut;
-                    delete[] dataVec[i];
+                    pool.put(ptrOut);
+                    pool.put(dataVec[i]);
                     MPI_Abort(MPI_COMM_WORLD, -1);
                 }
+                if (DEDUP) dedupStats.addEncode(t0, inSize);
+                span.bytes(inSize, cmp_len);
+                recvBuffer[i].crc = blockChecksum(ptrOut, cmp_len);
+                recvBuffer[i].flags = flags;
             } else {
                 // Decompression
-                cmp_len = BIGFILE_LOW_THRESHOLD;
-                ptrOut = new unsigned char[cmp_len];
+                if (blockChecksum(dataVec[i], inSize) != recvBuffer[i].crc) {
+                    std::cerr << "Process " << myrank << ": corrupted block " << recvBuffer[i].blockid << " of file " << recvBuffer[i].filename << std::endl;
+                    MPI_Abort(MPI_COMM_WORLD, -1);
+                }
+                // the uncompressed size of the block is in the index of the archive
+                cmp_len = recvBuffer[i].rawsize;
+                ptrOut = pool.get(cmp_len);
                 int err;
-                if ((err = uncompress(ptrOut, &cmp_len, (const unsigned char*)dataVec[i], inSize)) != Z_OK) {
+                TraceSpan span(TR_DECOMPRESS);
+                if ((err = codec.decode(ptrOut, &cmp_len, (const unsigned char*)dataVec[i], inSize, recvBuffer[i].flags)) != Z_OK ||
+                    cmp_len != recvBuffer[i].rawsize) {
                     std::cerr << "Process " << myrank << " failed to decompress block, error: " << err << std::endl;
-                    delete[] ptrOut;
-                    delete[] dataVec[i];
+                    pool.put(ptrOut);
+                    pool.put(dataVec[i]);
                     MPI_Abort(MPI_COMM_WORLD, -1);
                 }
+                span.bytes(inSize, cmp_len);
             }
             
             myDataVec[i] = ptrOut;
             //update the recvBuffer with the new size, this will be used in the gather from the main process
             recvBuffer[i].size = cmp_len;
-            delete[] dataVec[i];  // Free the memory of the original data after processing
+            pool.put(dataVec[i]);  // Give back the buffer of the original data after processing
         }
     }
 
@@ -256,30 +227,14 @@ int main(int argc, char* argv[]) {
         // for now the impementation follows a sequential approach to send the data to the workers
         for (int i = 1; i < size; ++i) {
             for (int j = bcastData.displs[i]; j < bcastData.displs[i] + bcastData.sendCounts[i]; ++j) {
-                if (comp){
-                    // make a copy of the data to send
-                    unsigned char* sendData = new unsigned char[fileDataTestVec[j].size];
-                    // select the right block to send to the i-th process
-                    // fileDataVec[ X ].data.data() + (Y * Z) is the pointer to the Y-th block of the file
-                    // X is the index of the file in fileDataVec, obtained with fileDataTestVec[j].fileIndex
-                    // Y is the blockid of the block, obtained with fileDataTestVec[j].blockid
-                    // Z is the size of the block, BIGFILE_LOW_THRESHOLD
-
-                    std::memcpy(sendData, fileDataVec[fileDataTestVec[j].fileIndex].data.data() + ((fileDataTestVec[j].blockid-1) * BIGFILE_LOW_THRESHOLD), fileDataTestVec[j].size);
-                    MPI_Send(sendData, 
-                            fileDataTestVec[j].size, MPI_UNSIGNED_CHAR, i, 0, MPI_COMM_WORLD);
-                    
-                delete[] sendData;
-                }else{
-                    // decompression
-
-                    unsigned char* sendData = new unsigned char[fileDataTestVec[j].size];
-                    size_t offset = fileDataTestVec[j].offset;
-                    std::memcpy(sendData, fileDataVec[fileDataTestVec[j].fileIndex].data.data() + offset, fileDataTestVec[j].size);
-                    MPI_Send(sendData, 
-                            fileDataTestVec[j].size, MPI_UNSIGNED_CHAR, i, 0, MPI_COMM_WORLD);
-                    delete[] sendData;
-                }
+                // the blocks are sent straight from the mapping of the file, without copying them
+                // fileDataVec[ X ].ptr + Y is the pointer to the block, X is the index of the file
+                // (fileDataTestVec[j].fileIndex), Y the position of the block in the file
+                const size_t offset = fileDataTestVec[j].offset;
+                TraceSpan span(TR_SEND);
+                span.bytes(0, fileDataTestVec[j].size);
+                MPI_Send(fileDataVec[fileDataTestVec[j].fileIndex].ptr + offset,
+                        fileDataTestVec[j].size, MPI_UNSIGNED_CHAR, i, 0, MPI_COMM_WORLD);
             }
         }
     }
@@ -296,50 +251,53 @@ int main(int argc, char* argv[]) {
             size_t inSize = recvBuffer[i].size;
             size_t cmp_len = 0;
             unsigned char *ptrOut = nullptr;
-            unsigned char *ptrIn = nullptr;
+            // the block is read straight from the mapping of the file, fileDataTestVec[ X ] contains
+            // the information about the block, X (bcastData.displs[0] + i) is obtained from the scatter
+            const FileData_test &blk = fileDataTestVec[bcastData.displs[0] + i];
+            const unsigned char *ptrIn = fileDataVec[blk.fileIndex].ptr + blk.offset;
 
             /* process data MAIN PROCESS */
             if (comp){ //compresion
                 // get an estimation of the maximum compression size
                 cmp_len = compressBound(inSize);
-                // allocate memory to store compressed data in memory
-                ptrOut = new unsigned char[cmp_len];
-                ptrIn = new unsigned char[inSize];
+                // get the buffer to store the compressed data in memory
+                ptrOut = pool.get(cmp_len);
                 int err;
-
-                // The data is stored in fileDataVec, so we need to get the data from the fileDataVec
-                // fileDataTestVec[ X ] contains the information about the block to process
-                // fileDataTestVec[ X ].fileIndex is the index of the file in fileDataVec
-                // fileDataTestVec[ X ].blockid is the blockid of the block to process
-                // X is bcastData.displs[0] + i (the index of the block to process) obtained from the scatter
-                // fileDataVec[ X ].data.data() is the pointer to the data of the file
-                // fileDataVec[ X ].data.data() + (Y * Z) is the pointer to the Y-th block of the file
-                // X is the index of the file in fileDataVec, obtained with fileDataTestVec[bcastData.displs[0] + i].fileIndex
-                // Z is the size of the block, BIGFILE_LOW_THRESHOLD
-                // so we copy the data from the fileDataVec to the ptrIn
-
-                memcpy(ptrIn, fileDataVec[fileDataTestVec[bcastData.displs[0] + i].fileIndex].data.data() + ((fileDataTestVec[bcastData.displs[0] + i].blockid-1) * BIGFILE_LOW_THRESHOLD), inSize);
-                if((err = compress(ptrOut, &cmp_len, ptrIn, inSize)) != Z_OK) {
+                uint32_t flags;
+                const auto t0 = std::chrono::steady_clock::now();
+                TraceSpan span(TR_COMPRESS);
+                if((err = codec.encode(ptrOut, &cmp_len, ptrIn, inSize, flags)) != Z_OK) {
                     std::cerr << "process"<< myrank<<"Failed to compress block, error: " << err << std::endl;
-                    delete [] ptrOut;
-                    delete [] ptrIn;
+                    pool.put(ptrOut);
                     MPI_Abort(MPI_COMM_WORLD, -1);
 
                 }
+                if (DEDUP) dedupStats.addEncode(t0, inSize);
+                span.bytes(inSize, cmp_len);
+                recvBuffer[i].crc = blockChecksum(ptrOut, cmp_len);
+                recvBuffer[i].flags = flags;
             }
             else{ //decompression
-                // get the size of the block to decompress
-                bool islastblock = fileDataTestVec[bcastData.displs[0] + i].blockid == fileDataTestVec[bcastData.displs[0] + i].nblock;
-                cmp_len = islastblock ? fileDataTestVec[bcastData.displs[0] + i].lastblocksize : BIGFILE_LOW_THRESHOLD;
-		        ptrOut = new unsigned char[cmp_len];
-                ptrIn = new unsigned char[inSize];
+                // get the size of the block to decompress, from the index of the archive
+                cmp_len = recvBuffer[i].rawsize;
 
-                memcpy(ptrIn, fileDataVec[fileDataTestVec[bcastData.displs[0] + i].fileIndex].data.data() + fileDataTestVec[bcastData.displs[0] + i].offset, inSize);
+                if (blockChecksum(ptrIn, inSize) != recvBuffer[i].crc) {
+                    std::cerr << "process"<< myrank<<": corrupted block " << recvBuffer[i].blockid << " of file " << recvBuffer[i].filename << std::endl;
+                    MPI_Abort(MPI_COMM_WORLD, -1);
+                }
+                // the block is decompressed straight at its position in the output file
+                if (!outputs.block(blk.fileIndex, blk.blockid, ptrOut)) MPI_Abort(MPI_COMM_WORLD, -1);
                 int err;
-		        if ((err = uncompress(ptrOut, &cmp_len, ptrIn, inSize)) != Z_OK) {
+                TraceSpan span(TR_DECOMPRESS);
+		        if ((err = codec.decode(ptrOut, &cmp_len, ptrIn, inSize, recvBuffer[i].flags)) != Z_OK ||
+                    cmp_len != recvBuffer[i].rawsize) {
                     std::cerr << "process"<< myrank<<"Failed to decompress block, error: " << err << std::endl;
 			        MPI_Abort(MPI_COMM_WORLD, -1);
 		        }
+                span.bytes(inSize, cmp_len);
+                recvBuffer[i].size = cmp_len;
+                if (!outputs.done(blk.fileIndex)) MPI_Abort(MPI_COMM_WORLD, -1);
+                continue;
             }
             // store the compressed/decompressed data in the vector
             myDataVec[i] = ptrOut;
@@ -355,26 +313,21 @@ int main(int argc, char* argv[]) {
             dr.recDataVec.push_back(ptrOut);
             dr.blockid = recvBuffer[i].blockid;
             dr.nblock = recvBuffer[i].nblock;
+            dr.rawsize = recvBuffer[i].rawsize;
+            dr.crc = recvBuffer[i].crc;
+            dr.flags = recvBuffer[i].flags;
             allData.push_back(dr);
             // if I have all the blocks of the file, then I can merge them
             // and free the memory
             if (dr.blockid ==   dr.nblock){
-                size_t lastblocksize = recvBuffer[i].lastblocksize;
-                if (comp){   
-                    if(mergeAndZip(allData, lastblocksize)){
-                        if(VERBOSE) std::cout << "File " << dr.filename << " merged and zipped successfully." << std::endl;
-                    } else {
-                        std::cerr << "Error merging and zipping file: " << dr.filename << std::endl;
-                        MPI_Abort(MPI_COMM_WORLD, -1);
-                    }
-                }else{
-                    if(mergeAndWrite(allData)){
-                        if(VERBOSE) std::cout << "File " << dr.filename << " merged and written successfully." << std::endl;
-                    } else {
-                        std::cerr << "Error merging and writing file: " << dr.filename << std::endl;
-                        MPI_Abort(MPI_COMM_WORLD, -1);
-                    }
+                if(mergeAndZip(allData)){
+                    if(VERBOSE) std::cout << "File " << dr.filename << " merged and zipped successfully." << std::endl;
+                } else {
+                    std::cerr << "Error merging and zipping file: " << dr.filename << std::endl;
+                    MPI_Abort(MPI_COMM_WORLD, -1);
                 }
+                // the blocks have been written, their buffers can be reused
+                for (auto &d : allData) pool.put(d.recDataVec[0]);
                 allData.clear();
             }
         }
@@ -382,69 +335,76 @@ int main(int argc, char* argv[]) {
 
     // once the main process has processed its data, it can receive the data from the other processes
     // first of all, the main process has to receive informations about the incoming data
-    MPI_Gatherv(recvBuffer.data(), bcastData.sendCounts[myrank], fileDataType,
-                fileDataTestVec.data(), bcastData.sendCounts, bcastData.displs, fileDataType, 0, MPI_COMM_WORLD);
+    {
+        TraceSpan wait(TR_WAIT);
+        MPI_Gatherv(recvBuffer.data(), bcastData.sendCounts[myrank], fileDataType,
+                    fileDataTestVec.data(), bcastData.sendCounts.data(), bcastData.displs.data(), fileDataType, 0, MPI_COMM_WORLD);
+    }
 
 
     if(myrank){ // workers
         // each worker sends the compressed data to the main process
         for (int i = 0; i < bcastData.sendCounts[myrank]; ++i) {
+            TraceSpan span(TR_SEND);
+            span.bytes(0, recvBuffer[i].size);
             MPI_Send(myDataVec[i], recvBuffer[i].size, MPI_UNSIGNED_CHAR, 0, 0, MPI_COMM_WORLD);
-            delete[] myDataVec[i];
+            pool.put(myDataVec[i]);
         }
     }else{
-        // prepare the data to be received from the workers
-        std::vector<unsigned char*> recDataVec;
-
         for (int i = 1; i < size; ++i) {
             for (int j = 0; j < bcastData.sendCounts[i]; ++j) {
                 // The size of the data being received from process 'i'
                 size_t dataSize = fileDataTestVec[bcastData.displs[i] + j].size;
+
+                if (!comp) {
+                    // a decompressed block is received straight at its position in the output file
+                    const FileData_test &d = fileDataTestVec[bcastData.displs[i] + j];
+                    unsigned char *dst = nullptr;
+                    if (!outputs.block(d.fileIndex, d.blockid, dst)) MPI_Abort(MPI_COMM_WORLD, -1);
+                    {
+                        TraceSpan span(TR_RECV);
+                        span.bytes(dataSize, 0);
+                        MPI_Recv(dst, dataSize, MPI_UNSIGNED_CHAR, i, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+                    }
+                    if (!outputs.done(d.fileIndex)) MPI_Abort(MPI_COMM_WORLD, -1);
+                    continue;
+                }
                 
-                // Allocate memory for the incoming data
-                unsigned char* myDataMain = new unsigned char[dataSize];
+                // Get a buffer for the incoming data
+                unsigned char* myDataMain = pool.get(dataSize);
                 
                 // Receive the data from process 'i'
-                MPI_Recv(myDataMain, dataSize, MPI_UNSIGNED_CHAR, i, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+                {
+                    TraceSpan span(TR_RECV);
+                    span.bytes(dataSize, 0);
+                    MPI_Recv(myDataMain, dataSize, MPI_UNSIGNED_CHAR, i, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+                }
 
                 // add the data to the vector
-                recDataVec.push_back(myDataMain);
                 DataRec dr;
                 std::strncpy(dr.filename, fileDataTestVec[bcastData.displs[i] + j].filename, sizeof(dr.filename));
                 dr.size = dataSize;
                 dr.recDataVec.push_back(myDataMain);
                 dr.blockid = fileDataTestVec[bcastData.displs[i] + j].blockid;
                 dr.nblock = fileDataTestVec[bcastData.displs[i] + j].nblock;
+                dr.rawsize = fileDataTestVec[bcastData.displs[i] + j].rawsize;
+                dr.crc = fileDataTestVec[bcastData.displs[i] + j].crc;
+                dr.flags = fileDataTestVec[bcastData.displs[i] + j].flags;
                 allData.push_back(dr);
 
                 // if I have all the blocks of the file, then I can merge them
                 if (dr.blockid ==   dr.nblock){
-                    if(comp){ 
-                        size_t lastblocksize = fileDataTestVec[bcastData.displs[i] + j].lastblocksize;
-                        if(mergeAndZip(allData, lastblocksize)){
-                            if(VERBOSE) std::cout << "File " << dr.filename << " merged and zipped successfully." << std::endl;
-                        } else {
-                            std::cerr << "Error merging and zipping file: " << dr.filename << std::endl;
-                            MPI_Abort(MPI_COMM_WORLD, -1);
-                        }
-                    }
-                    else{
-                        if(mergeAndWrite(allData)){
-                            if(VERBOSE) std::cout << "File " << dr.filename << " merged and written successfully." << std::endl;
-                        } else {
-                            std::cerr << "Error merging and writing file: " << dr.filename << std::endl;
-                            MPI_Abort(MPI_COMM_WORLD, -1);
-                        }
+                    if(mergeAndZip(allData)){
+                        if(VERBOSE) std::cout << "File " << dr.filename << " merged and zipped successfully." << std::endl;
+                    } else {
+                        std::cerr << "Error merging and zipping file: " << dr.filename << std::endl;
+                        MPI_Abort(MPI_COMM_WORLD, -1);
                     }
+                    for (auto &d : allData) pool.put(d.recDataVec[0]);
                     allData.clear();
                 }
             }
         }
-
-        // free the memory
-        for (long unsigned int i = 0; i < recDataVec.size(); ++i) {
-            delete[] recDataVec[i];
-        }
     }
 
     double end_time = MPI_Wtime();
@@ -454,9 +414,13 @@ int main(int argc, char* argv[]) {
         //print int milliseconds
         std::cout << "Elapsed time: " << (end_time - start_time) * 1000 << " milliseconds." << std::endl;
     }
+    reportDedup(myrank);
+    reportTrace(myrank, size);
+
+    for (auto &f : fileDataVec)
+        if (f.ptr) unmapFile(f.ptr, f.size);
 
     MPI_Type_free(&fileDataType);
-    MPI_Type_free(&iHeaderDataType);
     MPI_Finalize();
     return 0;
 }
\ No newline at end of file
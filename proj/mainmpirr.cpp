@@ -9,6 +9,7 @@
 
 #include <cmdlinempi.hpp>
 #include <utilitympi.hpp>
+#include <mpiio.hpp>
 #include <iostream>
 #include <sstream>
 #include <cstring>  // For memcpy
@@ -18,36 +19,244 @@
 
 //static int numFiles = -1;
 
-struct FileData_test {
-        char filename[256];
-        size_t size;
-        size_t nblock = 1;
-        size_t blockid = 0;
-        size_t fileIndex = -1;
-        size_t lastblocksize = 0;
-        size_t offset = 0;
-};
-
-
-MPI_Datatype createFileDataType() {
-    MPI_Datatype new_Type;
-    MPI_Datatype old_types[7] = { MPI_CHAR, MPI_UNSIGNED_LONG, MPI_UNSIGNED_LONG, MPI_UNSIGNED_LONG, MPI_UNSIGNED_LONG, MPI_UNSIGNED_LONG, MPI_UNSIGNED_LONG };
-    int blocklen[7] = { 256, 1, 1, 1, 1, 1, 1};
-
-    // NOTE: using this since the MPI_Aint_displ in the slides is not working
-    MPI_Aint offsets[7];
-    offsets[0] = offsetof(FileData_test, filename);
-    offsets[1] = offsetof(FileData_test, size);
-    offsets[2] = offsetof(FileData_test, nblock);
-    offsets[3] = offsetof(FileData_test, blockid);
-    offsets[4] = offsetof(FileData_test, fileIndex);
-    offsets[5] = offsetof(FileData_test, lastblocksize);
-    offsets[6] = offsetof(FileData_test, offset);
-
-    MPI_Type_create_struct(7, blocklen, offsets, old_types, &new_Type);
-    MPI_Type_commit(&new_Type);
-
-    return new_Type;
+
+// compresses/decompresses the block described by d, whose data is in ptrIn;
+// returns the result in a buffer of the pool and updates d.size (and d.crc, d.flags)
+static unsigned char *processBlock(FileData_test &d, const unsigned char *ptrIn, int myrank, BufferPool &pool, Codec &codec) {
+    size_t inSize = d.size;
+    size_t cmp_len = 0;
+    unsigned char* ptrOut = nullptr;
+
+    if (comp) {
+        // Compression
+        cmp_len = compressBound(inSize);
+        ptrOut = pool.get(cmp_len);
+        int err;
+        uint32_t flags;
+        const auto t0 = std::chrono::steady_clock::now();
+        TraceSpan span(TR_COMPRESS);
+        if ((err = codec.encode(ptrOut, &cmp_len, ptrIn, inSize, flags)) != Z_OK) {
+            if (QUITE_MODE >= 1) {
+                std::cerr << "Process " << myrank << " failed to compress block, error: " << err << std::endl;
+            }
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+        if (DEDUP) dedupStats.addEncode(t0, inSize);
+        span.bytes(inSize, cmp_len);
+        d.crc = blockChecksum(ptrOut, cmp_len);
+        d.flags = flags;
+    } else {
+        // Decompression
+        if (blockChecksum(ptrIn, inSize) != d.crc) {
+            std::cerr << "Process " << myrank << ": corrupted block " << d.blockid << " of file " << d.filename << std::endl;
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+        // the uncompressed size of the block is in the index of the archive
+        cmp_len = d.rawsize;
+        ptrOut = pool.get(cmp_len);
+        int err;
+        TraceSpan span(TR_DECOMPRESS);
+        if ((err = codec.decode(ptrOut, &cmp_len, ptrIn, inSize, d.flags)) != Z_OK || cmp_len != d.rawsize) {
+            std::cerr << "Process " << myrank << " failed to decompress block, error: " << err << std::endl;
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+        span.bytes(inSize, cmp_len);
+    }
+    d.size = cmp_len;
+    return ptrOut;
+}
+
+// main process, compression: stores the block d (its data is in buf, a buffer of the pool);
+// once all the blocks of the file have been received the archive is written and the
+// buffers given back
+static void collectBlock(std::unordered_map<std::string, std::vector<DataRec>> &allDataMap,
+                         const FileData_test &d, unsigned char *buf, BufferPool &pool) {
+    std::string filename = d.filename;
+
+    // Create a new DataRec object for this block
+    DataRec dr;
+    std::memcpy(dr.filename, d.filename, sizeof(dr.filename));
+    dr.filename[sizeof(dr.filename) - 1] = '\0';
+    dr.size = d.size;
+    dr.nblock = d.nblock;
+    dr.blockid = d.blockid;
+    dr.rawsize = d.rawsize;
+    dr.crc = d.crc;
+    dr.flags = d.flags;
+    dr.recDataVec.push_back(buf);
+
+    // Add this block's DataRec to the vector in allDataMap
+    std::vector<DataRec>& dataRecVec = allDataMap[filename];
+    dataRecVec.push_back(dr);
+
+    // Check if all blocks for this file have been received
+    if (dataRecVec.size() != dr.nblock) return;
+    if(VERBOSE) std::cout << "All blocks received for file: " << filename << std::endl;
+
+    // Sort the blocks by blockid
+    std::sort(dataRecVec.begin(), dataRecVec.end(), [](const DataRec &a, const DataRec &b) {
+        return a.blockid < b.blockid;
+    });
+
+    // Process the complete file
+    if (mergeAndZip(dataRecVec)) {
+        if (VERBOSE) std::cout << "File " << filename << " merged and zipped successfully." << std::endl;
+    } else {
+        std::cerr << "Error merging and zipping file: " << filename << std::endl;
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+
+    // Give back the buffers and remove the entry from the map after processing
+    for (auto &b : dataRecVec) pool.put(b.recDataVec[0]);
+    allDataMap.erase(filename);
+}
+
+// main process: receives from src the result of block d. A decompressed block is
+// received straight at its position in the output file, see OutputFiles
+static void receiveBlock(std::unordered_map<std::string, std::vector<DataRec>> &allDataMap, OutputFiles &outputs,
+                         const FileData_test &d, int src, int tag, BufferPool &pool) {
+    if (!comp) {
+        unsigned char *dst = nullptr;
+        if (!outputs.block(d.fileIndex, d.blockid, dst)) MPI_Abort(MPI_COMM_WORLD, -1);
+        {
+            TraceSpan span(TR_RECV);
+            span.bytes(d.size, 0);
+            MPI_Recv(dst, d.size, MPI_UNSIGNED_CHAR, src, tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        }
+        if (!outputs.done(d.fileIndex)) MPI_Abort(MPI_COMM_WORLD, -1);
+        return;
+    }
+    unsigned char *buf = pool.get(d.size);
+    {
+        TraceSpan span(TR_RECV);
+        span.bytes(d.size, 0);
+        MPI_Recv(buf, d.size, MPI_UNSIGNED_CHAR, src, tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    }
+    collectBlock(allDataMap, d, buf, pool);
+}
+
+/*
+ * On-demand scheduling (-O k).
+ * Instead of splitting the blocks in advance, the main process keeps k blocks in
+ * flight on each worker and sends a new one every time a result comes back (a
+ * result is also the request for more work), so a worker that gets easy blocks
+ * simply gets more of them.
+ * A worker has always k receives posted (MPI_Irecv), the next blocks are already
+ * there when it finishes the current one, and sends the results back with MPI_Isend:
+ * transfers, (de)compression and the writes of the main process overlap.
+ * A task with blockid 0 means that the slot of the worker gets no more work.
+ * The main process has k send slots per worker, used in turn: before a slot is
+ * reused its previous sends are completed (the worker has posted the receives),
+ * so only 2*k requests per worker are ever alive.
+ */
+enum { TAG_TASK = 1, TAG_TASK_DATA, TAG_RESULT, TAG_RESULT_DATA };
+
+static void onDemandMaster(std::vector<FileData> &fileDataVec, std::vector<FileData_test> &tasks,
+                           int size, MPI_Datatype fileDataType, BufferPool &pool, OutputFiles &outputs) {
+    static FileData_test stop;   // blockid 0
+    const size_t k = ONDEMAND;
+    // the two sends (task and data) of each slot, k slots for each worker
+    std::vector<MPI_Request> reqs(2 * k * (size - 1), MPI_REQUEST_NULL);
+    std::vector<size_t> slot(size, 0);
+    size_t next = 0, inflight = 0;
+
+    // sends the next block (or a stop) to worker w, straight from the mapping
+    auto dispatch = [&](int w) {
+        MPI_Request *r = &reqs[2 * ((w - 1) * k + slot[w])];
+        slot[w] = (slot[w] + 1) % k;
+        if (r[0] != MPI_REQUEST_NULL) {
+            TraceSpan wait(TR_WAIT);
+            MPI_Waitall(2, r, MPI_STATUSES_IGNORE);
+        }
+        if (next < tasks.size()) {
+            FileData_test &t = tasks[next++];
+            TraceSpan span(TR_SEND);
+            span.bytes(0, t.size);
+            MPI_Isend(&t, 1, fileDataType, w, TAG_TASK, MPI_COMM_WORLD, &r[0]);
+            MPI_Isend(fileDataVec[t.fileIndex].ptr + t.offset, t.size, MPI_UNSIGNED_CHAR, w, TAG_TASK_DATA, MPI_COMM_WORLD, &r[1]);
+            ++inflight;
+        } else {
+            MPI_Isend(&stop, 1, fileDataType, w, TAG_TASK, MPI_COMM_WORLD, &r[0]);
+            MPI_Isend(nullptr, 0, MPI_UNSIGNED_CHAR, w, TAG_TASK_DATA, MPI_COMM_WORLD, &r[1]);
+        }
+    };
+    // k credits for each worker
+    for (size_t c = 0; c < k; ++c)
+        for (int w = 1; w < size; ++w) dispatch(w);
+
+    std::unordered_map<std::string, std::vector<DataRec>> allDataMap;
+    while (inflight) {
+        FileData_test res;
+        MPI_Status status;
+        {
+            TraceSpan wait(TR_WAIT);
+            MPI_Recv(&res, 1, fileDataType, MPI_ANY_SOURCE, TAG_RESULT, MPI_COMM_WORLD, &status);
+        }
+        --inflight;
+        // the credit is free, the worker gets more work before the main process
+        // takes the data and writes
+        dispatch(status.MPI_SOURCE);
+        receiveBlock(allDataMap, outputs, res, status.MPI_SOURCE, TAG_RESULT_DATA, pool);
+    }
+    TraceSpan wait(TR_WAIT);
+    MPI_Waitall(reqs.size(), reqs.data(), MPI_STATUSES_IGNORE);
+}
+
+// maxBlock is the size of the biggest block the main process can send
+static void onDemandWorker(int myrank, size_t maxBlock, MPI_Datatype fileDataType, BufferPool &pool, Codec &codec) {
+    struct Slot {
+        FileData_test  task, result;
+        unsigned char *in  = nullptr;
+        unsigned char *out = nullptr;
+        MPI_Request    recv[2];
+        MPI_Request    send[2] = { MPI_REQUEST_NULL, MPI_REQUEST_NULL };
+        bool           stopped = false;
+    };
+    std::vector<Slot> slots(ONDEMAND);
+    auto post = [&](Slot &s) {
+        MPI_Irecv(&s.task, 1, fileDataType, 0, TAG_TASK, MPI_COMM_WORLD, &s.recv[0]);
+        MPI_Irecv(s.in, maxBlock, MPI_UNSIGNED_CHAR, 0, TAG_TASK_DATA, MPI_COMM_WORLD, &s.recv[1]);
+    };
+    for (auto &s : slots) {
+        s.in = pool.get(maxBlock);
+        post(s);
+    }
+
+    // the receives match the messages in the order they are posted, so the slots
+    // are served round-robin, in the same order they have been (re)posted
+    int stopped = 0;
+    for (size_t i = 0; stopped < ONDEMAND; i = (i + 1) % slots.size()) {
+        Slot &s = slots[i];
+        if (s.stopped) continue;
+        {
+            TraceSpan wait(TR_WAIT);
+            MPI_Waitall(2, s.recv, MPI_STATUSES_IGNORE);
+        }
+        if (s.task.blockid == 0) {
+            s.stopped = true;
+            ++stopped;
+            continue;
+        }
+        // the previous result of the slot has to be gone before reusing its buffers
+        {
+            TraceSpan wait(TR_WAIT);
+            MPI_Waitall(2, s.send, MPI_STATUSES_IGNORE);
+        }
+        if (s.out) pool.put(s.out);
+        s.result = s.task;
+        s.out = processBlock(s.result, s.in, myrank, pool, codec);
+        post(s);
+        TraceSpan span(TR_SEND);
+        span.bytes(0, s.result.size);
+        MPI_Isend(&s.result, 1, fileDataType, 0, TAG_RESULT, MPI_COMM_WORLD, &s.send[0]);
+        MPI_Isend(s.out, s.result.size, MPI_UNSIGNED_CHAR, 0, TAG_RESULT_DATA, MPI_COMM_WORLD, &s.send[1]);
+    }
+    TraceSpan wait(TR_WAIT);
+    for (auto &s : slots) {
+        MPI_Waitall(2, s.send, MPI_STATUSES_IGNORE);
+        if (s.out) pool.put(s.out);
+        pool.put(s.in);
+    }
 }
 
 
@@ -65,11 +274,35 @@ int main(int argc, char* argv[]) {
             MPI_Abort(MPI_COMM_WORLD, -1);
             return -1;
     }
+    // -O: the main process only hands out the blocks, with no other process nobody would compress them
+    if (ONDEMAND && size < 2) {
+        if (!myrank) std::fprintf(stderr, "Error: '-O' needs at least 2 processes\n");
+        MPI_Abort(MPI_COMM_WORLD, -1);
+        return -1;
+    }
 
     std::vector<FileData> fileDataVec;
     std::vector<FileData_test> fileDataTestVec;
+    // main process, decompression: the outputs, the blocks are put straight in place
+    OutputFiles outputs;
+
+    // per-rank pool of block buffers, recycled instead of allocated for every block,
+    // and per-rank codec, reset between blocks instead of allocated for every block
+    BufferPool pool(compressBound(BIGFILE_LOW_THRESHOLD));
+    Codec codec(LEVEL, STRATEGY, RESTART_INTERVAL);
 
     double start_time = MPI_Wtime();
+    traceThread("rank", myrank);
+
+    // the blocks do not go through the main process, see mpiio.hpp
+    if (MPIIO_MODE) {
+        mpiioRun(argv[start], myrank, size, pool, codec);
+        double end_time = MPI_Wtime();
+        if (!myrank) std::cout << "Elapsed time: " << (end_time - start_time) * 1000 << " milliseconds." << std::endl;
+        reportTrace(myrank, size);
+        MPI_Finalize();
+        return 0;
+    }
 
     // "header" to broadcast the number of files and the number of files each process will receive
     InitialHeader bcastData;
@@ -77,80 +310,49 @@ int main(int argc, char* argv[]) {
         // read the files and store the data in fileDataVec
         if (walkDirAndGetFiles(argv[start], fileDataVec, comp)) {
             if(VERBOSE) std::cout << "Files processed successfully." << std::endl;
+            // -t 0: the block size depends on the files found, the main process does not compress
+            if (comp && AUTO_BLOCKSIZE) BIGFILE_LOW_THRESHOLD = autoBlockSize(fileDataVec, std::max(1, size - 1), QUITE_MODE>=1);
 
+            TraceSpan span(TR_DISPATCH);
             fileDataTestVec.reserve(fileDataVec.size());
             //for each file in fileDataVec, create a FileData_test object and store it in fileDataTestVec
             for (size_t f = 0; f < fileDataVec.size(); ++f) {
                 if(!comp) { // decompression
-                    //read the first 8 bytes to get the number of blocks
-                    size_t offset = 0;
-                    size_t nblocks = 0;
-                    std::memcpy(&nblocks, fileDataVec[f].data.data(), sizeof(size_t));
-                    offset += sizeof(size_t);
-                    //for each block read the size of the blocks
-                    std::vector<size_t> blockSizes;
-                    for (size_t i = 0; i < nblocks; ++i) {
-                        size_t blocksize = 0;
-                        std::memcpy(&blocksize, fileDataVec[f].data.data() + offset, sizeof(size_t));
-                        offset += sizeof(size_t);
-                        blockSizes.push_back(blocksize);
+                    // the index at the end of the archive has the position and the sizes of each block
+                    ContainerReader reader;
+                    if (!reader.open(fileDataVec[f].ptr, fileDataVec[f].size)) {
+                        std::cerr << "Error with the header during decompression (" << reader.error() << "): " << fileDataVec[f].filename << std::endl;
+                        MPI_Abort(MPI_COMM_WORLD, -1);
                     }
-                    // save the size of the last block uncompressed
-                    size_t lastblocksize = 0;
-                    std::memcpy(&lastblocksize, fileDataVec[f].data.data() + offset, sizeof(size_t));
-                    // save the offset for later use
-                    offset += sizeof(size_t);
+                    const size_t nblocks = reader.nblocks();
+                    outputs.add(f, fileDataVec[f].filename, reader);
                     FileData_test fdt;
                     // for each block create the FileData_test object with all the infos and store it in fileDataTestVec
                     for(size_t i = 0; i < nblocks; ++i) {
+                        const BlockEntry &e = reader.block(i);
                         std::memcpy(fdt.filename, fileDataVec[f].filename, sizeof(fdt.filename));
                         fdt.filename[sizeof(fdt.filename) - 1] = '\0';
-                        fdt.size = blockSizes[i];
+                        fdt.size = e.cmpSize;
                         fdt.nblock = nblocks;
                         fdt.blockid = i+1;
                         fdt.fileIndex = f;
-                        fdt.lastblocksize = lastblocksize;
-                        fdt.offset = offset;
+                        fdt.lastblocksize = reader.block(nblocks-1).rawSize;
+                        fdt.offset = e.offset;
+                        fdt.rawsize = e.rawSize;
+                        fdt.crc = e.crc;
+                        fdt.flags = e.flags;
                         fileDataTestVec.push_back(fdt);
-                        offset += blockSizes[i];
                     }
                 }else{ //compression
                     if (fileDataVec[f].size > BIGFILE_LOW_THRESHOLD) {
-                        // File is large; split into blocks
-                        const size_t filesize = fileDataVec[f].size;
-                        const size_t fullblocks  = filesize / BIGFILE_LOW_THRESHOLD;
-                        const size_t partialblock= filesize % BIGFILE_LOW_THRESHOLD;
-                        for(size_t i=0;i<fullblocks;++i) {
-                            FileData_test fdt;
-
-                            //memcpy becouse strncpy skipped some copy during the loop
-                            std::memcpy(fdt.filename, fileDataVec[f].filename, sizeof(fdt.filename) - 1);
-                            //null-termination
-                            fdt.filename[sizeof(fdt.filename) - 1] = '\0';
-
-                            fdt.size = BIGFILE_LOW_THRESHOLD;
-                            fdt.nblock = fullblocks+(partialblock>0);
-                            fdt.blockid = i+1;
-                            fdt.fileIndex = f;
-                            fdt.lastblocksize = partialblock ? partialblock : BIGFILE_LOW_THRESHOLD;
-                            fileDataTestVec.push_back(fdt);
-                        }
-                        if (partialblock) {
-                            FileData_test fdt;
-                            std::memcpy(fdt.filename, fileDataVec[f].filename, sizeof(fdt.filename) - 1);
-                            fdt.filename[sizeof(fdt.filename) - 1] = '\0';
-                            fdt.size = partialblock;
-                            fdt.nblock = fullblocks+1;
-                            fdt.blockid = fullblocks+1;
-                            fdt.fileIndex = f;
-                            fdt.lastblocksize = partialblock;
-                            fileDataTestVec.push_back(fdt);
-                        }
+                        // File is large; split into blocks, without the duplicates with -H 1
+                        splitBlocks(fileDataVec[f], f, fileDataTestVec);
                     } else {
                         // File is small enough; add as a single block
                         FileData_test fdt;
                         std::strncpy(fdt.filename, fileDataVec[f].filename, sizeof(fdt.filename));
                         fdt.size = fileDataVec[f].size;
+                        fdt.rawsize = fdt.size;
                         fdt.nblock = 1;
                         fdt.blockid = 1;
                         fdt.fileIndex = f;
@@ -165,36 +367,37 @@ int main(int argc, char* argv[]) {
         }
         bcastData.numFiles = fileDataTestVec.size();
     }
+    // the other processes need the block size picked by the main process
+    shareBlockSize(pool);
+
+    // the blocks are handed out on demand instead of being split in advance
+    if (ONDEMAND) {
+        uint64_t maxBlock = 0;
+        for (auto &t : fileDataTestVec) maxBlock = std::max<uint64_t>(maxBlock, t.size);
+        MPI_Bcast(&maxBlock, 1, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+        MPI_Datatype fileDataType = createFileDataType();
+        if (!myrank) onDemandMaster(fileDataVec, fileDataTestVec, size, fileDataType, pool, outputs);
+        else         onDemandWorker(myrank, maxBlock, fileDataType, pool, codec);
+
+        double end_time = MPI_Wtime();
+        if (!myrank) std::cout << "Elapsed time: " << (end_time - start_time) * 1000 << " milliseconds." << std::endl;
+        reportDedup(myrank);
+        reportTrace(myrank, size);
+        for (auto &f : fileDataVec)
+            if (f.ptr) unmapFile(f.ptr, f.size);
+        MPI_Type_free(&fileDataType);
+        MPI_Finalize();
+        return 0;
+    }
 
     /* first difference from the previous version:
     * now we have to exclude the main process from the total number of processes
     * when distributing the files among the processes */
 
-    // Total number of processes excluding process 0
-    int totalProcesses = size - 1;
-
-    // Calculate the base and remainder for the remaining processes
-    int base = bcastData.numFiles / totalProcesses;
-    int remainder = bcastData.numFiles % totalProcesses;
-
-    // Initialize sendCounts and displs for all processes
-    for (int i = 0; i < size; ++i) {
-        bcastData.sendCounts[i] = 0;
-        bcastData.displs[i] = 0;
-    }
-
-    // Calculate sendCounts and displs for processes 1 to (size-1)
-    int offset = 0;
-    for (int i = 1; i < size; ++i) {
-        bcastData.sendCounts[i] = base + ((i - 1) < remainder ? 1 : 0);
-        bcastData.displs[i] = offset;
-        offset += bcastData.sendCounts[i];
-    }
-    // Process 0 gets no data, so its sendCounts and displs remain zero.
-    MPI_Datatype iHeaderDataType = createIHeaderDataType(size);
-
-    //bdacst the information needed to all the processes (inclusing process 0)
-    MPI_Bcast(&bcastData, 1, iHeaderDataType, 0, MPI_COMM_WORLD);
+    // only the number of blocks is broadcast, the split (among the processes 1 to size-1)
+    // is computed locally; process 0 gets no data
+    MPI_Bcast(&bcastData.numFiles, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    bcastData.split(size, 1);
     if(VERBOSE) std::cout << "Process " << myrank << " will receive " << bcastData.sendCounts[myrank] << " files." << std::endl;
 
     // now everyone knows how many files they will receive
@@ -205,8 +408,11 @@ int main(int argc, char* argv[]) {
 
     //scatter the file information to all the processes, each process has a vector of FileData_test
     //ready to store the data thanks to the previous broadcast
-    MPI_Scatterv(fileDataTestVec.data(), bcastData.sendCounts, bcastData.displs, fileDataType,
-                 recvBuffer.data(), bcastData.sendCounts[myrank], fileDataType, 0, MPI_COMM_WORLD);
+    {
+        TraceSpan wait(TR_WAIT);
+        MPI_Scatterv(fileDataTestVec.data(), bcastData.sendCounts.data(), bcastData.displs.data(), fileDataType,
+                     recvBuffer.data(), bcastData.sendCounts[myrank], fileDataType, 0, MPI_COMM_WORLD);
+    }
 
     //store all the data untill all processes finish
     std::vector<unsigned char*> myDataVec(bcastData.sendCounts[myrank]);
@@ -219,46 +425,17 @@ int main(int argc, char* argv[]) {
         // First loop: Receive the data
         for (int i = 0; i < bcastData.sendCounts[myrank]; ++i) {
             
-            myData = new unsigned char[recvBuffer[i].size];
+            myData = pool.get(recvBuffer[i].size);
+            TraceSpan span(TR_RECV);
+            span.bytes(recvBuffer[i].size, 0);
             MPI_Recv(myData, recvBuffer[i].size, MPI_UNSIGNED_CHAR, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
             dataVec[i] = myData;  // Store the received data for later processing
         }
 
         // Second loop: Process the received data
         for (int i = 0; i < bcastData.sendCounts[myrank]; ++i) {
-            size_t inSize = recvBuffer[i].size;
-            size_t cmp_len = 0;
-            unsigned char* ptrOut = nullptr;
-            
-            if (comp) {
-                // Compression
-                cmp_len = compressBound(inSize);
-                ptrOut = new unsigned char[cmp_len];
-                int err;
-                if ((err = compress(ptrOut, &cmp_len, (const unsigned char*)dataVec[i], inSize)) != Z_OK) {
-                    if (QUITE_MODE >= 1) {
-                        std::cerr << "Process " << myrank << " failed to compress block, error: " << err << std::endl;
-                    }
-                    delete[] ptrOut;
-                    delete[] dataVec[i];
-                    MPI_Abort(MPI_COMM_WORLD, -1);
-                }
-            } else {
-                // Decompression
-                cmp_len = BIGFILE_LOW_THRESHOLD;
-                ptrOut = new unsigned char[cmp_len];
-                int err;
-                if ((err = uncompress(ptrOut, &cmp_len, (const unsigned char*)dataVec[i], inSize)) != Z_OK) {
-                    std::cerr << "Process " << myrank << " failed to decompress block, error: " << err << std::endl;
-                    delete[] ptrOut;
-                    delete[] dataVec[i];
-                    MPI_Abort(MPI_COMM_WORLD, -1);
-                }
-            }
-            
-            myDataVec[i] = ptrOut;
-            recvBuffer[i].size = cmp_len;
-            delete[] dataVec[i];  // Free the memory of the original data after processing
+            myDataVec[i] = processBlock(recvBuffer[i], dataVec[i], myrank, pool, codec);
+            pool.put(dataVec[i]);  // Give back the buffer of the original data after processing
         }
     }
         
@@ -268,39 +445,34 @@ int main(int argc, char* argv[]) {
         
         for (int i = 1; i < size; ++i) {
             for (int j = bcastData.displs[i]; j < bcastData.displs[i] + bcastData.sendCounts[i]; ++j) {
-                if (comp){
-                    // make a copy of the data to send
-                    unsigned char* sendData = new unsigned char[fileDataTestVec[j].size];
-                    std::memcpy(sendData, fileDataVec[fileDataTestVec[j].fileIndex].data.data() + ((fileDataTestVec[j].blockid-1) * BIGFILE_LOW_THRESHOLD), fileDataTestVec[j].size);
-                    
-                    MPI_Send(sendData, 
-                            fileDataTestVec[j].size, MPI_UNSIGNED_CHAR, i, 0, MPI_COMM_WORLD);
-                    
-                delete[] sendData;
-                }else{
-                    unsigned char* sendData = new unsigned char[fileDataTestVec[j].size];
-                    size_t offset = fileDataTestVec[j].offset;
-                    std::memcpy(sendData, fileDataVec[fileDataTestVec[j].fileIndex].data.data() + offset, fileDataTestVec[j].size);
-                    MPI_Send(sendData, 
-                            fileDataTestVec[j].size, MPI_UNSIGNED_CHAR, i, 0, MPI_COMM_WORLD);
-                    delete[] sendData;
-                }
+                // the blocks are sent straight from the mapping of the file, without copying them
+                // fileDataVec[ X ].ptr + Y is the pointer to the block, X is the index of the file
+                // (fileDataTestVec[j].fileIndex), Y the position of the block in the file
+                const size_t offset = fileDataTestVec[j].offset;
+                TraceSpan span(TR_SEND);
+                span.bytes(0, fileDataTestVec[j].size);
+                MPI_Send(fileDataVec[fileDataTestVec[j].fileIndex].ptr + offset,
+                        fileDataTestVec[j].size, MPI_UNSIGNED_CHAR, i, 0, MPI_COMM_WORLD);
             }
         }
     }
 
-    MPI_Gatherv(recvBuffer.data(), bcastData.sendCounts[myrank], fileDataType,
-                fileDataTestVec.data(), bcastData.sendCounts, bcastData.displs, fileDataType, 0, MPI_COMM_WORLD);
+    {
+        TraceSpan wait(TR_WAIT);
+        MPI_Gatherv(recvBuffer.data(), bcastData.sendCounts[myrank], fileDataType,
+                    fileDataTestVec.data(), bcastData.sendCounts.data(), bcastData.displs.data(), fileDataType, 0, MPI_COMM_WORLD);
+    }
 
 
     if(myrank){
         //ogni processo manda i dati compressi al processo 0
         for (int i = 0; i < bcastData.sendCounts[myrank]; ++i) {
+            TraceSpan span(TR_SEND);
+            span.bytes(0, recvBuffer[i].size);
             MPI_Send(myDataVec[i], recvBuffer[i].size, MPI_UNSIGNED_CHAR, 0, 0, MPI_COMM_WORLD);
-            delete[] myDataVec[i];
+            pool.put(myDataVec[i]);
         }
     }else{  // Main process
-        std::vector<unsigned char*> recDataVec;
         /*
         second difference from the previous version:
         * instead of storing all the data in a single vector, we store the data in a map
@@ -321,74 +493,14 @@ int main(int argc, char* argv[]) {
                 if (currentIndex[i] < bcastData.sendCounts[i]) {
                     int j = currentIndex[i];
 
-                    // The size of the data being received from process 'i'
-                    size_t dataSize = fileDataTestVec[bcastData.displs[i] + j].size;
-                    
-                    // Allocate memory for the incoming data
-                    unsigned char* myDataMain = new unsigned char[dataSize];
-                    
                     // Receive the data from process 'i'
-                    MPI_Recv(myDataMain, dataSize, MPI_UNSIGNED_CHAR, i, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-                    
-                    // Retrieve the filename from the incoming data
-                    std::string filename = fileDataTestVec[bcastData.displs[i] + j].filename;
-
-                    // Create a new DataRec object for this block
-                    DataRec dr;
-
-                    std::memcpy(dr.filename, filename.c_str(), sizeof(dr.filename));
-                    dr.filename[sizeof(dr.filename) - 1] = '\0';
-
-                    dr.size = dataSize;
-                    dr.nblock = fileDataTestVec[bcastData.displs[i] + j].nblock;
-                    dr.blockid = fileDataTestVec[bcastData.displs[i] + j].blockid;
-                    dr.recDataVec.push_back(myDataMain);
-
-                    // Add this block's DataRec to the vector in allDataMap
-                    allDataMap[filename].push_back(dr);
+                    receiveBlock(allDataMap, outputs, fileDataTestVec[bcastData.displs[i] + j], i, 0, pool);
 
                     currentIndex[i]++;
                     collectedElements++;
-
-                    // Check if all blocks for this file have been received
-                    if (allDataMap[filename].size() == dr.nblock) {
-                        if(VERBOSE) std::cout << "All blocks received for file: " << filename << std::endl;
-
-                        // Sort the blocks by blockid
-                        std::vector<DataRec>& dataRecVec = allDataMap[filename];
-                        std::sort(dataRecVec.begin(), dataRecVec.end(), [](const DataRec &a, const DataRec &b) {
-                            return a.blockid < b.blockid;
-                        });
-
-                        size_t lastblocksize = fileDataTestVec[bcastData.displs[i] + j].lastblocksize;
-
-                        // Process the complete file
-                        if (comp) {
-                            if (mergeAndZip(dataRecVec, lastblocksize)) {
-                                if (VERBOSE) std::cout << "File " << filename << " merged and zipped successfully." << std::endl;
-                            } else {
-                                std::cerr << "Error merging and zipping file: " << filename << std::endl;
-                                MPI_Abort(MPI_COMM_WORLD, -1);
-                            }
-                        } else {
-                            if (mergeAndWrite(dataRecVec)) {
-                                if (VERBOSE) std::cout << "File " << filename << " merged and written successfully." << std::endl;
-                            } else {
-                                std::cerr << "Error merging and writing file: " << filename << std::endl;
-                                MPI_Abort(MPI_COMM_WORLD, -1);
-                            }
-                        }
-
-                        // Remove the entry from the map after processing
-                        allDataMap.erase(filename);
-                    }
                 }
             }
         }
-        // Free the memory of the received data
-        for (long unsigned int i = 0; i < recDataVec.size(); ++i) {
-            delete[] recDataVec[i];
-        }
     }
 
     double end_time = MPI_Wtime();
@@ -399,9 +511,13 @@ int main(int argc, char* argv[]) {
         std::cout << "Elapsed time: " << (end_time - start_time) * 1000 << " milliseconds." << std::endl;
 
     }
+    reportDedup(myrank);
+    reportTrace(myrank, size);
+
+    for (auto &f : fileDataVec)
+        if (f.ptr) unmapFile(f.ptr, f.size);
 
     MPI_Type_free(&fileDataType);
-    MPI_Type_free(&iHeaderDataType);
     MPI_Finalize();
     return 0;
 }
\ No newline at end of file
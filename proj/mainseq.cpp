@@ -3,220 +3,134 @@
 #include<iostream>
 
 #include <cmdline.hpp>
+#include <levelsweep.hpp>
 
 using namespace ff;
 
-bool doWorkCompress(unsigned char *ptr, size_t size, const std::string &fname) {
-    if (size<= BIGFILE_LOW_THRESHOLD) {
-        /* if a file is smaller than the threshold it does not need partitioning */
-        /* we save the information to create the header */
-        bool isSingleBlock=true;
-        size_t nblocks=1;
-        size_t lastBlock=size;
-
-        unsigned char * inPtr  = ptr;
-		size_t          inSize = size;
-        // get an estimation of the maximum compression size
-        size_t cmp_len = compressBound(inSize);
-        // allocate memory to store compressed data in memory
-        unsigned char *ptrOut = new unsigned char[cmp_len];
-        if (compress(ptrOut, &cmp_len, (const unsigned char *)inPtr, inSize) != Z_OK) {
-            return false;
-        }
-        std::string outfile = fname + SUFFIX;
-        std::ofstream outFile(outfile, std::ios::binary);
-        if (!outFile.is_open()) {
-            std::cerr << "Failed to open output file: " << outfile << std::endl;
-            return false;
-        }
-
-        // Write a header indicating it's a single block file
-        size_t header = 1; // 1 indicates a single block
-        outFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
-		//save the compressed size
-		outFile.write(reinterpret_cast<const char*>(&cmp_len), sizeof(size_t));
-		//save the last block size
-		outFile.write(reinterpret_cast<const char*>(&lastBlock), sizeof(lastBlock));
-
-        // Write the compressed data
-        outFile.write(reinterpret_cast<const char*>(ptrOut), cmp_len);
-		
-
-        if (REMOVE_ORIGIN) {
-            unlink(fname.c_str());
+// The archive being written by the AsyncWriter: the jobs of a file share it, it
+// goes away with the last one. ok is only touched by the writer thread.
+struct OutArchive {
+    ContainerWriter writer;
+    bool            ok = true;
+};
+
+// Compute and I/O overlap even in the sequential version: the blocks are
+// compressed straight from the mapping while the next one is being read ahead
+// (prefetchRegion) and the previous ones are written by the writer thread.
+// The output buffers are taken from pool and given back by the writer thread,
+// codec keeps the deflate state across the blocks.
+bool doWorkCompress(unsigned char *ptr, size_t size, const std::string &fname, BufferPool &pool, Codec &codec, AsyncWriter &out) {
+    /* a file smaller than the threshold is a single block, a bigger one is
+     * split in blocks of BIGFILE_LOW_THRESHOLD bytes, the last one may be shorter */
+    const size_t nblocks = (size <= BIGFILE_LOW_THRESHOLD) ? 1 : (size + BIGFILE_LOW_THRESHOLD - 1) / BIGFILE_LOW_THRESHOLD;
+
+    std::string outfile = fname + SUFFIX;
+    auto archive = std::make_shared<OutArchive>();
+    if (!archive->writer.open(outfile, BIGFILE_LOW_THRESHOLD)) return false;
+    if (nblocks > 1) madvise(ptr, size, MADV_SEQUENTIAL);
+    // -H 1: the whole file is mapped, the duplicates are checked byte by byte too
+    BlockDedup dedup;
+
+    for (size_t i = 0; i < nblocks; ++i) {
+        const size_t inSize = (nblocks == 1) ? size : std::min(size - i * BIGFILE_LOW_THRESHOLD, BIGFILE_LOW_THRESHOLD);
+        if (i + 1 < nblocks)
+            prefetchRegion(ptr + (i + 1) * BIGFILE_LOW_THRESHOLD, std::min(size - (i + 1) * BIGFILE_LOW_THRESHOLD, BIGFILE_LOW_THRESHOLD));
+        // the job of the last block also closes the archive, one job per small file
+        const bool last = (i + 1 == nblocks);
+        size_t dup = BlockDedup::NONE;
+        if (DEDUP && nblocks > 1) {
+            dup = dedup.find(i, ptr + i * BIGFILE_LOW_THRESHOLD, inSize);
+            dedupStats.addBlock(inSize, dup != BlockDedup::NONE);
         }
-
-        delete[] ptrOut;
-		outFile.close();
-		return true;
-        
-        /* continue */
-
-    } else {
-        /* if a file is bigger than the threshold it needs partitioning */
-        const size_t fullblocks  = size / BIGFILE_LOW_THRESHOLD;
-        const size_t partialblock= size % BIGFILE_LOW_THRESHOLD;
-
-        size_t nblocks=fullblocks+(partialblock>0);
-        size_t lastBlock= partialblock ? partialblock : BIGFILE_LOW_THRESHOLD;
-        
-        /* save all the blocks in memory */
-        std::vector<unsigned char *> blocks(nblocks);
-        for(size_t i=0;i<fullblocks;++i) {
-            blocks[i]=new unsigned char[BIGFILE_LOW_THRESHOLD];
-            memcpy(blocks[i],ptr+i*BIGFILE_LOW_THRESHOLD,BIGFILE_LOW_THRESHOLD);
-        }
-        /* if there is a partial block, the last block will be the partial block */
-        if (partialblock) {
-            blocks[fullblocks]=new unsigned char[partialblock];
-            memcpy(blocks[fullblocks],ptr+fullblocks*BIGFILE_LOW_THRESHOLD,partialblock);
-        }
-
-        std::vector<unsigned char *> compressedBlocks(nblocks);
-        std::vector<size_t> compressedSizes(nblocks);
-        for(size_t i=0;i<fullblocks;++i) {
-            size_t cmp_len = compressBound(BIGFILE_LOW_THRESHOLD);
-            compressedBlocks[i] = new unsigned char[cmp_len];
-            if (compress(compressedBlocks[i], &cmp_len, (const unsigned char *)blocks[i], BIGFILE_LOW_THRESHOLD) != Z_OK) {
+        // a duplicate is not compressed, the writer repeats the entries of the first copy
+        unsigned char *ptrOut = nullptr;
+        size_t cmp_len = 0;
+        uint32_t flags = 0;
+        if (dup == BlockDedup::NONE) {
+            cmp_len = compressBound(inSize);
+            ptrOut = pool.get(cmp_len);
+            const auto t0 = std::chrono::steady_clock::now();
+            TraceSpan span(TR_COMPRESS);
+            if (codec.encode(ptrOut, &cmp_len, ptr + i * BIGFILE_LOW_THRESHOLD, inSize, flags) != Z_OK) {
+                pool.put(ptrOut);
+                // after the blocks already queued, the partial archive is removed
+                out.submit([archive, outfile] {
+                    archive->ok = false;
+                    unlink(outfile.c_str());
+                    return false;
+                });
                 return false;
             }
-            compressedSizes[i] = cmp_len;
+            span.bytes(inSize, cmp_len);
+            if (DEDUP) dedupStats.addEncode(t0, inSize);
         }
-        if (partialblock) {
-            size_t cmp_len = compressBound(partialblock);
-            compressedBlocks[fullblocks] = new unsigned char[cmp_len];
-            if (compress(compressedBlocks[fullblocks], &cmp_len, (const unsigned char *)blocks[fullblocks], partialblock) != Z_OK) {
+        out.submit([archive, &pool, ptrOut, cmp_len, inSize, flags, dup, last, fname, outfile] {
+            TraceSpan span(TR_WRITE);
+            span.bytes(0, cmp_len);
+            if (ptrOut) {
+                archive->ok = archive->ok && archive->writer.append(ptrOut, cmp_len, inSize, blockChecksum(ptrOut, cmp_len), flags);
+                pool.put(ptrOut);
+            } else {
+                archive->ok = archive->ok && archive->writer.duplicate(dup);
+            }
+            if (!last) return archive->ok;
+            if (!archive->writer.close() || !archive->ok) {
+                unlink(outfile.c_str());
                 return false;
             }
-            compressedSizes[fullblocks] = cmp_len;
-        }
-
-
-
-        /* save the compressed blocks in memory */
-        std::string outfile = fname + SUFFIX;
-        std::ofstream outFile(outfile, std::ios::binary);
-        if (!outFile.is_open()) {
-            std::cerr << "Failed to open output file: " << outfile << std::endl;
-            return false;
-        }
-
-        //print the header
-        // Write a header indicating it's a multi-block file
-        size_t header = nblocks;
-        outFile.write(reinterpret_cast<const char*>(&header), sizeof(size_t));
-        // Write the sizes of each compressed block
-        for (size_t i = 0; i < nblocks; ++i) {
-            outFile.write(reinterpret_cast<const char*>(&compressedSizes[i]), sizeof(size_t));
-        }
-        // Write the size of the last uncompressed block
-        outFile.write(reinterpret_cast<const char*>(&lastBlock), sizeof(size_t));
-
-
-        // Write the compressed data of each block
-        for (size_t i = 0; i < nblocks; ++i) {
-            outFile.write(reinterpret_cast<const char*>(compressedBlocks[i]), compressedSizes[i]);
-        }
-
-        if (REMOVE_ORIGIN) {
-            unlink(fname.c_str());
-        }
-
-        for (size_t i = 0; i < nblocks; ++i) {
-            delete[] blocks[i];
-            delete[] compressedBlocks[i];
-        }
-        outFile.close();
-        return true;
-
-
-
-
+            if (REMOVE_ORIGIN) unlink(fname.c_str());
+            return true;
+        });
     }
     return true;
 }
 
-bool doWorkDecompress(unsigned char *ptr, size_t size, const std::string &fname) {
-    
-    // Read the header to determine if it's a single block or multi-block file
-    size_t header;
-    memcpy(&header, ptr, sizeof(header));
+// The output is created with its final size and mapped (see outmap.hpp), each
+// block is decompressed straight at its position: no buffer and no write.
+bool doWorkDecompress(unsigned char *ptr, size_t size, const std::string &fname, Codec &codec) {
     
-    //if (header == 1) {
-        // Single block file
-        /* continue with single block decompression */
-      //  return true;
-    //} else {
-        // Multi-block file
-    size_t numBlocks = header;
-
-    // Read the sizes of each block
-    if (QUITE_MODE>2) std::cout << "numBlocks: " << numBlocks << std::endl;
-    std::vector<size_t> blockSizes(numBlocks);
-    for (size_t i = 0; i < numBlocks; ++i) {
-        size_t blockSize;
-        // we have to consider the offset of the header
-        memcpy(&blockSize, ptr + sizeof(header) + i * sizeof(blockSize), sizeof(blockSize));
-        blockSizes[i] = blockSize;
-    }
-    /* when decompressing a multi-block file, every block will be BIGFILE_LOW_THRESHOLD
-    * except the last one that will be the remaining size */
-    size_t lastBlock;
-    memcpy(&lastBlock, ptr + sizeof(header) + numBlocks * sizeof(size_t), sizeof(lastBlock));
-
-    //calculate the size of the header, which will be the offset
-    size_t headerSize = sizeof(header) + numBlocks * sizeof(size_t) + sizeof(lastBlock);
-    //print the header size
-
-    //now we have the information to read the data
-    size_t currentPos = 0;
-
-    std::vector<unsigned char *> blockData(numBlocks);
-
-    for (size_t i = 0; i < numBlocks; ++i) {
-        blockData[i] = new unsigned char[blockSizes[i]];
-        memcpy(blockData[i], ptr + headerSize + currentPos, blockSizes[i]);
-        currentPos += blockSizes[i];
-    }
-
-    // Decompress each block
-    std::vector<unsigned char *> decompressedBlocks(numBlocks);
-    for (size_t i = 0; i < numBlocks-1; ++i) {
-        decompressedBlocks[i] = new unsigned char[BIGFILE_LOW_THRESHOLD];
-        size_t decompressedSize = BIGFILE_LOW_THRESHOLD;
-        if (uncompress(decompressedBlocks[i], &decompressedSize, blockData[i], blockSizes[i]) != Z_OK) {
-            return false;
-        }
-    }
-    decompressedBlocks[numBlocks-1] = new unsigned char[lastBlock];
-    size_t decompressedSize = lastBlock;
-    if (uncompress(decompressedBlocks[numBlocks-1], &decompressedSize, blockData[numBlocks-1], blockSizes[numBlocks-1]) != Z_OK) {
+    // read the index of the blocks from the end of the archive
+    ContainerReader reader;
+    if (!reader.open(ptr, size)) {
+        std::cerr << "Error with the header during decompression (" << reader.error() << "): " << fname << std::endl;
         return false;
     }
+    const size_t numBlocks = reader.nblocks();
+    if (QUITE_MODE>2) std::cout << "numBlocks: " << numBlocks << std::endl;
 
-    // Write the decompressed data to a file
     std::string outfile = fname.substr(0, fname.size() - 4);
-    std::ofstream outFile(outfile, std::ios::binary);
-    if (!outFile.is_open()) {
-        std::cerr << "Failed to open output file: " << outfile << std::endl;
-        return false;
-    }
-
-    for (size_t i = 0; i < numBlocks; ++i) {
-        outFile.write(reinterpret_cast<const char*>(decompressedBlocks[i]), (i == numBlocks-1) ? lastBlock : BIGFILE_LOW_THRESHOLD);
-    }
-
-    if (REMOVE_ORIGIN) {
-        unlink(fname.c_str());
+    int fd;
+    unsigned char *dst;
+    if (!mapOutputFile(outfile, reader.rawSize(), fd, dst)) return false;
+    if (numBlocks > 1) madvise(ptr, size, MADV_SEQUENTIAL);
+
+    // Decompress each block, the uncompressed size of each one is in the index
+    bool ok = true;
+    for (size_t i = 0; i < numBlocks && ok; ++i) {
+        const BlockEntry &e = reader.block(i);
+        if (i + 1 < numBlocks) prefetchRegion(reader.blockData(i + 1), reader.block(i + 1).cmpSize);
+        if (!verifyBlock(e, reader.blockData(i))) {
+            std::cerr << "Corrupted block " << i + 1 << " of file: " << fname << std::endl;
+            ok = false;
+            break;
+        }
+        size_t decompressedSize = e.rawSize;
+        TraceSpan span(TR_DECOMPRESS);
+        if (codec.decode(dst + reader.rawOffset(i), &decompressedSize, reader.blockData(i), e.cmpSize, e.flags) != Z_OK ||
+            decompressedSize != e.rawSize) {
+            ok = false;
+            break;
+        }
+        span.bytes(e.cmpSize, decompressedSize);
     }
-
-    for (size_t i = 0; i < numBlocks; ++i) {
-        delete[] blockData[i];
-        delete[] decompressedBlocks[i];
+    TraceSpan span(TR_WRITE);
+    span.bytes(0, reader.rawSize());
+    if (!unmapOutputFile(fd, dst, reader.rawSize())) {
+        std::cerr << "Failed to write output file: " << outfile << std::endl;
+        ok = false;
     }
-
-    outFile.close();
-    return true;
+    if (ok && REMOVE_ORIGIN) unlink(fname.c_str());
+    return ok;
 }
 
 
@@ -232,6 +146,7 @@ int main(int argc, char *argv[]) {
 
 
 	ffTime(START_TIME);
+	traceThread("main");
 	
 	//fileDataVec is a vector of FileData with the information of the requested files
 	std::vector<FileData> fileDataVec;
@@ -247,54 +162,43 @@ int main(int argc, char *argv[]) {
 					<< std::endl;
 		}
 	}
-    for (auto& fileData : fileDataVec) {
-        //implementation in utils.hpp
+    // -t 0: the block size depends on the files found
+    if (comp && AUTO_BLOCKSIZE) BIGFILE_LOW_THRESHOLD = autoBlockSize(fileDataVec, 1, QUITE_MODE>=1);
+    // -B n: the levels are only measured on a sample, nothing is written
+    if (SWEEP_SAMPLE) {
+        if (!comp) {
+            std::fprintf(stderr, "Error: -B needs files to compress\n");
+            return -1;
+        }
+        return levelSweep(fileDataVec, SWEEP_SAMPLE, BIGFILE_LOW_THRESHOLD, STRATEGY) ? 0 : -1;
+    }
+    // the block buffers and the codec state are recycled from one file to the next one
+    BufferPool pool(compressBound(BIGFILE_LOW_THRESHOLD));
+    Codec codec(LEVEL, STRATEGY, RESTART_INTERVAL);
+    AsyncWriter out;
+    for (size_t k = 0; k < fileDataVec.size(); ++k) {
+        auto& fileData = fileDataVec[k];
+        // the beginning of the next file is read while this one is processed
+        if (k + 1 < fileDataVec.size())
+            prefetchRegion(fileDataVec[k + 1].ptr, std::min(fileDataVec[k + 1].size, BIGFILE_LOW_THRESHOLD));
         if (comp){
-            if (!doWorkCompress(fileData.ptr, fileData.size, fileData.filename)){
+            if (!doWorkCompress(fileData.ptr, fileData.size, fileData.filename, pool, codec, out)){
                 error("doWorkCompress\n");
             }
         }
 		else{
-            if (!doWorkDecompress(fileData.ptr, fileData.size, fileData.filename)){
+            if (!doWorkDecompress(fileData.ptr, fileData.size, fileData.filename, codec)){
                 error("doWorkDecompress\n");
             }
         }
     }
+    // the time includes the writes still pending
+    if (!out.drain()) error("writing the output files\n");
 
-
-
-/*
-  const bool compress = ((pMode[0] == 'c') || (pMode[0] == 'C'));
-  REMOVE_ORIGIN = ((pMode[0] == 'C') || (pMode[0] == 'D'));
-  
-  bool success = true;
-  while(argc>1) {
-      struct stat statbuf; // to store file information
-      if (stat(argv[argc], &statbuf)==-1) { // get file information
-		  perror("stat");
-		  fprintf(stderr, "Error: stat %s\n", argv[argc]);
-		  --argc;
-		  continue;
-      }
-      bool dir=false;
-      if (S_ISDIR(statbuf.st_mode))  {
-		  success &= walkDir(argv[argc], compress);
-      } else {
-		  success &= doWork(argv[argc], statbuf.st_size, compress);
-      }
-      --argc;
-  }
-  ffTime(STOP_TIME);
-  if (!success) {
-      printf("Exiting with (some) Error(s)\n");
-      return -1;
-  }
-
-    printf("Time: %f (ms)\n", ffTime(GET_TIME));
-  
-*/
     ffTime(STOP_TIME);
     printf("Time: %f (ms)\n", ffTime(GET_TIME));
+    if (DEDUP && comp) dedupStats.print();
+    traceReport();
 
   return 0;
 }
@@ -0,0 +1,295 @@
+/*
+ * MPI-IO mode of the MPI drivers (-I 1), for inputs on a filesystem shared
+ * by all the ranks.
+ *
+ * Rank 0 only walks the directory and broadcasts the list of files, it does
+ * not read them. The files are then processed one at a time by all the ranks
+ * together, in rounds: in each round every rank takes MPIIO_BLOCKS_PER_RANK
+ * consecutive blocks, reads them with MPI_File_read_at_all, (de)compresses
+ * them and writes the result with MPI_File_write_at_all.
+ *
+ *  -   compression: the offset of the blocks of a rank in the .zip is the
+ *      exclusive scan (MPI_Exscan) of the compressed sizes of the ranks
+ *      before it; the index entries are gathered by rank 0 (MPI_Gatherv, a
+ *      block with restart points has an entry per piece), which writes the
+ *      header and, at the end, the index and the footer (see container.hpp).
+ *  -   decompression: rank 0 reads the index and broadcasts it, the offset of
+ *      every block in the output is known in advance.
+ *
+ * No block goes through rank 0, that is no longer the I/O and memory
+ * bottleneck of the run.
+ */
+
+#if !defined _MPIIO_HPP
+#define _MPIIO_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include <mpi.h>
+
+#include <utilitympi.hpp>
+
+// blocks taken by each rank in every round
+static const size_t MPIIO_BLOCKS_PER_RANK = 4;
+
+// the list of files found by rank 0 (relative to the directory walked)
+struct MPIIOFile {
+    std::string name;
+    size_t      size;
+};
+
+static inline void mpiioCheck(int err, const char *what, const std::string &fname) {
+    if (err != MPI_SUCCESS) {
+        char msg[MPI_MAX_ERROR_STRING];
+        int len = 0;
+        MPI_Error_string(err, msg, &len);
+        std::cerr << what << " " << fname << ": " << msg << std::endl;
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+}
+
+// opens the output collectively, truncating it
+static inline MPI_File mpiioCreate(const std::string &fname) {
+    MPI_File fh;
+    mpiioCheck(MPI_File_open(MPI_COMM_WORLD, fname.c_str(), MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                             MPI_INFO_NULL, &fh), "Failed to open output file", fname);
+    mpiioCheck(MPI_File_set_size(fh, 0), "Failed to truncate output file", fname);
+    return fh;
+}
+
+// rank 0 walks dname and sends the list of files to all the ranks;
+// the other ranks move in dname (if it is a directory) as the walk does
+static inline std::vector<MPIIOFile> mpiioListFiles(const char dname[], int myrank) {
+    std::vector<MPIIOFile> files;
+    std::vector<uint64_t>  sizes;
+    std::string            names;   // all the names, '\0' terminated
+    uint64_t n = 0, namesLen = 0;
+
+    if (!myrank) {
+        std::vector<FileData> fileDataVec;
+        if (!walkDirAndGetFiles(dname, fileDataVec, comp, true)) {
+            std::cerr << "Error processing files in directory." << std::endl;
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+        n = fileDataVec.size();
+        for (auto &f : fileDataVec) {
+            sizes.push_back(f.size);
+            names.append(f.filename);
+            names.push_back('\0');
+        }
+        namesLen = names.size();
+    } else {
+        struct stat statbuf;
+        if (stat(dname, &statbuf) == 0 && S_ISDIR(statbuf.st_mode) && chdir(dname) == -1) {
+            perror("chdir");
+            std::fprintf(stderr, "Error: chdir %s\n", dname);
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+    }
+    MPI_Bcast(&n, 1, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&namesLen, 1, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+    sizes.resize(n);
+    names.resize(namesLen);
+    MPI_Bcast(sizes.data(), n, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+    MPI_Bcast(names.data(), namesLen, MPI_CHAR, 0, MPI_COMM_WORLD);
+
+    const char *p = names.data();
+    for (uint64_t i = 0; i < n; ++i) {
+        // "./": some MPI-IO implementations fail to open a relative name without a '/'
+        files.push_back({std::string("./") + p, sizes[i]});
+        p += std::strlen(p) + 1;
+    }
+    return files;
+}
+
+static inline void mpiioCompressFile(const MPIIOFile &file, int myrank, int size, BufferPool &pool, Codec &codec) {
+    const size_t B       = BIGFILE_LOW_THRESHOLD;
+    // an empty file still has one (empty) block
+    const size_t nblocks = file.size ? (file.size + B - 1) / B : 1;
+    const size_t K       = MPIIO_BLOCKS_PER_RANK;
+    const size_t round   = K * size;
+    const std::string outfile = file.name + SUFFIX;
+
+    MPI_File in, out;
+    mpiioCheck(MPI_File_open(MPI_COMM_WORLD, file.name.c_str(), MPI_MODE_RDONLY, MPI_INFO_NULL, &in),
+               "Failed to open input file", file.name);
+    out = mpiioCreate(outfile);
+
+    std::vector<BlockEntry> entries;                // mine, in this round (a block with restart points has more)
+    std::vector<BlockEntry> index;                  // rank 0 only
+    std::vector<int> counts(myrank ? 0 : size), displs(myrank ? 0 : size);
+    std::vector<unsigned char*> bufs(K, nullptr);
+    std::vector<uint64_t> at(K, 0), len(K, 0);      // where my blocks go, from the first one, and their size
+    uint64_t pos = sizeof(FileHeader);              // where the blocks of this round start
+
+    for (size_t first = 0; first < nblocks; first += round) {
+        // read and compress my blocks
+        uint64_t mine = 0;
+        entries.clear();
+        for (size_t j = 0; j < K; ++j) {
+            const size_t blk = first + myrank * K + j;
+            const size_t raw = (blk < nblocks) ? std::min(B, file.size - blk * B) : 0;
+            unsigned char *ptrIn = pool.get(raw);
+            {
+                TraceSpan span(TR_READ);
+                span.bytes(raw, 0);
+                mpiioCheck(MPI_File_read_at_all(in, blk < nblocks ? blk * B : 0, ptrIn, raw, MPI_UNSIGNED_CHAR,
+                                                MPI_STATUS_IGNORE), "Failed to read file", file.name);
+            }
+            at[j] = mine;
+            len[j] = 0;
+            if (blk < nblocks) {
+                size_t cmp_len = compressBound(raw);
+                bufs[j] = pool.get(cmp_len);
+                int err;
+                uint32_t flags;
+                TraceSpan span(TR_COMPRESS);
+                if ((err = codec.encode(bufs[j], &cmp_len, ptrIn, raw, flags)) != Z_OK) {
+                    std::cerr << "process" << myrank << "Failed to compress block, error: " << err << std::endl;
+                    MPI_Abort(MPI_COMM_WORLD, -1);
+                }
+                span.bytes(raw, cmp_len);
+                len[j] = blockEntries(bufs[j], cmp_len, raw, blockChecksum(bufs[j], cmp_len), flags, mine, entries);
+                mine += len[j];
+            }
+            pool.put(ptrIn);
+        }
+        // my blocks go after the ones of the ranks before me
+        uint64_t before = 0, total = 0;
+        MPI_Exscan(&mine, &before, 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+        if (!myrank) before = 0;   // Exscan leaves it undefined on rank 0
+        MPI_Allreduce(&mine, &total, 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+        for (auto &e : entries) e.offset += pos + before;
+        for (size_t j = 0; j < K; ++j) {
+            TraceSpan span(TR_WRITE);
+            span.bytes(0, len[j]);
+            mpiioCheck(MPI_File_write_at_all(out, pos + before + at[j], bufs[j], len[j],
+                                             MPI_UNSIGNED_CHAR, MPI_STATUS_IGNORE), "Failed to write output file", outfile);
+            if (bufs[j]) pool.put(bufs[j]);
+            bufs[j] = nullptr;
+        }
+        // the ranks are in block order, so the entries gathered are in block order too
+        const int bytes = entries.size() * sizeof(BlockEntry);
+        MPI_Gather(&bytes, 1, MPI_INT, counts.data(), 1, MPI_INT, 0, MPI_COMM_WORLD);
+        size_t n = 0;
+        for (int r = 0; r < (int)counts.size(); ++r) { displs[r] = n; n += counts[r]; }
+        const size_t have = index.size();
+        if (!myrank) index.resize(have + n / sizeof(BlockEntry));
+        MPI_Gatherv(entries.data(), bytes, MPI_BYTE, myrank ? nullptr : index.data() + have,
+                    counts.data(), displs.data(), MPI_BYTE, 0, MPI_COMM_WORLD);
+        pos += total;
+    }
+
+    // header, index and footer
+    if (!myrank) {
+        const FileHeader hdr    = containerHeader(B);
+        const Footer     footer = containerFooter(index.data(), index.size(), pos);
+        mpiioCheck(MPI_File_write_at(out, 0, &hdr, sizeof(hdr), MPI_BYTE, MPI_STATUS_IGNORE),
+                   "Failed to write output file", outfile);
+        mpiioCheck(MPI_File_write_at(out, pos, index.data(), index.size() * sizeof(BlockEntry), MPI_BYTE, MPI_STATUS_IGNORE),
+                   "Failed to write output file", outfile);
+        mpiioCheck(MPI_File_write_at(out, pos + index.size() * sizeof(BlockEntry), &footer, sizeof(footer), MPI_BYTE, MPI_STATUS_IGNORE),
+                   "Failed to write output file", outfile);
+    }
+    MPI_File_close(&in);
+    MPI_File_close(&out);
+    if (!myrank) {
+        if (VERBOSE) std::cout << "File " << file.name << " zipped successfully." << std::endl;
+        if (REMOVE_ORIGIN) unlink(file.name.c_str());
+    }
+}
+
+static inline void mpiioDecompressFile(const MPIIOFile &file, int myrank, int size, BufferPool &pool, Codec &codec) {
+    const std::string outfile = file.name.substr(0, file.name.size() - 4);
+
+    // rank 0 reads the index, all the ranks get a copy of it
+    uint64_t nblocks = 0;
+    std::vector<BlockEntry> index;
+    if (!myrank) {
+        ContainerReader reader;
+        int fd = open(file.name.c_str(), O_RDONLY);
+        if (fd < 0 || !reader.open(fd, file.size)) {
+            std::cerr << "Error with the header during decompression (" << (fd < 0 ? strerror(errno) : reader.error())
+                      << "): " << file.name << std::endl;
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+        close(fd);
+        nblocks = reader.nblocks();
+        for (size_t i = 0; i < nblocks; ++i) index.push_back(reader.block(i));
+    }
+    MPI_Bcast(&nblocks, 1, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+    index.resize(nblocks);
+    MPI_Bcast(index.data(), nblocks * sizeof(BlockEntry), MPI_BYTE, 0, MPI_COMM_WORLD);
+
+    // where each block goes in the output
+    std::vector<uint64_t> rawOffset(nblocks);
+    for (size_t i = 1; i < nblocks; ++i) rawOffset[i] = rawOffset[i-1] + index[i-1].rawSize;
+
+    const size_t K     = MPIIO_BLOCKS_PER_RANK;
+    const size_t round = K * size;
+    MPI_File in, out;
+    mpiioCheck(MPI_File_open(MPI_COMM_WORLD, file.name.c_str(), MPI_MODE_RDONLY, MPI_INFO_NULL, &in),
+               "Failed to open input file", file.name);
+    out = mpiioCreate(outfile);
+
+    for (size_t first = 0; first < nblocks; first += round) {
+        for (size_t j = 0; j < K; ++j) {
+            const size_t blk = first + myrank * K + j;
+            const BlockEntry e = (blk < nblocks) ? index[blk] : BlockEntry{0, 0, 0, 0, 0};
+            unsigned char *ptrIn = pool.get(e.cmpSize);
+            {
+                TraceSpan span(TR_READ);
+                span.bytes(e.cmpSize, 0);
+                mpiioCheck(MPI_File_read_at_all(in, e.offset, ptrIn, e.cmpSize, MPI_UNSIGNED_CHAR, MPI_STATUS_IGNORE),
+                           "Failed to read file", file.name);
+            }
+            size_t cmp_len = e.rawSize;
+            unsigned char *ptrOut = pool.get(cmp_len);
+            if (blk < nblocks) {
+                if (!verifyBlock(e, ptrIn)) {
+                    std::cerr << "process" << myrank << ": corrupted block " << blk + 1 << " of file " << file.name << std::endl;
+                    MPI_Abort(MPI_COMM_WORLD, -1);
+                }
+                int err;
+                TraceSpan span(TR_DECOMPRESS);
+                if ((err = codec.decode(ptrOut, &cmp_len, ptrIn, e.cmpSize, e.flags)) != Z_OK || cmp_len != e.rawSize) {
+                    std::cerr << "process" << myrank << "Failed to decompress block, error: " << err << std::endl;
+                    MPI_Abort(MPI_COMM_WORLD, -1);
+                }
+                span.bytes(e.cmpSize, cmp_len);
+            }
+            pool.put(ptrIn);
+            TraceSpan span(TR_WRITE);
+            span.bytes(0, cmp_len);
+            mpiioCheck(MPI_File_write_at_all(out, blk < nblocks ? rawOffset[blk] : 0, ptrOut, cmp_len,
+                                             MPI_UNSIGNED_CHAR, MPI_STATUS_IGNORE), "Failed to write output file", outfile);
+            pool.put(ptrOut);
+        }
+    }
+    MPI_File_close(&in);
+    MPI_File_close(&out);
+    if (!myrank) {
+        if (VERBOSE) std::cout << "File " << file.name << " unzipped successfully." << std::endl;
+        if (REMOVE_ORIGIN) unlink(file.name.c_str());
+    }
+}
+
+// MPI-IO mode: all the ranks (also rank 0) compress/decompress the files found in dname
+static inline void mpiioRun(const char dname[], int myrank, int size, BufferPool &pool, Codec &codec) {
+    const std::vector<MPIIOFile> files = mpiioListFiles(dname, myrank);
+    // -t 0: all the ranks have the same list, they pick the same block size
+    if (comp && AUTO_BLOCKSIZE) {
+        BIGFILE_LOW_THRESHOLD = autoBlockSize(files, size, !myrank && QUITE_MODE>=1);
+        pool.reset(compressBound(BIGFILE_LOW_THRESHOLD));
+    }
+    for (const MPIIOFile &file : files) {
+        if (comp) mpiioCompressFile(file, myrank, size, pool, codec);
+        else      mpiioDecompressFile(file, myrank, size, pool, codec);
+    }
+}
+
+#endif // _MPIIO_HPP
@@ -0,0 +1,70 @@
+/*
+ * Output of a decompressed file written in place.
+ *
+ * The uncompressed size of the file and of each block is in the index of the
+ * archive, so the output can be created with its final size before any block
+ * is decompressed. It is then mapped writable and shared: every block is
+ * decompressed (or received, in the MPI versions) straight at its position,
+ * in any order and by any thread, without an intermediate buffer and without
+ * a write of its own. The kernel writes the pages back.
+ *
+ * The space is reserved up front with posix_fallocate, a full disk is reported
+ * when the file is created instead of with a SIGBUS while the mapping is being
+ * written. Filesystems that cannot reserve it get a plain ftruncate.
+ */
+
+#if !defined _OUTMAP_HPP
+#define _OUTMAP_HPP
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <string>
+
+// creates fname with size bytes and maps it, ptr is nullptr for an empty file
+static inline bool mapOutputFile(const std::string &fname, size_t size, int &fd, unsigned char *&ptr) {
+    ptr = nullptr;
+    fd = open(fname.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open");
+        std::fprintf(stderr, "Failed to open output file %s\n", fname.c_str());
+        return false;
+    }
+    if (size == 0) return true;
+    int err = posix_fallocate(fd, 0, size);
+    if ((err == EINVAL || err == EOPNOTSUPP) && ftruncate(fd, size) == 0) err = 0;
+    if (err) {
+        errno = err;
+        perror("posix_fallocate");
+        std::fprintf(stderr, "Failed to reserve %zu bytes for file %s\n", size, fname.c_str());
+        close(fd);
+        return false;
+    }
+    ptr = (unsigned char *) mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED) {
+        ptr = nullptr;
+        perror("mmap");
+        std::fprintf(stderr, "Failed to memory map output file %s\n", fname.c_str());
+        close(fd);
+        return false;
+    }
+    return true;
+}
+
+// unmaps and closes an output created by mapOutputFile
+static inline bool unmapOutputFile(int fd, unsigned char *ptr, size_t size) {
+    bool ok = true;
+    if (ptr && munmap(ptr, size) < 0) {
+        perror("munmap");
+        ok = false;
+    }
+    if (close(fd) < 0) {
+        perror("close");
+        ok = false;
+    }
+    return ok;
+}
+
+#endif // _OUTMAP_HPP
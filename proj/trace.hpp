@@ -0,0 +1,280 @@
+/*
+ * Tracing of the pipelines (-T file).
+ *
+ * Every thread that records something gets its own ring buffer of timestamped
+ * events, written only by that thread: recording an event is a clock read and
+ * a store, no lock and no shared cache line. The events are:
+ *
+ *  -   spans (TraceSpan): a stage of the pipeline (scan, map, dispatch,
+ *      compress, ..., see TRACE_STAGE_NAMES) from start to end, with the bytes
+ *      that went in and out (the ratio of each block compressed);
+ *  -   levels (traceLevel): the occupancy of a queue (files found and not yet
+ *      taken, blocks sent to the R-Workers and not yet taken, credits in use,
+ *      writes pending), recorded every time it changes.
+ *
+ * Besides the ring, which keeps the last TRACE_RING events of the thread, each
+ * buffer adds up the time and the bytes of every stage, so the summary is exact
+ * even when the ring has wrapped. The time of a thread is split into busy (in a
+ * span), blocked (in a "wait" span: credits, a full queue) and idle (the rest of
+ * its life, e.g. a FastFlow node waiting for its next task).
+ *
+ * At the end traceReport writes the events as Chrome trace JSON (chrome://tracing,
+ * https://ui.perfetto.dev) and prints the summary tables. When -T is not given
+ * TRACE is false: a span is a test of it, nothing is allocated or recorded.
+ */
+
+#if !defined _TRACE_HPP
+#define _TRACE_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+static bool        TRACE=false;   // -T
+static std::string TRACE_FILE;    // where the Chrome trace goes
+
+enum TraceStage : uint8_t {
+    TR_SCAN, TR_MAP, TR_READ, TR_DISPATCH, TR_COMPRESS, TR_DECOMPRESS,
+    TR_WRITE, TR_MERGE, TR_SEND, TR_RECV, TR_WAIT, TR_STAGES
+};
+static const char *TRACE_STAGE_NAMES[TR_STAGES] = {
+    "scan", "map", "read", "dispatch", "compress", "decompress",
+    "write", "merge", "send", "recv", "wait"
+};
+enum TraceLevel : uint8_t {
+    TL_FILES, TL_BLOCKS, TL_CREDITS, TL_WRITES, TL_LEVELS
+};
+static const char *TRACE_LEVEL_NAMES[TL_LEVELS] = {
+    "files queued", "blocks queued", "credits in use (bytes)", "writes pending"
+};
+
+static const size_t TRACE_RING = 1 << 16;   // events kept for each thread
+
+struct TraceEvent {
+    uint64_t ts;       // ns from the start of the trace
+    uint64_t dur;      // span: ns, level: the new value
+    uint64_t in, out;  // span: bytes
+    uint8_t  level;    // 0 span, 1 level
+    uint8_t  id;       // TraceStage or TraceLevel
+};
+
+struct TraceStats {
+    uint64_t count=0, ns=0, in=0, out=0;
+};
+
+struct TraceBuffer {
+    std::string             name;
+    size_t                  tid;
+    std::vector<TraceEvent> ring;
+    uint64_t                next=0;      // events recorded so far
+    uint64_t                born=0, last=0;
+    uint64_t                busy=0, blocked=0, nestedWait=0;
+    int                     depth=0;     // spans open
+    TraceStats              stages[TR_STAGES];
+};
+
+static std::chrono::steady_clock::time_point traceOrigin = std::chrono::steady_clock::now();
+static std::mutex                               traceMtx;
+static std::vector<std::unique_ptr<TraceBuffer>> traceBuffers;
+static std::atomic<int64_t>                     traceLevels[TL_LEVELS];
+
+// -T file: the walker moves the process in the directory walked, a relative
+// path is taken from the directory the program is started in
+static inline void traceEnable(const char *path) {
+    TRACE = true;
+    TRACE_FILE = path;
+    char cwd[4096];
+    if (path[0] != '/' && getcwd(cwd, sizeof(cwd))) TRACE_FILE = std::string(cwd) + "/" + path;
+}
+
+static inline uint64_t traceNow() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - traceOrigin).count();
+}
+
+// the buffer of the calling thread, created at its first event
+static inline TraceBuffer *traceBuffer() {
+    thread_local TraceBuffer *mine = nullptr;
+    if (mine) return mine;
+    auto b = std::make_unique<TraceBuffer>();
+    b->ring.resize(TRACE_RING);
+    b->born = b->last = traceNow();
+    std::lock_guard<std::mutex> lock(traceMtx);
+    b->tid  = traceBuffers.size();
+    b->name = "thread " + std::to_string(b->tid);
+    mine = b.get();
+    traceBuffers.push_back(std::move(b));
+    return mine;
+}
+
+// names the calling thread in the trace (id >= 0 is appended)
+static inline void traceThread(const std::string &name, long id=-1) {
+    if (!TRACE) return;
+    traceBuffer()->name = (id >= 0) ? name + " " + std::to_string(id) : name;
+}
+
+static inline void tracePush(TraceBuffer *b, const TraceEvent &e) {
+    b->ring[b->next++ % TRACE_RING] = e;
+    b->last = e.ts + (e.level ? 0 : e.dur);
+}
+
+// a queue of the pipeline grows (or shrinks) by delta
+static inline void traceLevel(TraceLevel l, int64_t delta) {
+    if (!TRACE) return;
+    const int64_t v = traceLevels[l].fetch_add(delta, std::memory_order_relaxed) + delta;
+    tracePush(traceBuffer(), TraceEvent{traceNow(), (uint64_t)std::max<int64_t>(v, 0), 0, 0, 1, l});
+}
+
+// a stage from construction to destruction, bytes() sets what it read and produced
+class TraceSpan {
+public:
+    explicit TraceSpan(TraceStage s) : stage(s) {
+        if (!TRACE) return;
+        b = traceBuffer();
+        ++b->depth;
+        t0 = traceNow();
+    }
+    ~TraceSpan() {
+        if (!b) return;
+        const uint64_t dur = traceNow() - t0;
+        tracePush(b, TraceEvent{t0, dur, in, out, 0, stage});
+        TraceStats &s = b->stages[stage];
+        ++s.count; s.ns += dur; s.in += in; s.out += out;
+        // the time of the thread is counted once, from the outermost span
+        if (--b->depth == 0) {
+            if (stage == TR_WAIT) b->blocked += dur;
+            else                  b->busy += dur;
+        } else if (stage == TR_WAIT) {
+            b->blocked += dur;
+            b->nestedWait += dur;
+        }
+    }
+    void bytes(uint64_t i, uint64_t o) { in = i; out = o; }
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+private:
+    TraceStage   stage;
+    TraceBuffer *b=nullptr;
+    uint64_t     t0=0, in=0, out=0;
+};
+
+// the totals of every stage, over all the threads of the process
+static inline void traceTotals(TraceStats (&tot)[TR_STAGES]) {
+    std::lock_guard<std::mutex> lock(traceMtx);
+    for (auto &b : traceBuffers)
+        for (int s = 0; s < TR_STAGES; ++s) {
+            tot[s].count += b->stages[s].count;
+            tot[s].ns    += b->stages[s].ns;
+            tot[s].in    += b->stages[s].in;
+            tot[s].out   += b->stages[s].out;
+        }
+}
+
+// the compression ratio of the blocks of a span, 0 if it is not a codec stage
+static inline double traceRatio(int stage, uint64_t in, uint64_t out) {
+    if (!in || !out) return 0.0;
+    if (stage == TR_COMPRESS)   return (double)in / out;
+    if (stage == TR_DECOMPRESS) return (double)out / in;
+    return 0.0;
+}
+
+static inline void tracePrintStages(const TraceStats (&tot)[TR_STAGES]) {
+    std::printf("%-11s %9s %11s %10s %10s %10s %8s\n", "stage", "events", "total ms", "mean us", "in MB", "out MB", "ratio");
+    const double mb = 1024.0 * 1024.0;
+    for (int s = 0; s < TR_STAGES; ++s) {
+        const TraceStats &t = tot[s];
+        if (!t.count) continue;
+        std::printf("%-11s %9lu %11.1f %10.1f %10.1f %10.1f", TRACE_STAGE_NAMES[s], (unsigned long)t.count,
+                    t.ns / 1e6, t.ns / 1e3 / t.count, t.in / mb, t.out / mb);
+        const double ratio = traceRatio(s, t.in, t.out);
+        if (ratio > 0) std::printf(" %8.3f\n", ratio);
+        else           std::printf(" %8s\n", "-");
+    }
+}
+
+// busy, blocked and idle ns of a thread, from its first to its last event
+static inline void traceTimes(const TraceBuffer &b, uint64_t &busy, uint64_t &blocked, uint64_t &idle) {
+    const uint64_t life = b.last - b.born;
+    busy    = b.busy - std::min(b.busy, b.nestedWait);
+    blocked = b.blocked;
+    idle    = life - std::min(life, busy + blocked);
+}
+static inline void tracePrintTimesHeader(const char *who) {
+    std::printf("%-16s %11s %11s %11s %8s\n", who, "busy ms", "blocked ms", "idle ms", "busy %");
+}
+static inline void tracePrintTimes(const std::string &name, uint64_t busy, uint64_t blocked, uint64_t idle) {
+    const uint64_t life = busy + blocked + idle;
+    std::printf("%-16s %11.1f %11.1f %11.1f %8.1f\n", name.c_str(), busy / 1e6, blocked / 1e6, idle / 1e6,
+                life ? 100.0 * busy / life : 0.0);
+}
+
+// busy, blocked and idle time of each thread of the process
+static inline void tracePrintThreads() {
+    std::lock_guard<std::mutex> lock(traceMtx);
+    tracePrintTimesHeader("thread");
+    for (auto &b : traceBuffers) {
+        uint64_t busy, blocked, idle;
+        traceTimes(*b, busy, blocked, idle);
+        tracePrintTimes(b->name, busy, blocked, idle);
+    }
+}
+
+// the events of all the threads as Chrome trace JSON, pid tells the processes apart
+static inline bool traceWrite(const std::string &path, int pid) {
+    FILE *f = std::fopen(path.c_str(), "w");
+    if (!f) {
+        perror("fopen");
+        std::fprintf(stderr, "Failed to write the trace %s\n", path.c_str());
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(traceMtx);
+    std::fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    std::fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"rank %d\"}}", pid, pid);
+    uint64_t dropped = 0;
+    for (auto &b : traceBuffers) {
+        std::fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%zu,\"args\":{\"name\":\"%s\"}}",
+                     pid, b->tid, b->name.c_str());
+        const uint64_t first = (b->next > TRACE_RING) ? b->next - TRACE_RING : 0;
+        dropped += first;
+        for (uint64_t i = first; i < b->next; ++i) {
+            const TraceEvent &e = b->ring[i % TRACE_RING];
+            if (e.level) {
+                std::fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":%d,\"args\":{\"value\":%lu}}",
+                             TRACE_LEVEL_NAMES[e.id], e.ts / 1e3, pid, (unsigned long)e.dur);
+                continue;
+            }
+            std::fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%zu",
+                         TRACE_STAGE_NAMES[e.id], e.ts / 1e3, e.dur / 1e3, pid, b->tid);
+            if (e.in || e.out) {
+                std::fprintf(f, ",\"args\":{\"in\":%lu,\"out\":%lu", (unsigned long)e.in, (unsigned long)e.out);
+                const double ratio = traceRatio(e.id, e.in, e.out);
+                if (ratio > 0) std::fprintf(f, ",\"ratio\":%.3f", ratio);
+                std::fprintf(f, "}");
+            }
+            std::fprintf(f, "}");
+        }
+    }
+    std::fprintf(f, "\n]}\n");
+    const bool ok = (std::fclose(f) == 0);
+    if (dropped)
+        std::fprintf(stderr, "trace: the oldest %lu events did not fit in the rings\n", (unsigned long)dropped);
+    return ok;
+}
+
+// -T: writes the trace and prints the summary of the process
+static inline void traceReport() {
+    if (!TRACE) return;
+    traceWrite(TRACE_FILE, 0);
+    TraceStats tot[TR_STAGES];
+    traceTotals(tot);
+    tracePrintStages(tot);
+    tracePrintThreads();
+}
+
+#endif // _TRACE_HPP
@@ -0,0 +1,290 @@
+/*
+ * Asynchronous file I/O with io_uring (mainffa2a -U).
+ *
+ * The workers of the FastFlow version write the blocks with pwrite: on fast
+ * disks a worker stalls on the write instead of compressing the next block.
+ * An IoRing queues reads and writes to the kernel and returns immediately, a
+ * completion thread (the reaper) runs a callback for each of them once it is
+ * done, so a few threads keep many I/Os in flight while the workers compress.
+ *
+ *  -   The ring is used through the raw system calls (linux/io_uring.h), no
+ *      liburing is needed. If the kernel has no io_uring (or it is disabled)
+ *      init() fails and the callers keep the blocking calls.
+ *  -   submit() takes several operations and hands them to the kernel with a
+ *      single io_uring_enter (batched submission).
+ *  -   Short reads/writes are resubmitted for the rest by the reaper, the
+ *      callback gets the total n. of bytes (or -errno). A read ends early only
+ *      at the end of the file.
+ *  -   Registered buffers: addBuffers() registers a memory area (e.g. a slab
+ *      of a BufferPool, see BufferPool::setSlabHook) in a sparse table, the
+ *      operations on buffers inside it use READ_FIXED/WRITE_FIXED and the
+ *      kernel does not pin their pages at every I/O. If the table cannot be
+ *      registered (old kernels, RLIMIT_MEMLOCK) the plain operations are used.
+ *  -   Callbacks run on the reaper thread, they must not block.
+ *  -   submit() can be called by any thread, it waits if IORING_MAX_INFLIGHT
+ *      operations are already in flight.
+ */
+
+#if !defined _URING_HPP
+#define _URING_HPP
+
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define IO_URING_AVAILABLE 1
+#endif
+
+static const unsigned IORING_ENTRIES      = 256;   // submission queue
+static const size_t   IORING_MAX_INFLIGHT = 256;   // the completion queue is twice as big
+static const unsigned IORING_FIXED_SLOTS  = 256;   // registered buffers table
+
+// an operation for IoRing::submit, done is called with the bytes read or
+// written (or -errno)
+struct IoOp {
+    bool           write;
+    int            fd;
+    unsigned char *buf;
+    size_t         len;
+    uint64_t       offset;
+    std::function<void(ssize_t)> done;
+};
+
+#if defined(IO_URING_AVAILABLE)
+
+class IoRing {
+public:
+    IoRing() = default;
+    ~IoRing() {
+        if (ringFd < 0) return;
+        // waits for the operations in flight, then a NOP stops the reaper
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait(lock, [&] { return inflight == 0; });
+            io_uring_sqe *sqe = nextSqe();
+            sqe->opcode    = IORING_OP_NOP;
+            sqe->user_data = 0;
+            enter(1);
+        }
+        reaper.join();
+        munmap(sqes, sqesSize);
+        munmap(sqRing, sqRingSize);
+        if (cqRing != sqRing) munmap(cqRing, cqRingSize);
+        close(ringFd);
+    }
+    IoRing(const IoRing&) = delete;
+    IoRing& operator=(const IoRing&) = delete;
+
+    // false if io_uring cannot be used
+    bool init() {
+        io_uring_params p;
+        std::memset(&p, 0, sizeof(p));
+        p.flags      = IORING_SETUP_CQSIZE;
+        p.cq_entries = 2 * IORING_ENTRIES;
+        ringFd = (int)syscall(__NR_io_uring_setup, IORING_ENTRIES, &p);
+        if (ringFd < 0) return false;
+
+        sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        cqRing = (p.features & IORING_FEAT_SINGLE_MMAP) ? sqRing :
+                 mmap(nullptr, cqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe *)mmap(nullptr, sqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == (io_uring_sqe *)MAP_FAILED) {
+            perror("io_uring mmap");
+            close(ringFd);
+            ringFd = -1;
+            return false;
+        }
+        unsigned char *sq = (unsigned char *)sqRing, *cq = (unsigned char *)cqRing;
+        sqTail  = (std::atomic<unsigned> *)(sq + p.sq_off.tail);
+        sqMask  = *(unsigned *)(sq + p.sq_off.ring_mask);
+        sqArray = (unsigned *)(sq + p.sq_off.array);
+        cqHead  = (std::atomic<unsigned> *)(cq + p.cq_off.head);
+        cqTail  = (std::atomic<unsigned> *)(cq + p.cq_off.tail);
+        cqMask  = *(unsigned *)(cq + p.cq_off.ring_mask);
+        cqes    = (io_uring_cqe *)(cq + p.cq_off.cqes);
+
+        // sparse table of registered buffers, filled by addBuffers
+        io_uring_rsrc_register reg;
+        std::memset(&reg, 0, sizeof(reg));
+        reg.nr    = IORING_FIXED_SLOTS;
+        reg.flags = IORING_RSRC_REGISTER_SPARSE;
+        fixed = (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS2, &reg, sizeof(reg)) == 0);
+
+        reaper = std::thread([this] { reap(); });
+        return true;
+    }
+
+    // registers [base, base+size) as a fixed buffer, false if it is not possible
+    bool addBuffers(unsigned char *base, size_t size) {
+        std::lock_guard<std::mutex> lock(bufMtx);
+        if (!fixed || bufs.size() >= IORING_FIXED_SLOTS) return false;
+        iovec iov{base, size};
+        io_uring_rsrc_update2 up;
+        std::memset(&up, 0, sizeof(up));
+        up.offset = (unsigned)bufs.size();
+        up.data   = (uint64_t)(uintptr_t)&iov;
+        up.nr     = 1;
+        if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS_UPDATE, &up, sizeof(up)) != 1) return false;
+        const unsigned slot = (unsigned)bufs.size();
+        bufs.emplace(base, std::make_pair(size, slot));
+        return true;
+    }
+
+    // queues ops (at most IORING_ENTRIES) with a single system call
+    void submit(std::vector<IoOp> &ops) {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [&] { return inflight + ops.size() <= IORING_MAX_INFLIGHT; });
+        for (IoOp &op : ops) prepare(new Req{std::move(op), 0});
+        inflight += ops.size();
+        enter((unsigned)ops.size());
+        ops.clear();
+    }
+    // waits for all the operations in flight
+    void drain() {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [&] { return inflight == 0; });
+    }
+
+private:
+    struct Req {
+        IoOp   op;
+        size_t done;                 // bytes already read/written
+    };
+
+    // the next free entry of the submission queue (mtx held)
+    io_uring_sqe *nextSqe() {
+        const unsigned tail = sqTail->load(std::memory_order_relaxed) + pendingSqes;
+        io_uring_sqe *sqe = &sqes[tail & sqMask];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqArray[tail & sqMask] = tail & sqMask;
+        ++pendingSqes;
+        return sqe;
+    }
+    // the rest of r (mtx held)
+    void prepare(Req *r) {
+        io_uring_sqe *sqe = nextSqe();
+        unsigned char *ptr = r->op.buf + r->done;
+        const int slot = fixedSlot(ptr, r->op.len - r->done);
+        if (slot >= 0) {
+            sqe->opcode    = r->op.write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+            sqe->buf_index = (uint16_t)slot;
+        } else {
+            sqe->opcode    = r->op.write ? IORING_OP_WRITE : IORING_OP_READ;
+        }
+        sqe->fd        = r->op.fd;
+        sqe->addr      = (uint64_t)(uintptr_t)ptr;
+        sqe->len       = (unsigned)std::min<size_t>(r->op.len - r->done, 1u << 30);
+        sqe->off       = r->op.offset + r->done;
+        sqe->user_data = (uint64_t)(uintptr_t)r;
+    }
+    // slot of the registered buffer containing [ptr, ptr+len), -1 if none
+    int fixedSlot(unsigned char *ptr, size_t len) {
+        std::lock_guard<std::mutex> lock(bufMtx);
+        auto it = bufs.upper_bound(ptr);
+        if (it == bufs.begin()) return -1;
+        --it;
+        return (ptr + len <= it->first + it->second.first) ? (int)it->second.second : -1;
+    }
+    // makes the prepared entries visible and submits them (mtx held)
+    void enter(unsigned n) {
+        sqTail->store(sqTail->load(std::memory_order_relaxed) + pendingSqes, std::memory_order_release);
+        pendingSqes = 0;
+        while (n) {
+            int r = (int)syscall(__NR_io_uring_enter, ringFd, n, 0, 0, nullptr, 0);
+            if (r < 0) {
+                if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+                perror("io_uring_enter");
+                std::abort();
+            }
+            n -= r;
+        }
+    }
+
+    void reap() {
+        for (;;) {
+            int r = (int)syscall(__NR_io_uring_enter, ringFd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (r < 0 && errno != EINTR) {
+                perror("io_uring_enter");
+                std::abort();
+            }
+            unsigned head = cqHead->load(std::memory_order_relaxed);
+            const unsigned tail = cqTail->load(std::memory_order_acquire);
+            bool stop = false;
+            for (; head != tail; ++head) {
+                const io_uring_cqe cqe = cqes[head & cqMask];
+                cqHead->store(head + 1, std::memory_order_release);
+                if (cqe.user_data == 0) { stop = true; continue; }
+                complete((Req *)(uintptr_t)cqe.user_data, cqe.res);
+            }
+            if (stop) return;
+        }
+    }
+    void complete(Req *r, int res) {
+        if (res == -EINTR || res == -EAGAIN || (res > 0 && (r->done += res) < r->op.len)) {
+            // the rest of a short read/write (a read of 0 bytes is the end of the file)
+            std::lock_guard<std::mutex> lock(mtx);
+            prepare(r);
+            enter(1);
+            return;
+        }
+        r->op.done(res < 0 ? (ssize_t)res : (ssize_t)r->done);
+        delete r;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            --inflight;
+        }
+        cv.notify_all();
+    }
+
+    int           ringFd=-1;
+    void         *sqRing=nullptr, *cqRing=nullptr;
+    size_t        sqRingSize=0, cqRingSize=0, sqesSize=0;
+    io_uring_sqe *sqes=nullptr;
+    io_uring_cqe *cqes=nullptr;
+    std::atomic<unsigned> *sqTail=nullptr, *cqHead=nullptr, *cqTail=nullptr;
+    unsigned     *sqArray=nullptr;
+    unsigned      sqMask=0, cqMask=0;
+    unsigned      pendingSqes=0;     // prepared, not yet visible to the kernel
+
+    std::mutex    mtx;               // submission queue and inflight
+    std::condition_variable cv;
+    size_t        inflight=0;
+
+    bool          fixed=false;       // the sparse table has been registered
+    std::mutex    bufMtx;
+    std::map<unsigned char*, std::pair<size_t, unsigned>> bufs; // base -> size, slot
+
+    std::thread   reaper;
+};
+
+#else  // no io_uring: init fails, the callers use the blocking calls
+
+class IoRing {
+public:
+    bool init() { return false; }
+    bool addBuffers(unsigned char *, size_t) { return false; }
+    void submit(std::vector<IoOp> &) {}
+    void drain() {}
+};
+
+#endif // IO_URING_AVAILABLE
+
+#endif // _URING_HPP
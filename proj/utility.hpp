@@ -35,9 +35,22 @@
 #include <string>
 #include <stdexcept>
 #include <vector>
+#include <mutex>
+#include <functional>
+#include <condition_variable>
+#include <deque>
+#include <thread>
 
 
 #include <miniz/miniz.h>
+#include <bufferpool.hpp>
+#include <codec.hpp>
+#include <container.hpp>
+#include <dedup.hpp>
+#include <outmap.hpp>
+#include <trace.hpp>
+#include <walker.hpp>
+#include <blocksize.hpp>
 
 
 #define SUFFIX ".zip"
@@ -46,7 +59,12 @@
 // global variables with their default values -------------------------------------------------
 static bool comp = true;                      // by default, it compresses 
 static size_t BIGFILE_LOW_THRESHOLD=2097152;  // 2Mbytes threshold 
+static bool AUTO_BLOCKSIZE=false;            // -t 0, the threshold is picked from the files (see blocksize.hpp)
 static bool REMOVE_ORIGIN=false;              // Does it keep the origin file?
+static int  LEVEL=MZ_DEFAULT_COMPRESSION;       // -L 0..10, deflate level of the Codec
+static int  STRATEGY=MZ_DEFAULT_STRATEGY;      // -Z, deflate strategy of the Codec (see codec.hpp)
+static size_t RESTART_INTERVAL=0;             // -F, bytes between two restart points of a block, 0 none
+static bool DEDUP=false;                      // -H 1, the duplicate blocks of a file are stored once (see dedup.hpp)
 static int  QUITE_MODE=1; 					 // 0 silent, 1 error messages, 2 verbose
 static int  VERBOSE=0;                     	// 0 normal, 1 verbose for debugging
 static bool RECUR= false;                     // do we have to process the contents of subdirs?
@@ -76,6 +94,12 @@ static inline bool mapFile(const char fname[], size_t &size, unsigned char *&ptr
 	}
 	size=s.st_size;
     }
+    // an empty file cannot be mapped, there is nothing to read anyway
+    if (size==0) {
+	close(fd);
+	ptr = nullptr;
+	return true;
+    }
 
     // map all the file in memory
     ptr = (unsigned char *) mmap (0, size, PROT_READ, MAP_PRIVATE, fd, 0);
@@ -89,6 +113,40 @@ static inline bool mapFile(const char fname[], size_t &size, unsigned char *&ptr
     close(fd);
     return true;
 }
+// map only the region [offset, offset+size) of the file open on fd.
+// mmap needs a page-aligned offset, so the mapping starts at the page boundary
+// below offset: base and mapsize describe the whole mapping (to be passed to
+// unmapFile), ptr points to the first byte of the requested region.
+// An empty region is not mapped at all (base and ptr are set to nullptr).
+static inline bool mapRegion(int fd, size_t offset, size_t size,
+			     unsigned char *&base, size_t &mapsize, unsigned char *&ptr) {
+    base = ptr = nullptr; mapsize = 0;
+    if (size==0) return true;
+    TraceSpan span(TR_MAP);
+    span.bytes(size, 0);
+    static const size_t pagesize = sysconf(_SC_PAGESIZE);
+    const size_t delta = offset % pagesize;
+    base = (unsigned char *) mmap (0, size+delta, PROT_READ, MAP_PRIVATE, fd, offset-delta);
+    if (base == MAP_FAILED) {
+	base = nullptr;
+	if (QUITE_MODE>=1) {
+	    perror("mmap");
+	    std::fprintf(stderr, "Failed to memory map region [%ld, %ld)\n", offset, offset+size);
+	}
+	return false;
+    }
+    mapsize = size+delta;
+    ptr     = base+delta;
+    return true;
+}
+// tells the kernel that [ptr, ptr+size) of a mapping is going to be read soon,
+// so that it is read from disk while the caller works on something else
+static inline void prefetchRegion(const unsigned char *ptr, size_t size) {
+    if (ptr == nullptr || size==0) return;
+    static const size_t pagesize = sysconf(_SC_PAGESIZE);
+    const size_t delta = reinterpret_cast<uintptr_t>(ptr) % pagesize;
+    madvise(const_cast<unsigned char*>(ptr) - delta, size+delta, MADV_WILLNEED);
+}
 // unmap a previously memory-mapped file
 static inline void unmapFile(unsigned char *ptr, size_t size) {
     if (munmap(ptr, size)<0) {
@@ -119,6 +177,114 @@ static inline bool writeFile(const std::string &filename, unsigned char *ptr, si
     return true;
 }
 
+// Credit-based backpressure for the streaming mode. The producers acquire
+// credits (bytes of memory) before emitting a block, the consumers give them
+// back once the memory of the block has been released. A request bigger than
+// the whole budget is granted only when nothing else is in flight, so that a
+// single big block cannot deadlock the pipeline.
+struct CreditGate {
+    explicit CreditGate(size_t budget): budget(budget) {}
+
+    void acquire(size_t n) {
+	{
+	    std::unique_lock<std::mutex> lock(mtx);
+	    auto available = [&] { return inflight==0 || inflight+n <= budget; };
+	    if (!available()) {
+		TraceSpan wait(TR_WAIT);
+		cv.wait(lock, available);
+	    }
+	    inflight += n;
+	}
+	traceLevel(TL_CREDITS, n);
+    }
+    // as acquire, but it does not wait: false if n is not available now
+    bool tryAcquire(size_t n) {
+	std::lock_guard<std::mutex> lock(mtx);
+	if (inflight!=0 && inflight+n > budget) return false;
+	inflight += n;
+	traceLevel(TL_CREDITS, n);
+	return true;
+    }
+    void release(size_t n) {
+	{
+	    std::lock_guard<std::mutex> lock(mtx);
+	    inflight -= n;
+	}
+	traceLevel(TL_CREDITS, -(int64_t)n);
+	cv.notify_all();
+    }
+private:
+    const size_t budget;
+    size_t inflight=0;
+    std::mutex mtx;
+    std::condition_variable cv;
+};
+
+// Writer thread of the sequential version: the jobs (writing a block, closing a
+// file) are run in the order they are submitted, while the caller goes on with
+// the next block. At most depth jobs are pending, submit waits for the oldest
+// one otherwise, so depth bounds the memory of the blocks not yet written.
+// A job returns false if it failed (and reports why), drain tells the caller.
+struct AsyncWriter {
+    explicit AsyncWriter(size_t depth=2): depth(depth), th([this] { loop(); }) {}
+    ~AsyncWriter() {
+	drain();
+	{
+	    std::lock_guard<std::mutex> lock(mtx);
+	    stop = true;
+	}
+	cv.notify_all();
+	th.join();
+    }
+    AsyncWriter(const AsyncWriter&) = delete;
+    AsyncWriter& operator=(const AsyncWriter&) = delete;
+
+    void submit(std::function<bool()> job) {
+	std::unique_lock<std::mutex> lock(mtx);
+	if (pending >= depth) {
+	    TraceSpan wait(TR_WAIT);
+	    cv.wait(lock, [&] { return pending < depth; });
+	}
+	jobs.push_back(std::move(job));
+	++pending;
+	traceLevel(TL_WRITES, 1);
+	cv.notify_all();
+    }
+    // waits for all the jobs submitted, false if any of them failed
+    bool drain() {
+	std::unique_lock<std::mutex> lock(mtx);
+	cv.wait(lock, [&] { return pending==0; });
+	const bool r = ok;
+	ok = true;
+	return r;
+    }
+private:
+    void loop() {
+	traceThread("writer");
+	std::unique_lock<std::mutex> lock(mtx);
+	for (;;) {
+	    cv.wait(lock, [&] { return stop || !jobs.empty(); });
+	    if (jobs.empty()) return;
+	    std::function<bool()> job = std::move(jobs.front());
+	    jobs.pop_front();
+	    lock.unlock();
+	    const bool r = job();
+	    lock.lock();
+	    ok = ok && r;
+	    --pending;
+	    traceLevel(TL_WRITES, -1);
+	    cv.notify_all();
+	}
+    }
+    const size_t depth;
+    size_t pending=0;                          // queued + running
+    bool   ok=true, stop=false;
+    std::deque<std::function<bool()>> jobs;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::thread th;                            // last, it uses the members above
+};
+
 // check if dir is '.' or '..'
 static inline bool isdot(const char dir[]) {
   int l = strlen(dir);  
@@ -400,125 +566,6 @@ static inline int decompressFile(const char fname[], size_t infile_size,
 
 
 
-// returns false in case of error
-static inline bool doWork(const char fname[], size_t size, const bool comp) {
-    if (comp) {
-	if (compressFile(fname, size, REMOVE_ORIGIN)<0) return false;
-    } else {
-	if (decompressFile(fname, size, REMOVE_ORIGIN)<0) return false;
-    }
-    return true;
-}
-
-// returns false in case of error
-static inline bool walkDir(const char dname[], const bool comp) {
-    if (chdir(dname) == -1) {
-	if (QUITE_MODE>=1) {
-	    perror("chdir");
-	    std::fprintf(stderr, "Error: chdir %s\n", dname);
-	}
-	return false;
-    }
-    DIR *dir;	
-    if ((dir=opendir(".")) == NULL) {
-	if (QUITE_MODE>=1) {
-	    perror("opendir");
-	    std::fprintf(stderr, "Error: opendir %s\n", dname);
-	}
-	return false;
-    }
-    struct dirent *file;
-    bool error=false;
-    while((errno=0, file =readdir(dir)) != NULL) {
-	struct stat statbuf;
-	if (stat(file->d_name, &statbuf)==-1) {
-	    if (QUITE_MODE>=1) {		
-			perror("stat");
-			std::fprintf(stderr, "Error: stat %s\n", file->d_name);
-	    }
-	    return false;
-	}
-	if(S_ISDIR(statbuf.st_mode)) {
-	    if ( !isdot(file->d_name) ) {
-			if (walkDir(file->d_name, comp)) {
-				if (!chdir("..")) {
-					perror("chdir");
-					std::fprintf(stderr, "Error: chdir ..\n");
-					error = true;
-				}
-			}
-			else error  = true;
-	    }
-	} else {
-	    if (!doWork(file->d_name, statbuf.st_size, comp)) error = true;
-	}
-    }
-    if (errno != 0) {
-	if (QUITE_MODE>=1) perror("readdir");
-	error=true;
-    }
-    closedir(dir);
-    return !error;
-}
-
-/* New stuff */
-
-// given a path returns the number of files in the directory and the total size of the files
-
-static inline bool countFiles(const char dname[], unsigned long long &nfiles, unsigned long long &size) {
-	if (chdir(dname) == -1) {
-	if (QUITE_MODE>=1) {
-	    perror("chdir");
-	    std::fprintf(stderr, "Error: chdir %s\n", dname);
-	}
-	return false;
-	}
-	DIR *dir;	
-	if ((dir=opendir(".")) == NULL) {
-	if (QUITE_MODE>=1) {
-	    perror("opendir");
-	    std::fprintf(stderr, "Error: opendir %s\n", dname);
-	}
-	return false;
-	}
-	struct dirent *file;
-	bool error=false;
-	while((errno=0, file =readdir(dir)) != NULL) {
-	struct stat statbuf;
-	if (stat(file->d_name, &statbuf)==-1) {
-	    if (QUITE_MODE>=1) {		
-			perror("stat");
-			std::fprintf(stderr, "Error: stat %s\n", file->d_name);
-	    }
-	    return false;
-	}
-	if(S_ISDIR(statbuf.st_mode)) {
-	    if ( !isdot(file->d_name) ) {
-			if (!countFiles(file->d_name, nfiles, size)) error = true;
-	    }
-	} else {
-	    nfiles++;
-	    size += statbuf.st_size;
-	}
-	}
-	if (errno != 0) {
-	if (QUITE_MODE>=1) perror("readdir");
-	error=true;
-	}
-	closedir(dir);
-	return !error;
-}
-
-
-struct Partition {
-	unsigned long npart;
-	unsigned char* ptr;
-	size_t size_part;
-	size_t size_uncompressed;
-};
-
-
-
 struct FileData {
     unsigned char* ptr;
     std::string filename;
@@ -531,112 +578,43 @@ struct FileData {
 
 
 
-static inline bool walkDirAndGetPtr(const char dname[], std::vector<FileData>& fileDataVec, const bool comp, std::string relativePath = "") {
-    struct stat statbuf;
-
-    if (stat(dname, &statbuf) == -1) {
-        if (QUITE_MODE >= 1) {
-            perror("stat");
-            std::fprintf(stderr, "Error: stat %s\n", dname);
-        }
-        return false;
-    }
-
-    if (S_ISDIR(statbuf.st_mode)) {
-        // Process as a directory
-        if (chdir(dname) == -1) {
-            if (QUITE_MODE >= 1) {
-                perror("chdir");
-                std::fprintf(stderr, "Error: chdir %s\n", dname);
-            }
-            return false;
-        }
-
-        DIR *dir;
-        if ((dir = opendir(".")) == NULL) {
-            if (QUITE_MODE >= 1) {
-                perror("opendir");
-                std::fprintf(stderr, "Error: opendir %s\n", dname);
-            }
-            return false;
-        }
-
-        struct dirent *file;
-        bool error = false;
-        while ((errno = 0, file = readdir(dir)) != NULL) {
-            if (stat(file->d_name, &statbuf) == -1) {
-                if (QUITE_MODE >= 1) {
-                    perror("stat");
-                    std::fprintf(stderr, "Error: stat %s\n", file->d_name);
-                }
-                return false;
-            }
-
-            if (S_ISDIR(statbuf.st_mode)) {
-                if (!isdot(file->d_name)) {
-                    // Update relative path for the directory
-                    std::string newRelativePath = relativePath + file->d_name + "/";
-                    if (walkDirAndGetPtr(file->d_name, fileDataVec, comp, newRelativePath)) {
-                        if (chdir("..") == -1) {
-                            perror("chdir");
-                            std::fprintf(stderr, "Error: chdir ..\n");
-                            error = true;
-                        }
-                    } else {
-                        error = true;
-                    }
-                }
-            } else {
-                std::string filename = file->d_name;
-                size_t size = statbuf.st_size;
-
-                // Check the file extension
-                bool isZipFile = (filename.size() > 4 && filename.substr(filename.size() - 4) == ".zip");
-
-                // Skip or include based on the 'comp' flag
-                if ((comp && isZipFile) || (!comp && !isZipFile)) {
-                    if (VERBOSE) ::fprintf(stderr, "ignoring %s file %s\n", comp ? "compressed" : "non-compressed", file->d_name);
-                    continue; // Skip if the conditions do not match
-                }
-
-                unsigned char* ptr = nullptr;
-                if (!mapFile(file->d_name, size, ptr)) return false;
-
-                // Create a FileData object with the relative path and store it in the vector
-                fileDataVec.emplace_back(ptr, relativePath + file->d_name, size);
-            }
-        }
-
-        if (errno != 0) {
-            if (QUITE_MODE >= 1) perror("readdir");
-            error = true;
-        }
-
-        closedir(dir);
-        return !error;
-
-    } else {
-        // Process as a single file
-        std::string filename = dname;
-        size_t size = statbuf.st_size;
-
-        // Check the file extension
-        bool isZipFile = (filename.size() > 4 && filename.substr(filename.size() - 4) == ".zip");
-
-        // Skip or include based on the 'comp' flag
-        if ((comp && isZipFile) || (!comp && !isZipFile)) {
-            std::fprintf(stderr, "ignoring %s file %s\n", comp ? "compressed" : "non-compressed", dname);
-            return true; // Skip if the conditions do not match
+// scans dname with the parallel walker (see walker.hpp) and calls found for every file
+// to compress (comp) or to decompress, as soon as it is found and from the walker
+// threads, so found has to be thread-safe.
+// If lazy is true the files are not mapped in memory (ptr is left to nullptr),
+// it is up to the consumer to map them (or part of them) when needed
+static inline bool walkDirAndStream(const char dname[], const bool comp, const bool lazy,
+                                    const std::function<void(const FileData&)> &found) {
+    Walker walker;
+    return walker.walk(dname, [&](const WalkEntry &e) {
+        if (discardIt(e.path.c_str(), comp)) {
+            if (VERBOSE) std::fprintf(stderr, "ignoring %s file %s\n", comp ? "compressed" : "non-compressed", e.path.c_str());
+            return true;
         }
-
+        size_t size = e.size;
         unsigned char* ptr = nullptr;
-        if (!mapFile(dname, size, ptr)) return false;
-
-        // Create a FileData object with the relative path and store it in the vector
-        fileDataVec.emplace_back(ptr, relativePath + dname, size);
-
+        if (!lazy) {
+            TraceSpan span(TR_MAP);
+            span.bytes(size, 0);
+            if (!mapFile(e.path.c_str(), size, ptr)) return false;
+        }
+        found(FileData(ptr, e.path, size));
         return true;
-    }
+    });
+}
+
+// all the files of dname at once, sorted by name
+static inline bool walkDirAndGetPtr(const char dname[], std::vector<FileData>& fileDataVec, const bool comp, const bool lazy = false) {
+    std::mutex mtx;
+    const bool ok = walkDirAndStream(dname, comp, lazy, [&](const FileData &file) {
+        std::lock_guard<std::mutex> lock(mtx);
+        fileDataVec.push_back(file);
+    });
+    // the walker finds the files in no particular order
+    std::sort(fileDataVec.begin(), fileDataVec.end(), [](const FileData &a, const FileData &b) {
+        return a.filename < b.filename;
+    });
+    return ok;
 }
 
 
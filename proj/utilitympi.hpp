@@ -9,6 +9,7 @@
 #include <cstdlib>
 #include <cstdio>
 #include <cstring>
+#include <cstddef>
 #include <dirent.h>
 
 #include <ftw.h>
@@ -17,7 +18,8 @@
 #include <string>
 #include <stdexcept>
 #include <vector>
-#include <fstream>
+#include <mutex>
+#include <unordered_map>
 #include <iostream>
 
 #include <cmath> 
@@ -29,6 +31,14 @@
 
 
 #include <miniz/miniz.h>
+#include <bufferpool.hpp>
+#include <codec.hpp>
+#include <container.hpp>
+#include <dedup.hpp>
+#include <outmap.hpp>
+#include <trace.hpp>
+#include <walker.hpp>
+#include <blocksize.hpp>
 
 
 #define SUFFIX ".zip"
@@ -37,10 +47,17 @@
 // global variables with their default values -------------------------------------------------
 static bool comp = true;                      // by default, it compresses 
 static size_t BIGFILE_LOW_THRESHOLD=2097152;  // 2Mbytes threshold 
+static bool AUTO_BLOCKSIZE=false;            // -t 0, the threshold is picked from the files (see blocksize.hpp)
 static bool REMOVE_ORIGIN=false;              // Does it keep the origin file?
+static int  LEVEL=MZ_DEFAULT_COMPRESSION;       // -L 0..10, deflate level of the Codec
+static int  STRATEGY=MZ_DEFAULT_STRATEGY;      // -Z, deflate strategy of the Codec (see codec.hpp)
+static size_t RESTART_INTERVAL=0;             // -F, bytes between two restart points of a block, 0 none
+static bool DEDUP=false;                      // -H 1, the duplicate blocks of a file are stored once (see dedup.hpp)
 static int  QUITE_MODE=1; 					 // 0 silent, 1 error messages, 2 verbose
 static int  VERBOSE=0;                     	// 0 normal, 1 verbose for debugging
 static bool RECUR= false;                     // do we have to process the contents of subdirs?
+static bool MPIIO_MODE=false;                 // the ranks read/write the files themselves with MPI-IO
+static int  ONDEMAND=0;                       // >0 on-demand scheduling, blocks in flight per worker (mainmpirr)
 // --------------------------------------------------------------------------------------------
 
 // map the file pointed by filepath in memory
@@ -67,6 +84,12 @@ static inline bool mapFile(const char fname[], size_t &size, unsigned char *&ptr
 	}
 	size=s.st_size;
     }
+    // an empty file cannot be mapped, there is nothing to read anyway
+    if (size==0) {
+	close(fd);
+	ptr = nullptr;
+	return true;
+    }
 
     // map all the file in memory
     ptr = (unsigned char *) mmap (0, size, PROT_READ, MAP_PRIVATE, fd, 0);
@@ -110,29 +133,15 @@ static bool isNumber(const char* s, long &n) {
 }
 
 
-// Function to read the file content into a vector
-bool readFile(const std::string& filename, std::vector<unsigned char>& buffer) {
-    std::ifstream file(filename, std::ios::binary | std::ios::ate);
-    if (!file) return false;
-
-    std::streamsize size = file.tellg();
-    file.seekg(0, std::ios::beg);
-
-    buffer.resize(size);
-    if (!file.read(reinterpret_cast<char*>(buffer.data()), size)) {
-        return false;
-    }
-    return true;
-}
-
+// the content of the file is mapped in memory (ptr), it is unmapped by the main at the end
 struct FileData {
     char filename[256];
     size_t size;
-    std::vector<unsigned char> data;
+    unsigned char *ptr;
 
     // Constructor for easy initialization
-    FileData(const char* fname, size_t s, std::vector<unsigned char> d) 
-        : size(s), data(std::move(d)) {
+    FileData(const char* fname, size_t s, unsigned char *p) 
+        : size(s), ptr(p) {
         // Copy filename with a limit to ensure it doesn't exceed 255 characters
         std::strncpy(filename, fname, sizeof(filename) - 1);
         // Ensure null-termination
@@ -142,141 +151,118 @@ struct FileData {
 
 
 
-static inline bool walkDirAndGetFiles(const char dname[], std::vector<FileData>& fileDataVec, const bool comp, std::string relativePath = "") {
-    struct stat statbuf;
-
-    if (stat(dname, &statbuf) == -1) {
-        if (QUITE_MODE >= 1) {
-            perror("stat");
-            std::fprintf(stderr, "Error: stat %s\n", dname);
-        }
-        return false;
-    }
-
-    if (S_ISDIR(statbuf.st_mode)) {
-        // Process as a directory
-        if (chdir(dname) == -1) {
-            if (QUITE_MODE >= 1) {
-                perror("chdir");
-                std::fprintf(stderr, "Error: chdir %s\n", dname);
-            }
-            return false;
-        }
-
-        DIR* dir;
-        if ((dir = opendir(".")) == NULL) {
-            if (QUITE_MODE >= 1) {
-                perror("opendir");
-                std::fprintf(stderr, "Error: opendir %s\n", dname);
-            }
-            return false;
-        }
-
-        struct dirent* file;
-        bool error = false;
-        while ((errno = 0, file = readdir(dir)) != NULL) {
-            if (stat(file->d_name, &statbuf) == -1) {
-                if (QUITE_MODE >= 1) {
-                    perror("stat");
-                    std::fprintf(stderr, "Error: stat %s\n", file->d_name);
-                }
-                return false;
-            }
-
-            if (S_ISDIR(statbuf.st_mode)) {
-                if (!isdot(file->d_name)) {
-                    // Update relative path for the directory
-                    std::string newRelativePath = relativePath + file->d_name + "/";
-                    if (walkDirAndGetFiles(file->d_name, fileDataVec, comp, newRelativePath)) {
-                        if (chdir("..") == -1) {
-                            perror("chdir");
-                            std::fprintf(stderr, "Error: chdir ..\n");
-                            error = true;
-                        }
-                    } else {
-                        error = true;
-                    }
-                }
-            } else {
-                std::string filename = file->d_name;
-                size_t size = statbuf.st_size;
-
-                // Check the file extension
-                bool isZipFile = (filename.size() > 4 && filename.substr(filename.size() - 4) == ".zip");
-
-                // Skip or include based on the 'comp' flag
-                if ((comp && isZipFile) || (!comp && !isZipFile)) {
-                    if (QUITE_MODE>1) std::fprintf(stderr, "ignoring %s file %s\n", comp ? "compressed" : "non-compressed", file->d_name);
-                    continue; // Skip if the conditions do not match
-                }
-
-                std::vector<unsigned char> data;
-                if (!readFile(file->d_name, data)) return false;
-
-                // Create a FileData object with the new order and store it in the vector
-                fileDataVec.emplace_back((relativePath + file->d_name).c_str(), size, std::move(data));
-            }
-        }
-
-        if (errno != 0) {
-            if (QUITE_MODE >= 1) perror("readdir");
-            error = true;
-        }
-
-        closedir(dir);
-        return !error;
-
-    } else {
-        // Process as a single file
-        std::string filename = dname;
-        size_t size = statbuf.st_size;
-
+// scans dname with the parallel walker (see walker.hpp), the files are sorted by name;
+// if lazy is true the files are not mapped in memory (ptr is left to nullptr)
+static inline bool walkDirAndGetFiles(const char dname[], std::vector<FileData>& fileDataVec, const bool comp, const bool lazy = false) {
+    std::mutex mtx;
+    Walker walker;
+    const bool ok = walker.walk(dname, [&](const WalkEntry &e) {
         // Check the file extension
+        const std::string &filename = e.path;
         bool isZipFile = (filename.size() > 4 && filename.substr(filename.size() - 4) == ".zip");
 
         // Skip or include based on the 'comp' flag
         if ((comp && isZipFile) || (!comp && !isZipFile)) {
-           if(QUITE_MODE>1) std::fprintf(stderr, "ignoring %s file %s\n", comp ? "compressed" : "non-compressed", dname);
+            if (QUITE_MODE>1) std::fprintf(stderr, "ignoring %s file %s\n", comp ? "compressed" : "non-compressed", filename.c_str());
             return true; // Skip if the conditions do not match
         }
 
-        std::vector<unsigned char> data;
-        if (!readFile(dname, data)) return false;
-
-        // Create a FileData object with the new order and store it in the vector
-        fileDataVec.emplace_back((relativePath + dname).c_str(), size, std::move(data));
+        size_t size = e.size;
+        unsigned char* ptr = nullptr;
+        if (!lazy) {
+            TraceSpan span(TR_MAP);
+            span.bytes(size, 0);
+            if (!mapFile(filename.c_str(), size, ptr)) return false;
+        }
 
+        std::lock_guard<std::mutex> lock(mtx);
+        fileDataVec.emplace_back(filename.c_str(), size, ptr);
         return true;
-    }
+    });
+    // the walker finds the files in no particular order
+    std::sort(fileDataVec.begin(), fileDataVec.end(), [](const FileData &a, const FileData &b) {
+        return std::strcmp(a.filename, b.filename) < 0;
+    });
+    return ok;
+}
+
+
+
+// -t 0: the main process has picked the block size (autoBlockSize), it is sent to
+// the other processes and every process resizes its pool of block buffers
+static inline void shareBlockSize(BufferPool &pool) {
+    if (!comp || !AUTO_BLOCKSIZE) return;
+    uint64_t blockSize = BIGFILE_LOW_THRESHOLD;
+    MPI_Bcast(&blockSize, 1, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+    BIGFILE_LOW_THRESHOLD = blockSize;
+    pool.reset(compressBound(BIGFILE_LOW_THRESHOLD));
 }
 
 
 
+// How the blocks are split among the processes. Only numFiles (the total number of
+// blocks) is broadcast, O(log P); every process computes the counts and the
+// displacements by itself, so there is no limit on the number of processes.
 struct InitialHeader {
-    int numFiles;
-    int sendCounts[128]; // Adjust size if needed, or dynamically allocate.
-    int displs[128];     // Adjust size if needed, or dynamically allocate.
+    int numFiles = 0;
+    std::vector<int> sendCounts;
+    std::vector<int> displs;
+
+    // contiguous split of numFiles among the processes [first, size), the counts differ
+    // at most by one; the processes before first get nothing
+    void split(int size, int first) {
+        const int workers   = size - first;
+        const int base      = numFiles / workers;
+        const int remainder = numFiles % workers;
+        sendCounts.assign(size, 0);
+        displs.assign(size, 0);
+        for (int i = first; i < size; ++i) {
+            sendCounts[i] = base + ((i - first) < remainder ? 1 : 0);
+            displs[i] = (i > first) ? (displs[i - 1] + sendCounts[i - 1]) : 0;
+        }
+    }
 };
 
 
-MPI_Datatype createIHeaderDataType(int size) {
-    MPI_Datatype new_Type;
-    MPI_Datatype old_types[3] = { MPI_INT, MPI_INT, MPI_INT };
-    int blocklen[3] = { 1, size, size };
 
-    MPI_Aint offsets[3];
-    offsets[0] = offsetof(InitialHeader, numFiles);
-    offsets[1] = offsetof(InitialHeader, sendCounts);
-    offsets[2] = offsetof(InitialHeader, displs);
+// a block (or small file) handed to a process, and its result
+struct FileData_test {
+        char filename[256];
+        size_t size;
+        size_t nblock = 1;
+        size_t blockid = 0;
+        size_t fileIndex = -1;
+        size_t lastblocksize = 0;
+        size_t offset = 0;
+        size_t rawsize = 0;     // uncompressed size of the block
+        size_t crc = 0;         // checksum of the compressed block
+        size_t flags = 0;       // BLOCK_STORED if the block is not compressed
+};
 
-    MPI_Type_create_struct(3, blocklen, offsets, old_types, &new_Type);
+// the MPI datatype of FileData_test, to be freed with MPI_Type_free
+static inline MPI_Datatype createFileDataType() {
+    MPI_Datatype new_Type;
+    MPI_Datatype old_types[10] = { MPI_CHAR, MPI_UNSIGNED_LONG, MPI_UNSIGNED_LONG, MPI_UNSIGNED_LONG, MPI_UNSIGNED_LONG, MPI_UNSIGNED_LONG, MPI_UNSIGNED_LONG, MPI_UNSIGNED_LONG, MPI_UNSIGNED_LONG, MPI_UNSIGNED_LONG };
+    int blocklen[10] = { 256, 1, 1, 1, 1, 1, 1, 1, 1, 1};
+
+    MPI_Aint offsets[10];
+    offsets[0] = offsetof(FileData_test, filename);
+    offsets[1] = offsetof(FileData_test, size);
+    offsets[2] = offsetof(FileData_test, nblock);
+    offsets[3] = offsetof(FileData_test, blockid);
+    offsets[4] = offsetof(FileData_test, fileIndex);
+    offsets[5] = offsetof(FileData_test, lastblocksize);
+    offsets[6] = offsetof(FileData_test, offset);
+    offsets[7] = offsetof(FileData_test, rawsize);
+    offsets[8] = offsetof(FileData_test, crc);
+    offsets[9] = offsetof(FileData_test, flags);
+
+    MPI_Type_create_struct(10, blocklen, offsets, old_types, &new_Type);
     MPI_Type_commit(&new_Type);
 
     return new_Type;
 }
 
-
-
 struct ReceiveFiles {
     char filename[256];
     size_t size;
@@ -284,84 +270,211 @@ struct ReceiveFiles {
 	unsigned char* myData = nullptr;
 };
 
-bool decompressBlock(unsigned char* input, size_t inputSize, unsigned char* output, size_t& outputSize) {
-		int err;
-		if ((err = uncompress(output, &outputSize, input, inputSize)) != Z_OK) {
-			std::cerr << "Failed to decompress block, error: " << err << std::endl;
-			return false;
-		}
-		return true;
-	}
-
 struct DataRec {
     char filename[256];
     size_t size;
     size_t nblock = 1;
     size_t blockid = 0;
     size_t lastblocksize = 0;
+    size_t rawsize = 0;     // uncompressed size of the block
+    size_t crc = 0;         // checksum of the compressed block
+    size_t flags = 0;       // BLOCK_STORED if the block is not compressed
     std::vector<unsigned char*> recDataVec;
 
 };
 
-bool mergeAndZip(const std::vector<DataRec>& dataRecVec, const size_t lastblocksize) {
-    std::string outfiles = dataRecVec[0].filename;
-    std::string outfile = outfiles + SUFFIX;
-    std::ofstream outFile(outfile, std::ios::binary);
-
-    if (!outFile.is_open()) {
-        std::cerr << "Failed to open output file: " << outfile << std::endl;
-        return false;
+// -H 1, main process: the big files with duplicate blocks. For each block of the
+// file, the blockid of the block sent to be compressed in its place (see splitBlocks)
+static std::unordered_map<std::string, std::vector<size_t>> dedupLayouts;
+
+// main process, compression: the blocks of the big file f (fileIndex idx) are
+// added to tasks, offset is their position in the file. With -H 1 a block equal
+// to an earlier one of the file is left out, it is not even sent: the blocks are
+// numbered in the order they first appear and mergeAndZip puts the copies back.
+template <typename Block>
+static inline void splitBlocks(const FileData &f, size_t idx, std::vector<Block> &tasks) {
+    const size_t B = BIGFILE_LOW_THRESHOLD;
+    const size_t nblocks = (f.size + B - 1) / B;
+    const size_t first = tasks.size();
+    std::vector<size_t> layout(nblocks);
+    BlockDedup dedup;
+    size_t unique = 0;
+    for (size_t i = 0; i < nblocks; ++i) {
+        const size_t len = std::min(B, f.size - i * B);
+        if (DEDUP) {
+            const size_t dup = dedup.find(i, f.ptr + i * B, len);
+            dedupStats.addBlock(len, dup != BlockDedup::NONE);
+            if (dup != BlockDedup::NONE) {
+                layout[i] = layout[dup];
+                continue;
+            }
+        }
+        layout[i] = ++unique;
+        Block fdt;
+        std::memcpy(fdt.filename, f.filename, sizeof(fdt.filename) - 1);
+        fdt.filename[sizeof(fdt.filename) - 1] = '\0';
+        fdt.size = len;
+        fdt.rawsize = len;
+        fdt.blockid = unique;
+        fdt.fileIndex = idx;
+        fdt.offset = i * B;
+        fdt.lastblocksize = f.size - (nblocks - 1) * B;
+        tasks.push_back(fdt);
     }
-    //write the number of blocks
-    size_t numBlocks = dataRecVec[0].nblock;
-    outFile.write(reinterpret_cast<const char*>(&numBlocks), sizeof(size_t));
+    for (size_t k = first; k < tasks.size(); ++k) tasks[k].nblock = unique;
+    if (unique < nblocks) dedupLayouts[f.filename] = std::move(layout);
+}
 
-    //for each block, write the size of the block
-    for (size_t i = 0; i < numBlocks; i++) {
-        size_t size = dataRecVec[i].size;
-        outFile.write(reinterpret_cast<const char*>(&size), sizeof(size_t));
-    }
-    //write last block size for decompression
-    outFile.write(reinterpret_cast<const char*>(&lastblocksize), sizeof(size_t));
+// -H 1: the main process prints what has been saved, with the compression time
+// of all the processes
+static inline void reportDedup(int myrank) {
+    if (!DEDUP || !comp) return;
+    uint64_t mine[2] = { dedupStats.encodeNs.load(), dedupStats.encoded.load() }, all[2] = { 0, 0 };
+    MPI_Reduce(mine, all, 2, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+    if (myrank) return;
+    dedupStats.encodeNs = all[0];
+    dedupStats.encoded  = all[1];
+    dedupStats.print();
+}
 
-    //write all the data
-    for (size_t i = 0; i < numBlocks; i++) {
-        outFile.write(reinterpret_cast<const char*>(dataRecVec[i].recDataVec[0]), dataRecVec[i].size);
+// -T: every rank writes its events to <file>.<rank>, the main process prints
+// the stages summed over all the ranks and how each rank spent its time
+static inline void reportTrace(int myrank, int size) {
+    if (!TRACE) return;
+    traceWrite(TRACE_FILE + "." + std::to_string(myrank), myrank);
+    TraceStats tot[TR_STAGES];
+    traceTotals(tot);
+    uint64_t mine[TR_STAGES * 4], all[TR_STAGES * 4];
+    for (int s = 0; s < TR_STAGES; ++s) {
+        mine[4 * s]     = tot[s].count;
+        mine[4 * s + 1] = tot[s].ns;
+        mine[4 * s + 2] = tot[s].in;
+        mine[4 * s + 3] = tot[s].out;
     }
-
-    outFile.close();
-    if (REMOVE_ORIGIN) {
-        unlink(outfiles.c_str());
+    MPI_Reduce(mine, all, TR_STAGES * 4, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+    // the threads of a rank are summed up
+    uint64_t times[3] = { 0, 0, 0 };
+    {
+        std::lock_guard<std::mutex> lock(traceMtx);
+        for (auto &b : traceBuffers) {
+            uint64_t busy, blocked, idle;
+            traceTimes(*b, busy, blocked, idle);
+            times[0] += busy;
+            times[1] += blocked;
+            times[2] += idle;
+        }
     }
-
-    outFile.close();
-    return true;
-
+    std::vector<uint64_t> ranks(myrank ? 0 : 3 * size);
+    MPI_Gather(times, 3, MPI_UINT64_T, ranks.data(), 3, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+    if (myrank) return;
+    for (int s = 0; s < TR_STAGES; ++s)
+        tot[s] = TraceStats{ all[4 * s], all[4 * s + 1], all[4 * s + 2], all[4 * s + 3] };
+    tracePrintStages(tot);
+    tracePrintTimesHeader("rank");
+    for (int r = 0; r < size; ++r)
+        tracePrintTimes("rank " + std::to_string(r), ranks[3 * r], ranks[3 * r + 1], ranks[3 * r + 2]);
 }
 
-bool mergeAndWrite(const std::vector<DataRec>& dataRecVec) {
+// the blocks have to be sorted by blockid
+bool mergeAndZip(const std::vector<DataRec>& dataRecVec) {
     std::string outfiles = dataRecVec[0].filename;
-    std::string outfile = outfiles.substr(0, outfiles.size() - 4);
+    std::string outfile = outfiles + SUFFIX;
+    TraceSpan span(TR_MERGE);
 
-    std::ofstream outFile(outfile, std::ios::binary);
-	if (!outFile.is_open()) {
-        std::cerr << "Failed to open output file: " << outfile << std::endl;
-        return false;
-	}
-    size_t numBlocks = dataRecVec[0].nblock;
+    ContainerWriter writer;
+    if (!writer.open(outfile, BIGFILE_LOW_THRESHOLD)) return false;
 
-    for (size_t i = 0; i < numBlocks; i++) {
-        outFile.write(reinterpret_cast<const char*>(dataRecVec[i].recDataVec[0]), dataRecVec[i].size);
+    //write all the data, the index of the blocks is written by close
+    size_t numBlocks = dataRecVec[0].nblock;
+    auto layout = dedupLayouts.find(outfiles);
+    if (layout == dedupLayouts.end()) {
+        for (size_t i = 0; i < numBlocks; i++) {
+            if (!writer.append(dataRecVec[i].recDataVec[0], dataRecVec[i].size, dataRecVec[i].rawsize, dataRecVec[i].crc, dataRecVec[i].flags)) {
+                std::cerr << "Failed to write output file: " << outfile << std::endl;
+                return false;
+            }
+        }
+    } else {
+        // -H 1: a copy repeats the entries of the block where the content first appears
+        std::vector<size_t> firstAt(numBlocks);
+        size_t next = 1;
+        for (size_t b = 0; b < layout->second.size(); ++b) {
+            const size_t i = layout->second[b] - 1;
+            bool ok;
+            if (i + 1 == next) {
+                ok = writer.append(dataRecVec[i].recDataVec[0], dataRecVec[i].size, dataRecVec[i].rawsize, dataRecVec[i].crc, dataRecVec[i].flags);
+                firstAt[i] = b;
+                ++next;
+            } else {
+                ok = writer.duplicate(firstAt[i]);
+            }
+            if (!ok) {
+                std::cerr << "Failed to write output file: " << outfile << std::endl;
+                return false;
+            }
+        }
+        dedupLayouts.erase(layout);
+    }
+    if (!writer.close()) {
+        std::cerr << "Failed to write output file: " << outfile << std::endl;
+        return false;
     }
 
     if (REMOVE_ORIGIN) {
         unlink(outfiles.c_str());
     }
-    outFile.close();
-
     return true;
 
 }
+
+// decompression, main process: the outputs of the archives. Each one is created
+// with its final size and mapped (see outmap.hpp) when the first of its blocks
+// arrives, the blocks are decompressed or received straight at their position
+// and the last one closes the file: no buffer and no copy on the main process.
+class OutputFiles {
+public:
+    // archive idx (the fileIndex of its blocks), while its blocks are listed
+    void add(size_t idx, const char *archive, const ContainerReader &reader) {
+        if (outs.size() <= idx) outs.resize(idx + 1);
+        Out &o = outs[idx];
+        o.archive = archive;
+        o.rawSize = reader.rawSize();
+        o.left    = reader.nblocks();
+        o.starts.resize(reader.nblocks());
+        for (size_t i = 0; i < reader.nblocks(); ++i) o.starts[i] = reader.rawOffset(i);
+    }
+    // where block blockid (from 1) of archive idx goes, false if the output cannot be created
+    bool block(size_t idx, size_t blockid, unsigned char *&dst) {
+        Out &o = outs[idx];
+        if (o.fd < 0 && !mapOutputFile(o.archive.substr(0, o.archive.size() - 4), o.rawSize, o.fd, o.ptr))
+            return false;
+        dst = o.ptr + o.starts[blockid - 1];
+        return true;
+    }
+    // a block of archive idx is in place, the last one closes the output
+    bool done(size_t idx) {
+        Out &o = outs[idx];
+        if (--o.left) return true;
+        TraceSpan span(TR_WRITE);
+        span.bytes(0, o.rawSize);
+        const bool ok = unmapOutputFile(o.fd, o.ptr, o.rawSize);
+        if (!ok) std::cerr << "Failed to write output file: " << o.archive.substr(0, o.archive.size() - 4) << std::endl;
+        else if (REMOVE_ORIGIN) unlink(o.archive.c_str());
+        o = Out();
+        return ok;
+    }
+
+private:
+    struct Out {
+        std::string           archive;
+        size_t                rawSize = 0;
+        size_t                left = 0;       // blocks not in place yet
+        std::vector<uint64_t> starts;         // uncompressed offset of each block
+        int                   fd = -1;
+        unsigned char        *ptr = nullptr;
+    };
+    std::vector<Out> outs;
+};
     
 
 #endif 
\ No newline at end of file
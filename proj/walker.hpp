@@ -0,0 +1,238 @@
+/*
+ * Directory walker with a few threads stealing directories from each other.
+ * The scan is over when no directory is queued or being read (pending == 0).
+ *
+ * The old walkers recursed with chdir/opendir/stat on the main thread before
+ * any compression could start. Here:
+ *
+ *  -   The directories are read by a few threads, each with its own deque of
+ *      directories still to read: a thread takes the last directory it pushed
+ *      and, when it runs out, steals the oldest one of another thread.
+ *  -   Directories are opened with openat on the fd of the root, read with
+ *      getdents64 and their entries are checked with fstatat: no chdir, so the
+ *      threads do not interfere with each other.
+ *  -   Every regular file found is passed to the visit callback as soon as it
+ *      is found, so the consumers can start working while the scan goes on
+ *      (see ScanQueue).
+ *
+ * As the old walkers did, walking a directory moves the process in it (once,
+ * before the scan): the paths given to visit are relative to it.
+ */
+
+#if !defined _WALKER_HPP
+#define _WALKER_HPP
+
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <trace.hpp>
+
+// a file found by the walker, passed to the visit callback
+struct WalkEntry {
+    std::string path;       // relative to the directory walked (or the file given)
+    size_t      size;
+};
+
+class Walker {
+public:
+    // called concurrently by the walker threads; returning false makes walk fail
+    using Visit = std::function<bool(const WalkEntry&)>;
+
+    explicit Walker(size_t nthreads = defaultThreads()) : nthreads(std::max<size_t>(1, nthreads)) {}
+
+    static size_t defaultThreads() {
+        return std::min(8u, std::max(1u, std::thread::hardware_concurrency()));
+    }
+
+    // walks dname, a directory or a single file; false if something went wrong
+    // (the scan goes on anyway, the files found are still visited)
+    bool walk(const char dname[], const Visit &visit) {
+        struct stat statbuf;
+        if (stat(dname, &statbuf) == -1) {
+            perror("stat");
+            std::fprintf(stderr, "Error: stat %s\n", dname);
+            return false;
+        }
+        if (!S_ISDIR(statbuf.st_mode))
+            return visit(WalkEntry{dname, (size_t)statbuf.st_size});
+
+        if (chdir(dname) == -1) {
+            perror("chdir");
+            std::fprintf(stderr, "Error: chdir %s\n", dname);
+            return false;
+        }
+        rootfd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (rootfd < 0) {
+            perror("open");
+            std::fprintf(stderr, "Error: opendir %s\n", dname);
+            return false;
+        }
+        failed = false;
+        queues = std::vector<Queue>(nthreads);
+        pending = 1;
+        queues[0].dirs.push_back("");
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < nthreads; ++i)
+            threads.emplace_back([this, i, &visit] { worker(i, visit); });
+        for (auto &t : threads) t.join();
+        close(rootfd);
+        rootfd = -1;
+        return !failed;
+    }
+
+private:
+    struct Queue {
+        std::mutex              mtx;
+        std::deque<std::string> dirs;   // relative to the root, "" is the root itself
+    };
+
+    // the layout of the records returned by getdents64
+    struct LinuxDirent64 {
+        ino64_t        d_ino;
+        off64_t        d_off;
+        unsigned short d_reclen;
+        unsigned char  d_type;
+        char           d_name[];
+    };
+
+    void push(size_t id, std::string dir) {
+        ++pending;
+        std::lock_guard<std::mutex> lock(queues[id].mtx);
+        queues[id].dirs.push_back(std::move(dir));
+    }
+    // my newest directory, or the oldest one of another thread
+    bool take(size_t id, std::string &dir) {
+        for (size_t k = 0; k < nthreads; ++k) {
+            Queue &q = queues[(id + k) % nthreads];
+            std::lock_guard<std::mutex> lock(q.mtx);
+            if (q.dirs.empty()) continue;
+            if (k == 0) { dir = std::move(q.dirs.back());  q.dirs.pop_back(); }
+            else        { dir = std::move(q.dirs.front()); q.dirs.pop_front(); }
+            return true;
+        }
+        return false;
+    }
+    void worker(size_t id, const Visit &visit) {
+        traceThread("walker", id);
+        std::string dir;
+        // pending counts the directories queued or being read: when it drops
+        // to zero nobody can push new ones any more
+        while (pending.load() > 0) {
+            if (!take(id, dir)) {
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+                continue;
+            }
+            readDir(id, dir, visit);
+            --pending;
+        }
+    }
+    void readDir(size_t id, const std::string &dir, const Visit &visit) {
+        TraceSpan span(TR_SCAN);
+        int fd = dir.empty() ? dup(rootfd) : openat(rootfd, dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+            perror("openat");
+            std::fprintf(stderr, "Error: opendir %s\n", dir.c_str());
+            failed = true;
+            return;
+        }
+        alignas(LinuxDirent64) char buf[32768];
+        for (;;) {
+            long n = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                perror("getdents64");
+                failed = true;
+                break;
+            }
+            if (n == 0) break;
+            for (long pos = 0; pos < n; ) {
+                const LinuxDirent64 *d = reinterpret_cast<const LinuxDirent64*>(buf + pos);
+                pos += d->d_reclen;
+                const char *name = d->d_name;
+                if (!std::strcmp(name, ".") || !std::strcmp(name, "..")) continue;
+                const std::string path = dir.empty() ? name : dir + "/" + name;
+                // the type is usually in the record, the size never is;
+                // symbolic links are followed, as stat does
+                if (d->d_type == DT_DIR) {
+                    push(id, path);
+                    continue;
+                }
+                struct stat statbuf;
+                if (fstatat(fd, name, &statbuf, 0) == -1) {
+                    perror("fstatat");
+                    std::fprintf(stderr, "Error: stat %s\n", path.c_str());
+                    failed = true;
+                    continue;
+                }
+                if (S_ISDIR(statbuf.st_mode)) push(id, path);
+                else if (S_ISREG(statbuf.st_mode) && !visit(WalkEntry{path, (size_t)statbuf.st_size}))
+                    failed = true;
+            }
+        }
+        close(fd);
+    }
+
+    const size_t        nthreads;
+    int                 rootfd = -1;
+    std::vector<Queue>  queues;
+    std::atomic<size_t> pending{0};
+    std::atomic<bool>   failed{false};
+};
+
+// Unbounded queue between the walker (or any producer) and the consumers:
+// pop blocks until there is an item, false once the queue is closed and empty.
+template <typename T>
+class ScanQueue {
+public:
+    void push(T item) {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            items.push_back(std::move(item));
+        }
+        traceLevel(TL_FILES, 1);
+        cv.notify_one();
+    }
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            closed = true;
+        }
+        cv.notify_all();
+    }
+    bool pop(T &item) {
+        std::unique_lock<std::mutex> lock(mtx);
+        if (!closed && items.empty()) {
+            TraceSpan wait(TR_WAIT);
+            cv.wait(lock, [this] { return closed || !items.empty(); });
+        }
+        if (items.empty()) return false;
+        item = std::move(items.front());
+        items.pop_front();
+        lock.unlock();
+        traceLevel(TL_FILES, -1);
+        return true;
+    }
+
+private:
+    std::mutex              mtx;
+    std::condition_variable cv;
+    std::deque<T>           items;
+    bool                    closed = false;
+};
+
+#endif // _WALKER_HPP